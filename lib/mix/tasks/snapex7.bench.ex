@@ -0,0 +1,233 @@
+defmodule Mix.Tasks.Snapex7.Bench do
+  use Mix.Task
+
+  @shortdoc "Benchmarks Snapex7.Client commands against a local snap7 server"
+
+  @moduledoc """
+  Reports p50/p99 latency and ops/sec for the main client commands, for every
+  payload size and concurrency level (callers sharing one `Snapex7.Client`).
+
+  Unless `--ip` is given, a loopback `Snapex7.Server` is started so the numbers
+  only depend on the erlcmd/ei path and the snap7 stack.
+
+      mix snapex7.bench
+      mix snapex7.bench --sizes 4,64,512 --concurrency 1,8 --duration 2000
+      mix snapex7.bench --commands db_read,read_area --ip 192.168.0.1
+      mix snapex7.bench --native
+
+  The following options are available:
+
+    * `--ip` - PLC address, a loopback server is used when missing.
+
+    * `--port` - TCP port of the PLC/loopback server (default 10102).
+
+    * `--duration` - milliseconds spent on every case (default 1000).
+
+    * `--sizes` - payload sizes in bytes (default 4,64,512,4096).
+
+    * `--concurrency` - amount of concurrent callers (default 1,4,16).
+
+    * `--commands` - subset of db_read, read_area, read_multi_vars,
+      write_multi_vars, full_upload and db_get. The last two need a PLC (`--ip`),
+      a snap7 server can't serve uploads and they are skipped against the loopback.
+
+    * `--native` - runs `s7_bench.o` instead, the same cases straight on the
+      snap7 C API (concurrency maps to threads), useful to tell the port overhead apart.
+  """
+
+  @commands [:db_read, :read_area, :read_multi_vars, :write_multi_vars, :full_upload, :db_get]
+  @uploads [:full_upload, :db_get]
+
+  @switches [
+    ip: :string,
+    port: :integer,
+    duration: :integer,
+    sizes: :string,
+    concurrency: :string,
+    commands: :string,
+    native: :boolean
+  ]
+
+  @n_multi_vars 4
+
+  @impl Mix.Task
+  def run(args) do
+    {opts, _, _} = OptionParser.parse(args, strict: @switches)
+    Mix.Task.run("app.start")
+
+    if Keyword.get(opts, :native, false) do
+      run_native(opts)
+    else
+      run_port(opts)
+    end
+  end
+
+  defp run_native(opts) do
+    priv = :code.priv_dir(:snapex7) |> List.to_string()
+
+    args =
+      [
+        ip: opts[:ip],
+        port: opts[:port],
+        duration: opts[:duration],
+        sizes: opts[:sizes],
+        threads: opts[:concurrency]
+      ]
+      |> Enum.reject(fn {_key, value} -> is_nil(value) end)
+      |> Enum.flat_map(fn {key, value} -> ["--#{key}", to_string(value)] end)
+
+    System.cmd(Path.join(priv, "s7_bench.o"), args,
+      env: [{"LD_LIBRARY_PATH", priv}, {"DYLD_LIBRARY_PATH", priv}],
+      into: IO.stream(:stdio, :line)
+    )
+  end
+
+  defp run_port(opts) do
+    port = Keyword.get(opts, :port, 10102)
+    duration = Keyword.get(opts, :duration, 1000)
+    sizes = parse_list(opts[:sizes], [4, 64, 512, 4096], &String.to_integer/1)
+    concurrency = parse_list(opts[:concurrency], [1, 4, 16], &String.to_integer/1)
+    commands = parse_list(opts[:commands], @commands, &String.to_existing_atom/1)
+
+    {connect_opts, commands} =
+      case opts[:ip] do
+        nil ->
+          {:ok, server} = Snapex7.Server.start_link(port: port, areas: [DB: [{1, 0xFFFF}]])
+          {Snapex7.Server.connect_opts(server), loopback_commands(commands)}
+
+        ip ->
+          {[ip: ip, port: port, rack: 0, slot: 1], commands}
+      end
+
+    {:ok, pid} = Snapex7.Client.start_link()
+    :ok = Snapex7.Client.connect_to(pid, connect_opts)
+
+    Mix.shell().info(
+      format_row(["command", "size", "callers", "ops", "ops/s", "p50(us)", "p99(us)", "errors"])
+    )
+
+    for command <- commands, size <- sizes, callers <- concurrency do
+      run_case(pid, command, size, callers, duration)
+    end
+
+    Snapex7.Client.stop(pid)
+  end
+
+  # Their cases would only time the error replies of the loopback server
+  defp loopback_commands(commands) do
+    case Enum.split_with(commands, &(&1 in @uploads)) do
+      {[], commands} ->
+        commands
+
+      {skipped, commands} ->
+        Mix.shell().info("Skipping #{Enum.join(skipped, ", ")}, the loopback server can't serve uploads")
+        commands
+    end
+  end
+
+  defp run_case(pid, command, size, callers, duration) do
+    fun = request(command, size)
+    started = System.monotonic_time()
+    deadline = started + System.convert_time_unit(duration, :millisecond, :native)
+
+    results =
+      1..callers
+      |> Enum.map(fn _ -> Task.async(fn -> bench_loop(pid, fun, deadline, [], 0) end) end)
+      |> Enum.map(&Task.await(&1, :infinity))
+
+    elapsed = System.monotonic_time() - started
+    samples = results |> Enum.flat_map(&elem(&1, 0)) |> Enum.sort()
+    errors = results |> Enum.map(&elem(&1, 1)) |> Enum.sum()
+    ops = length(samples)
+    ops_per_sec = ops / (System.convert_time_unit(elapsed, :native, :microsecond) / 1_000_000)
+
+    Mix.shell().info(
+      format_row([
+        command,
+        size,
+        callers,
+        ops,
+        Float.round(ops_per_sec, 1),
+        percentile(samples, ops, 50),
+        percentile(samples, ops, 99),
+        errors
+      ])
+    )
+  end
+
+  defp bench_loop(pid, fun, deadline, samples, errors) do
+    start = System.monotonic_time()
+
+    if start >= deadline do
+      {samples, errors}
+    else
+      errors =
+        case fun.(pid) do
+          {:error, _reason} -> errors + 1
+          _ok -> errors
+        end
+
+      sample = System.monotonic_time() - start
+      bench_loop(pid, fun, deadline, [sample | samples], errors)
+    end
+  end
+
+  defp request(:db_read, size) do
+    fn pid -> Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: size) end
+  end
+
+  defp request(:read_area, size) do
+    fn pid ->
+      Snapex7.Client.read_area(pid, area: :DB, word_len: :byte, db_number: 1, start: 0, amount: size)
+    end
+  end
+
+  defp request(:read_multi_vars, size) do
+    items = multi_vars(size, false)
+    fn pid -> Snapex7.Client.read_multi_vars(pid, data: items) end
+  end
+
+  defp request(:write_multi_vars, size) do
+    items = multi_vars(size, true)
+    fn pid -> Snapex7.Client.write_multi_vars(pid, data: items) end
+  end
+
+  defp request(:full_upload, size) do
+    fn pid -> Snapex7.Client.full_upload(pid, :DB, 1, size) end
+  end
+
+  defp request(:db_get, size) do
+    fn pid -> Snapex7.Client.db_get(pid, 1, size) end
+  end
+
+  # The payload is split between @n_multi_vars items of the same DB.
+  defp multi_vars(size, with_data?) do
+    amount = max(div(size, @n_multi_vars), 1)
+
+    for i <- 0..(@n_multi_vars - 1) do
+      item = %{area: :DB, word_len: :byte, db_number: 1, start: i * amount, amount: amount}
+      if with_data?, do: Map.put(item, :data, :binary.copy(<<0>>, amount)), else: item
+    end
+  end
+
+  defp percentile(_samples, 0, _p), do: 0
+
+  defp percentile(samples, n, p) do
+    samples
+    |> Enum.at(min(div(n * p, 100), n - 1))
+    |> System.convert_time_unit(:native, :nanosecond)
+    |> Kernel./(1000)
+    |> Float.round(1)
+  end
+
+  defp parse_list(nil, default, _fun), do: default
+
+  defp parse_list(string, _default, fun) do
+    string |> String.split(",", trim: true) |> Enum.map(fun)
+  end
+
+  defp format_row([command | values]) do
+    String.pad_trailing(to_string(command), 17) <>
+      Enum.map_join(values, "", &String.pad_leading(to_string(&1), 10))
+  end
+end
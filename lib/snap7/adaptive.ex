@@ -0,0 +1,15 @@
+defmodule Snapex7.Adaptive do
+  @moduledoc false
+
+  # Change-rate adaptive polling of Snapex7.Cache and Snapex7.Scheduler: a poll returning
+  # the same value as the previous one doubles the interval up to max_interval, any change
+  # brings it back to interval
+  @spec next_interval(pos_integer | nil, pos_integer, pos_integer, term, term) :: pos_integer
+  def next_interval(current, interval, max_interval, previous, value) do
+    if current != nil and previous === value do
+      min(current * 2, max_interval)
+    else
+      interval
+    end
+  end
+end
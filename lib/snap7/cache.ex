@@ -0,0 +1,227 @@
+defmodule Snapex7.Cache do
+  use GenServer
+  require Logger
+
+  @moduledoc """
+  Opt-in read cache, readers get the latest polled values without going through
+  `Snapex7.Client` (nor its mailbox and port).
+
+  Every poll runs a client request (e.g. `{:db_read, [db_number: 1, start: 0, amount: 4]}`)
+  periodically and publishes its value with a timestamp in a public ETS table named
+  after the cache, or in `:persistent_term` for hot values that rarely change (only
+  written when the value changes, every write triggers a global GC).
+
+      {:ok, _pid} =
+        Snapex7.Cache.start_link(
+          name: :plc_cache,
+          client: client,
+          polls: [
+            temperature: [request: {:db_read, [db_number: 1, start: 0, amount: 4]}, interval: 100],
+            recipe: [request: {:db_read, [db_number: 2, start: 0, amount: 64]}, interval: 5000, store: :persistent_term]
+          ]
+        )
+
+      {:ok, <<_::32>>} = Snapex7.Cache.get(:plc_cache, :temperature, max_age: 250)
+
+  With a `:max_interval`, a poll returning the same value as the previous one doubles its
+  interval, up to `:max_interval`, and a changed value brings it back to `:interval`: rarely
+  changing data costs a fraction of the PDUs while a change is still seen at the fast rate.
+  """
+
+  defmodule State do
+    @moduledoc false
+
+    # name: cache (and ETS table) name
+    # run: fun running a client request
+    # polls: %{key => {request, interval, max_interval, store}}
+    # adaptive: %{key => {current interval, last value}}
+    defstruct name: nil,
+              run: nil,
+              polls: %{},
+              adaptive: %{}
+  end
+
+  @type poll_opt ::
+          {:request, term}
+          | {:interval, pos_integer}
+          | {:max_interval, pos_integer}
+          | {:store, :ets | :persistent_term}
+
+  @type cache_opt ::
+          {:name, atom}
+          | {:client, GenServer.server()}
+          | {:pool, GenServer.server()}
+          | {:polls, [{term, [poll_opt]}]}
+
+  @doc """
+  Start up a cache.
+  The following options are available:
+
+    * `:name` - (atom) name of the cache process and its ETS table (required).
+
+    * `:client` - `Snapex7.Client` used for polling and read-through.
+
+    * `:pool` - `Snapex7.Pool` used instead of `:client`.
+
+    * `:polls` - (keyword) values to poll, each with the client `:request` (as in
+      `Snapex7.Client.command/2`), the poll `:interval` in ms (default 1000), the
+      `:max_interval` of the adaptive polling in ms (default the interval, not adaptive)
+      and the `:store`, `:ets` (default) or `:persistent_term`.
+  """
+  @spec start_link([cache_opt]) :: {:ok, pid} | {:error, term}
+  def start_link(opts) do
+    name = Keyword.fetch!(opts, :name)
+    GenServer.start_link(__MODULE__, opts, name: name)
+  end
+
+  @doc """
+  Stop the cache, its ETS table and `:persistent_term` values are deleted.
+  """
+  @spec stop(atom) :: :ok
+  def stop(cache) do
+    GenServer.stop(cache)
+  end
+
+  @doc """
+  Returns the cached value of `key`, it never blocks on the PLC.
+  The following options are available:
+
+    * `:max_age` - (int) maximum age in ms accepted (default :infinity).
+  """
+  @spec get(atom, term, [{:max_age, non_neg_integer | :infinity}]) ::
+          {:ok, term} | {:error, :stale} | {:error, :not_found}
+  def get(cache, key, opts \\ []) do
+    max_age = Keyword.get(opts, :max_age, :infinity)
+
+    case :ets.lookup(cache, key) do
+      [{^key, stamp, store, value}] ->
+        if max_age == :infinity or now() - stamp <= max_age do
+          {:ok, load(cache, key, store, value)}
+        else
+          {:error, :stale}
+        end
+
+      [] ->
+        {:error, :not_found}
+    end
+  end
+
+  @doc """
+  Returns the cached value of `key` when it isn't older than `max_age` ms, otherwise
+  runs `request` through the cache client and caches its value.
+  """
+  @spec fetch(atom, term, non_neg_integer, term) :: {:ok, term} | {:error, term}
+  def fetch(cache, key, max_age, request) do
+    case get(cache, key, max_age: max_age) do
+      {:ok, value} -> {:ok, value}
+      {:error, _reason} -> GenServer.call(cache, {:fetch, key, request})
+    end
+  end
+
+  @doc """
+  Publishes `value` for `key`, e.g. from a read done elsewhere.
+  """
+  @spec put(atom, term, term, :ets | :persistent_term) :: :ok
+  def put(cache, key, value, store \\ :ets) do
+    store(cache, key, value, store)
+  end
+
+  @spec init([cache_opt]) :: {:ok, Snapex7.Cache.State.t()}
+  def init(opts) do
+    name = Keyword.fetch!(opts, :name)
+    :ets.new(name, [:named_table, :public, :set, read_concurrency: true])
+
+    polls =
+      opts
+      |> Keyword.get(:polls, [])
+      |> Map.new(fn {key, poll_opts} ->
+        request = Keyword.fetch!(poll_opts, :request)
+        interval = Keyword.get(poll_opts, :interval, 1000)
+        max_interval = max(Keyword.get(poll_opts, :max_interval, interval), interval)
+        store = Keyword.get(poll_opts, :store, :ets)
+        send(self(), {:poll, key})
+        {key, {request, interval, max_interval, store}}
+      end)
+
+    {:ok, %State{name: name, run: runner(opts), polls: polls}}
+  end
+
+  def handle_call({:fetch, key, request}, _from, state) do
+    response =
+      case state.run.(request) do
+        {:ok, value} ->
+          store(state.name, key, value, :ets)
+          {:ok, value}
+
+        error ->
+          error
+      end
+
+    {:reply, response, state}
+  end
+
+  def handle_info({:poll, key}, state) do
+    {request, interval, max_interval, store} = Map.fetch!(state.polls, key)
+    started_at = now()
+
+    state =
+      case state.run.(request) do
+        {:ok, value} ->
+          store(state.name, key, value, store)
+          adapt(state, key, value, interval, max_interval)
+
+        error ->
+          # the previous value is kept, readers see it getting stale
+          Logger.debug("(#{__MODULE__}) #{inspect(key)} poll failed: #{inspect(error)}")
+          state
+      end
+
+    # at a fixed rate, the time of the request is taken out
+    {current, _value} = Map.get(state.adaptive, key, {interval, nil})
+    Process.send_after(self(), {:poll, key}, max(current - (now() - started_at), 0))
+    {:noreply, state}
+  end
+
+  def terminate(_reason, state) do
+    for [key] <- :ets.match(state.name, {:"$1", :_, :persistent_term, :_}) do
+      :persistent_term.erase({__MODULE__, state.name, key})
+    end
+  end
+
+  defp adapt(state, _key, _value, interval, interval), do: state
+
+  defp adapt(state, key, value, interval, max_interval) do
+    {current, previous} = Map.get(state.adaptive, key, {nil, nil})
+    current = Snapex7.Adaptive.next_interval(current, interval, max_interval, previous, value)
+    %State{state | adaptive: Map.put(state.adaptive, key, {current, value})}
+  end
+
+  defp runner(opts) do
+    case Keyword.fetch(opts, :pool) do
+      {:ok, pool} -> &Snapex7.Pool.command(pool, &1)
+      :error -> &Snapex7.Client.command(Keyword.fetch!(opts, :client), &1)
+    end
+  end
+
+  defp store(cache, key, value, :ets) do
+    :ets.insert(cache, {key, now(), :ets, value})
+    :ok
+  end
+
+  defp store(cache, key, value, :persistent_term) do
+    term_key = {__MODULE__, cache, key}
+
+    if :persistent_term.get(term_key, make_ref()) != value do
+      :persistent_term.put(term_key, value)
+    end
+
+    # only the timestamp goes to ETS
+    :ets.insert(cache, {key, now(), :persistent_term, nil})
+    :ok
+  end
+
+  defp load(_cache, _key, :ets, value), do: value
+  defp load(cache, key, :persistent_term, _value), do: :persistent_term.get({__MODULE__, cache, key})
+
+  defp now, do: System.monotonic_time(:millisecond)
+end
@@ -3,6 +3,8 @@ defmodule Snapex7.Client do
   require Logger
 
   @c_timeout 5000
+  # extra wait for the C side timeout reply once the deadline is over
+  @call_margin 1000
 
   @block_types [
     OB: 0x38,
@@ -29,6 +31,91 @@ defmodule Snapex7.Client do
     TM: 0x1D
   ]
 
+  # Identical reads waiting in the mailbox share the reply of the one in flight
+  @coalesced_reads [
+    :read_area,
+    :db_read,
+    :ab_read,
+    :eb_read,
+    :mb_read,
+    :tm_read,
+    :ct_read,
+    :read_multi_vars
+  ]
+
+  # Long block/SZL transfers run with the bulk priority unless told otherwise
+  @bulk_requests [:full_upload, :upload, :download, :db_get, :read_szl, :read_szl_list]
+
+  # Realtime requests handled while waiting for the reply of a slower one
+  @interleaved_requests @coalesced_reads ++
+                          [
+                            :write_area,
+                            :db_write,
+                            :ab_write,
+                            :eb_write,
+                            :mb_write,
+                            :tm_write,
+                            :ct_write,
+                            :write_multi_vars
+                          ]
+
+  @priorities [realtime: 0, normal: 1, bulk: 2]
+
+  # ISO errors of a dropped connection (TCP ones, etcp, always are)
+  @connection_errors [:errIsoConnect, :errIsoDisconnect, :errIsoSendPacket, :errIsoRecvPacket]
+
+  # Requests served while reconnecting, the rest are held or fail fast (see :reconnect)
+  @offline_requests [
+    :connect_to,
+    :set_connection_params,
+    :set_connection_type,
+    :set_params,
+    :get_params,
+    :disconnect,
+    :get_connected,
+    :get_stats
+  ]
+
+  # Hot commands sent with the binary protocol, {area, word_len} of the fixed area ones
+  @raw_areas [
+    ab_read: {0x82, 0x02},
+    ab_write: {0x82, 0x02},
+    eb_read: {0x81, 0x02},
+    eb_write: {0x81, 0x02},
+    mb_read: {0x83, 0x02},
+    mb_write: {0x83, 0x02},
+    tm_read: {0x1D, 0x1D},
+    tm_write: {0x1D, 0x1D},
+    ct_read: {0x1C, 0x1C},
+    ct_write: {0x1C, 0x1C}
+  ]
+  @raw_read 1
+  @raw_write 2
+
+  # Requests not reaching the PLC, free of the :rate_limit budget
+  @unmetered_commands [
+    :test,
+    :set_connection_type,
+    :set_connection_params,
+    :connect_to,
+    :connect,
+    :disconnect,
+    :get_params,
+    :set_params,
+    :get_exec_time,
+    :get_last_error,
+    :get_pdu_length,
+    :get_connected,
+    :get_stats,
+    :set_reply_timing,
+    :set_health,
+    :shm_open,
+    :shm_close
+  ]
+
+  # Requests changing the client state or post-processing the port reply can't be batched
+  @unbatched_requests [:connect_to, :connect, :disconnect, :get_plc_date_time, :batch]
+
   @word_types [
     bit: 0x01,
     byte: 0x02,
@@ -49,6 +136,18 @@ defmodule Snapex7.Client do
     # rack: the rack of the server.
     # slot: the slot of the server.
     # is_active: active or passive mode
+    # queue_wait: time (native units) the request being handled waited in the mailbox
+    # deadline: os time (ms) the request being handled must be answered by
+    # priority: :realtime, :normal or :bulk class of the request being handled
+    # batching: the port command of the request is collected instead of sent (see batch/3)
+    # binary_protocol: hot reads/writes use the fixed-layout binary protocol instead of ETF
+    # shm: Snapex7.Shm region where the port writes big binaries (nil for pipe only)
+    # nif: Snapex7.Nif client used instead of the port (nil for the port backend)
+    # reconnect: reconnect options (nil when disabled)
+    # session: connection type, params and password replayed on reconnect
+    # attempts: failed reconnect attempts since the connection dropped
+    # held: {ref, from, envelope} of the requests waiting for the reconnect (newest first)
+    # rate_limit: Snapex7.RateLimit budget of the PLC (nil when unlimited)
     defstruct port: nil,
               controlling_process: nil,
               queued_messages: [],
@@ -56,15 +155,64 @@ defmodule Snapex7.Client do
               rack: nil,
               slot: nil,
               state: nil,
-              is_active: false
+              is_active: false,
+              queue_wait: 0,
+              deadline: nil,
+              priority: :normal,
+              batching: false,
+              binary_protocol: false,
+              shm: nil,
+              nif: nil,
+              reconnect: nil,
+              session: %{params: %{}},
+              attempts: 0,
+              held: [],
+              rate_limit: nil
   end
 
   @doc """
   Start up a Snap7 Client GenServer.
+  Besides the `GenServer` options, the following options are available:
+
+    * `:binary_protocol` - (boolean) send the area/DB/AB/EB/MB/TM/CT reads and writes
+      with the fixed-layout binary protocol instead of ETF (default false), see
+      "Binary protocol" in the README.
+
+    * `:shm` - (boolean or keyword) map a shared memory ring of `:slots` (default 8) slots of
+      `:slot_size` bytes (default 65535), big binaries of data replies go through it instead
+      of the pipe (default false), see `Snapex7.Shm`.
+
+    * `:port_pool` - `Snapex7.PortPool` the port is checked out from (default
+      `Snapex7.PortPool`), the client spawns its own when the pool isn't running, is
+      empty or this is `false`.
+
+    * `:reconnect` - (boolean or keyword) reconnect when the connection drops (default false),
+      with an exponential backoff from `:backoff_min` (default 100 ms, the first attempt
+      is immediate) to `:backoff_max` (default 30_000 ms). The connection type, params and
+      session password set through the client are replayed. Meanwhile requests are held
+      until their timeout (`on_disconnect: :queue`, default) or answered
+      `{:error, :disconnected}` (`on_disconnect: :fail_fast`).
+
+    * `:health` - (keyword) dead peer detection by the port (port backend only), the
+      `:keepalive` `{idle_ms, interval_ms, count}` and `:user_timeout` (ms, Linux) of the
+      PLC socket, plus a PLC status probe every `:probe_interval` ms of idle time answered
+      within `:probe_timeout` ms. A dead PLC is told right away: the client disconnects (or
+      reconnects, see `:reconnect`) and sends `{:snapex7, client, {:disconnected, reason}}`
+      to the process that connected it.
+
+    * `:backend` - `:port` (default) runs snap7 in its own OS process, `:nif` links it into
+      the VM and runs the calls on dirty I/O schedulers, see `Snapex7.Nif` for the commands
+      it serves.
+
+    * `:rate_limit` - (keyword or `Snapex7.RateLimit`) communication budget of the PLC, the
+      `Snapex7.RateLimit.new/1` options or a budget shared with other clients (default
+      unlimited).
   """
   @spec start_link([term]) :: {:ok, pid} | {:error, term} | {:error, :einval}
   def start_link(opts \\ []) do
-    GenServer.start_link(__MODULE__, [], opts)
+    {client_opts, gen_opts} =
+      Keyword.split(opts, [:binary_protocol, :shm, :backend, :port_pool, :reconnect, :health, :rate_limit])
+    GenServer.start_link(__MODULE__, client_opts, gen_opts)
   end
 
   @doc """
@@ -79,6 +227,7 @@ defmodule Snapex7.Client do
 
   @type connect_opt ::
           {:ip, bitstring}
+          | {:port, integer}
           | {:rack, 0..7}
           | {:slot, 1..31}
           | {:local_tsap, integer}
@@ -97,11 +246,16 @@ defmodule Snapex7.Client do
 
     * `:slot` - (int) PLC Slot number (1..31).
 
+    * `:port` - (int) PLC TCP port (default 102), e.g. for a loopback `Snapex7.Server`.
+
+    * `:notify` - (pid) process the client sends its `{:snapex7, client, event}` messages
+      to (default the process calling `connect_to/2`).
+
   For more info see pg. 96 form Snap7 docs.
   """
   @spec connect_to(GenServer.server(), [connect_opt]) :: :ok | {:error, map()} | {:error, :einval}
   def connect_to(pid, opts \\ []) do
-    GenServer.call(pid, {:connect_to, opts})
+    call(pid, {:connect_to, opts})
   end
 
   @doc """
@@ -110,7 +264,7 @@ defmodule Snapex7.Client do
   @spec set_connection_type(GenServer.server(), atom()) ::
           :ok | {:error, map()} | {:error, :einval}
   def set_connection_type(pid, connection_type) do
-    GenServer.call(pid, {:set_connection_type, connection_type})
+    call(pid, {:set_connection_type, connection_type})
   end
 
   @doc """
@@ -126,7 +280,7 @@ defmodule Snapex7.Client do
   @spec set_connection_params(GenServer.server(), [connect_opt]) ::
           :ok | {:error, map()} | {:error, :einval}
   def set_connection_params(pid, opts \\ []) do
-    GenServer.call(pid, {:set_connection_params, opts})
+    call(pid, {:set_connection_params, opts})
   end
 
   @doc """
@@ -135,7 +289,7 @@ defmodule Snapex7.Client do
   """
   @spec connect(GenServer.server()) :: :ok | {:error, map()} | {:error, :einval}
   def connect(pid) do
-    GenServer.call(pid, :connect)
+    call(pid, :connect)
   end
 
   @doc """
@@ -143,7 +297,7 @@ defmodule Snapex7.Client do
   """
   @spec disconnect(GenServer.server()) :: :ok | {:error, map()} | {:error, :einval}
   def disconnect(pid) do
-    GenServer.call(pid, :disconnect)
+    call(pid, :disconnect)
   end
 
   @doc """
@@ -152,7 +306,7 @@ defmodule Snapex7.Client do
   """
   @spec get_params(GenServer.server(), integer()) :: :ok | {:error, map()} | {:error, :einval}
   def get_params(pid, param_number) do
-    GenServer.call(pid, {:get_params, param_number})
+    call(pid, {:get_params, param_number})
   end
 
   @doc """
@@ -161,7 +315,7 @@ defmodule Snapex7.Client do
   @spec set_params(GenServer.server(), integer(), integer()) ::
           :ok | {:error, map()} | {:error, :einval}
   def set_params(pid, param_number, value) do
-    GenServer.call(pid, {:set_params, param_number, value})
+    call(pid, {:set_params, param_number, value})
   end
 
   @type data_io_opt ::
@@ -192,7 +346,7 @@ defmodule Snapex7.Client do
   @spec read_area(GenServer.server(), [data_io_opt]) ::
           {:ok, bitstring} | {:error, map()} | {:error, :einval}
   def read_area(pid, opts) do
-    GenServer.call(pid, {:read_area, opts})
+    call(pid, {:read_area, opts})
   end
 
   @doc """
@@ -215,7 +369,7 @@ defmodule Snapex7.Client do
   """
   @spec write_area(GenServer.server(), [data_io_opt]) :: :ok | {:error, map()} | {:error, :einval}
   def write_area(pid, opts) do
-    GenServer.call(pid, {:write_area, opts})
+    call(pid, {:write_area, opts})
   end
 
   @doc """
@@ -237,7 +391,7 @@ defmodule Snapex7.Client do
   @spec db_read(GenServer.server(), [data_io_opt]) ::
           {:ok, bitstring} | {:error, map()} | {:error, :einval}
   def db_read(pid, opts) do
-    GenServer.call(pid, {:db_read, opts})
+    call(pid, {:db_read, opts})
   end
 
   @doc """
@@ -260,7 +414,7 @@ defmodule Snapex7.Client do
   """
   @spec db_write(GenServer.server(), [data_io_opt]) :: :ok | {:error, map()} | {:error, :einval}
   def db_write(pid, opts) do
-    GenServer.call(pid, {:db_write, opts})
+    call(pid, {:db_write, opts})
   end
 
   @doc """
@@ -280,7 +434,7 @@ defmodule Snapex7.Client do
   @spec ab_read(GenServer.server(), [data_io_opt]) ::
           {:ok, bitstring} | {:error, map()} | {:error, :einval}
   def ab_read(pid, opts) do
-    GenServer.call(pid, {:ab_read, opts})
+    call(pid, {:ab_read, opts})
   end
 
   @doc """
@@ -301,7 +455,7 @@ defmodule Snapex7.Client do
   """
   @spec ab_write(GenServer.server(), [data_io_opt]) :: :ok | {:error, map()} | {:error, :einval}
   def ab_write(pid, opts) do
-    GenServer.call(pid, {:ab_write, opts})
+    call(pid, {:ab_write, opts})
   end
 
   @doc """
@@ -321,7 +475,7 @@ defmodule Snapex7.Client do
   @spec eb_read(GenServer.server(), [data_io_opt]) ::
           {:ok, bitstring} | {:error, map()} | {:error, :einval}
   def eb_read(pid, opts) do
-    GenServer.call(pid, {:eb_read, opts})
+    call(pid, {:eb_read, opts})
   end
 
   @doc """
@@ -342,7 +496,7 @@ defmodule Snapex7.Client do
   """
   @spec eb_write(GenServer.server(), [data_io_opt]) :: :ok | {:error, map()} | {:error, :einval}
   def eb_write(pid, opts) do
-    GenServer.call(pid, {:eb_write, opts})
+    call(pid, {:eb_write, opts})
   end
 
   @doc """
@@ -362,7 +516,7 @@ defmodule Snapex7.Client do
   @spec mb_read(GenServer.server(), [data_io_opt]) ::
           {:ok, bitstring} | {:error, map()} | {:error, :einval}
   def mb_read(pid, opts) do
-    GenServer.call(pid, {:mb_read, opts})
+    call(pid, {:mb_read, opts})
   end
 
   @doc """
@@ -383,7 +537,7 @@ defmodule Snapex7.Client do
   """
   @spec mb_write(GenServer.server(), [data_io_opt]) :: :ok | {:error, map()} | {:error, :einval}
   def mb_write(pid, opts) do
-    GenServer.call(pid, {:mb_write, opts})
+    call(pid, {:mb_write, opts})
   end
 
   @doc """
@@ -403,7 +557,7 @@ defmodule Snapex7.Client do
   @spec tm_read(GenServer.server(), [data_io_opt]) ::
           {:ok, bitstring} | {:error, map()} | {:error, :einval}
   def tm_read(pid, opts) do
-    GenServer.call(pid, {:tm_read, opts})
+    call(pid, {:tm_read, opts})
   end
 
   @doc """
@@ -424,7 +578,7 @@ defmodule Snapex7.Client do
   """
   @spec tm_write(GenServer.server(), [data_io_opt]) :: :ok | {:error, map()} | {:error, :einval}
   def tm_write(pid, opts) do
-    GenServer.call(pid, {:tm_write, opts})
+    call(pid, {:tm_write, opts})
   end
 
   @doc """
@@ -444,7 +598,7 @@ defmodule Snapex7.Client do
   @spec ct_read(GenServer.server(), [data_io_opt]) ::
           {:ok, bitstring} | {:error, map()} | {:error, :einval}
   def ct_read(pid, opts) do
-    GenServer.call(pid, {:ct_read, opts})
+    call(pid, {:ct_read, opts})
   end
 
   @doc """
@@ -465,7 +619,7 @@ defmodule Snapex7.Client do
   """
   @spec ct_write(GenServer.server(), [data_io_opt]) :: :ok | {:error, map()} | {:error, :einval}
   def ct_write(pid, opts) do
-    GenServer.call(pid, {:ct_write, opts})
+    call(pid, {:ct_write, opts})
   end
 
   @doc """
@@ -481,7 +635,7 @@ defmodule Snapex7.Client do
   @spec read_multi_vars(GenServer.server(), list) ::
           {:ok, bitstring} | {:error, map()} | {:error, :einval}
   def read_multi_vars(pid, opt) do
-    GenServer.call(pid, {:read_multi_vars, opt})
+    call(pid, {:read_multi_vars, opt})
   end
 
   @doc """
@@ -497,7 +651,7 @@ defmodule Snapex7.Client do
   @spec write_multi_vars(GenServer.server(), [data_io_opt]) ::
           :ok | {:error, map()} | {:error, :einval}
   def write_multi_vars(pid, opts) do
-    GenServer.call(pid, {:write_multi_vars, opts})
+    call(pid, {:write_multi_vars, opts})
   end
 
   # Directory functions
@@ -507,7 +661,7 @@ defmodule Snapex7.Client do
   """
   @spec list_blocks(GenServer.server()) :: {:ok, list} | {:error, map()} | {:error, :einval}
   def list_blocks(pid) do
-    GenServer.call(pid, :list_blocks)
+    call(pid, :list_blocks)
   end
 
   @doc """
@@ -516,7 +670,7 @@ defmodule Snapex7.Client do
   @spec list_blocks_of_type(GenServer.server(), atom(), integer()) ::
           {:ok, list} | {:error, map} | {:error, :einval}
   def list_blocks_of_type(pid, block_type, n_items) do
-    GenServer.call(pid, {:list_blocks_of_type, block_type, n_items})
+    call(pid, {:list_blocks_of_type, block_type, n_items})
   end
 
   @doc """
@@ -527,7 +681,7 @@ defmodule Snapex7.Client do
   @spec get_ag_block_info(GenServer.server(), atom(), integer()) ::
           {:ok, list} | {:error, map} | {:error, :einval}
   def get_ag_block_info(pid, block_type, block_num) do
-    GenServer.call(pid, {:get_ag_block_info, block_type, block_num})
+    call(pid, {:get_ag_block_info, block_type, block_num})
   end
 
   @doc """
@@ -539,7 +693,7 @@ defmodule Snapex7.Client do
   @spec get_pg_block_info(GenServer.server(), bitstring()) ::
           {:ok, list} | {:error, map} | {:error, :einval}
   def get_pg_block_info(pid, buffer) do
-    GenServer.call(pid, {:get_pg_block_info, buffer})
+    call(pid, {:get_pg_block_info, buffer})
   end
 
   # Block Oriented functions
@@ -551,7 +705,7 @@ defmodule Snapex7.Client do
   @spec full_upload(GenServer.server(), atom(), integer(), integer()) ::
           {:ok, bitstring} | {:error, map} | {:error, :einval}
   def full_upload(pid, block_type, block_num, bytes2read) do
-    GenServer.call(pid, {:full_upload, block_type, block_num, bytes2read})
+    call(pid, {:full_upload, block_type, block_num, bytes2read})
   end
 
   @doc """
@@ -561,7 +715,7 @@ defmodule Snapex7.Client do
   @spec upload(GenServer.server(), atom(), integer(), integer()) ::
           {:ok, bitstring} | {:error, map} | {:error, :einval}
   def upload(pid, block_type, block_num, bytes2read) do
-    GenServer.call(pid, {:upload, block_type, block_num, bytes2read})
+    call(pid, {:upload, block_type, block_num, bytes2read})
   end
 
   @doc """
@@ -571,7 +725,7 @@ defmodule Snapex7.Client do
   @spec download(GenServer.server(), integer(), bitstring()) ::
           :ok | {:error, map} | {:error, :einval}
   def download(pid, block_num, buffer) do
-    GenServer.call(pid, {:download, block_num, buffer})
+    call(pid, {:download, block_num, buffer})
   end
 
   @doc """
@@ -580,7 +734,7 @@ defmodule Snapex7.Client do
   """
   @spec delete(GenServer.server(), atom(), integer()) :: :ok | {:error, map} | {:error, :einval}
   def delete(pid, block_type, block_num) do
-    GenServer.call(pid, {:delete, block_type, block_num})
+    call(pid, {:delete, block_type, block_num})
   end
 
   @doc """
@@ -592,7 +746,7 @@ defmodule Snapex7.Client do
   @spec db_get(GenServer.server(), integer(), integer()) ::
           {:ok, list} | {:error, map} | {:error, :einval}
   def db_get(pid, db_number, size \\ 65536) do
-    GenServer.call(pid, {:db_get, db_number, size})
+    call(pid, {:db_get, db_number, size})
   end
 
   @doc """
@@ -601,7 +755,7 @@ defmodule Snapex7.Client do
   @spec db_fill(GenServer.server(), integer(), integer()) ::
           {:ok, list} | {:error, map} | {:error, :einval}
   def db_fill(pid, db_number, fill_char) do
-    GenServer.call(pid, {:db_fill, db_number, fill_char})
+    call(pid, {:db_fill, db_number, fill_char})
   end
 
   # Date/Time functions
@@ -612,7 +766,7 @@ defmodule Snapex7.Client do
   @spec get_plc_date_time(GenServer.server()) ::
           {:ok, term, term} | {:error, map} | {:error, :einval}
   def get_plc_date_time(pid) do
-    GenServer.call(pid, :get_plc_date_time)
+    call(pid, :get_plc_date_time)
   end
 
   @type plc_time_opt ::
@@ -652,7 +806,7 @@ defmodule Snapex7.Client do
   @spec set_plc_date_time(GenServer.server(), [plc_time_opt]) ::
           :ok | {:error, map} | {:error, :einval}
   def set_plc_date_time(pid, opts \\ []) do
-    GenServer.call(pid, {:set_plc_date_time, opts})
+    call(pid, {:set_plc_date_time, opts})
   end
 
   @doc """
@@ -660,7 +814,7 @@ defmodule Snapex7.Client do
   """
   @spec set_plc_system_date_time(GenServer.server()) :: :ok | {:error, map} | {:error, :einval}
   def set_plc_system_date_time(pid) do
-    GenServer.call(pid, :set_plc_system_date_time)
+    call(pid, :set_plc_system_date_time)
   end
 
   # System info functions
@@ -674,7 +828,7 @@ defmodule Snapex7.Client do
   @spec read_szl(GenServer.server(), integer, integer) ::
           {:ok, bitstring} | {:error, map} | {:error, :einval}
   def read_szl(pid, id, index) do
-    GenServer.call(pid, {:read_szl, id, index})
+    call(pid, {:read_szl, id, index})
   end
 
   @doc """
@@ -682,7 +836,7 @@ defmodule Snapex7.Client do
   """
   @spec read_szl_list(GenServer.server()) :: {:ok, list} | {:error, map} | {:error, :einval}
   def read_szl_list(pid) do
-    GenServer.call(pid, :read_szl_list)
+    call(pid, :read_szl_list)
   end
 
   @doc """
@@ -690,7 +844,7 @@ defmodule Snapex7.Client do
   """
   @spec get_order_code(GenServer.server()) :: {:ok, list} | {:error, map} | {:error, :einval}
   def get_order_code(pid) do
-    GenServer.call(pid, :get_order_code)
+    call(pid, :get_order_code)
   end
 
   @doc """
@@ -698,7 +852,7 @@ defmodule Snapex7.Client do
   """
   @spec get_cpu_info(GenServer.server()) :: {:ok, list} | {:error, map} | {:error, :einval}
   def get_cpu_info(pid) do
-    GenServer.call(pid, :get_cpu_info)
+    call(pid, :get_cpu_info)
   end
 
   @doc """
@@ -706,7 +860,7 @@ defmodule Snapex7.Client do
   """
   @spec get_cp_info(GenServer.server()) :: {:ok, list} | {:error, map} | {:error, :einval}
   def get_cp_info(pid) do
-    GenServer.call(pid, :get_cp_info)
+    call(pid, :get_cp_info)
   end
 
   # PLC control functions
@@ -716,7 +870,7 @@ defmodule Snapex7.Client do
   """
   @spec plc_hot_start(GenServer.server()) :: :ok | {:error, map} | {:error, :einval}
   def plc_hot_start(pid) do
-    GenServer.call(pid, :plc_hot_start)
+    call(pid, :plc_hot_start)
   end
 
   @doc """
@@ -724,7 +878,7 @@ defmodule Snapex7.Client do
   """
   @spec plc_cold_start(GenServer.server()) :: :ok | {:error, map} | {:error, :einval}
   def plc_cold_start(pid) do
-    GenServer.call(pid, :plc_cold_start)
+    call(pid, :plc_cold_start)
   end
 
   @doc """
@@ -732,7 +886,7 @@ defmodule Snapex7.Client do
   """
   @spec plc_stop(GenServer.server()) :: :ok | {:error, map} | {:error, :einval}
   def plc_stop(pid) do
-    GenServer.call(pid, :plc_stop)
+    call(pid, :plc_stop)
   end
 
   @doc """
@@ -740,7 +894,7 @@ defmodule Snapex7.Client do
   """
   @spec copy_ram_to_rom(GenServer.server(), integer) :: :ok | {:error, map} | {:error, :einval}
   def copy_ram_to_rom(pid, timeout \\ 1000) do
-    GenServer.call(pid, {:copy_ram_to_rom, timeout})
+    call(pid, {:copy_ram_to_rom, timeout})
   end
 
   @doc """
@@ -748,7 +902,7 @@ defmodule Snapex7.Client do
   """
   @spec compress(GenServer.server(), integer) :: :ok | {:error, map} | {:error, :einval}
   def compress(pid, timeout \\ 1000) do
-    GenServer.call(pid, {:compress, timeout})
+    call(pid, {:compress, timeout})
   end
 
   @doc """
@@ -756,7 +910,7 @@ defmodule Snapex7.Client do
   """
   @spec get_plc_status(GenServer.server()) :: :ok | {:error, map} | {:error, :einval}
   def get_plc_status(pid) do
-    GenServer.call(pid, :get_plc_status)
+    call(pid, :get_plc_status)
   end
 
   # Security functions
@@ -767,7 +921,7 @@ defmodule Snapex7.Client do
   @spec set_session_password(GenServer.server(), bitstring()) ::
           :ok | {:error, map} | {:error, :einval}
   def set_session_password(pid, password) do
-    GenServer.call(pid, {:set_session_password, password})
+    call(pid, {:set_session_password, password})
   end
 
   @doc """
@@ -775,7 +929,7 @@ defmodule Snapex7.Client do
   """
   @spec clear_session_password(GenServer.server()) :: :ok | {:error, map} | {:error, :einval}
   def clear_session_password(pid) do
-    GenServer.call(pid, :clear_session_password)
+    call(pid, :clear_session_password)
   end
 
   @doc """
@@ -783,7 +937,7 @@ defmodule Snapex7.Client do
   """
   @spec get_protection(GenServer.server()) :: :ok | {:error, map} | {:error, :einval}
   def get_protection(pid) do
-    GenServer.call(pid, :get_protection)
+    call(pid, :get_protection)
   end
 
   # Low level functions
@@ -794,7 +948,7 @@ defmodule Snapex7.Client do
   @spec iso_exchange_buffer(GenServer.server(), bitstring) ::
           :ok | {:error, map} | {:error, :einval}
   def iso_exchange_buffer(pid, buffer) do
-    GenServer.call(pid, {:iso_exchange_buffer, buffer})
+    call(pid, {:iso_exchange_buffer, buffer})
   end
 
   # Miscellaneous functions
@@ -804,7 +958,7 @@ defmodule Snapex7.Client do
   """
   @spec get_exec_time(GenServer.server()) :: {:ok, integer} | {:error, map} | {:error, :einval}
   def get_exec_time(pid) do
-    GenServer.call(pid, :get_exec_time)
+    call(pid, :get_exec_time)
   end
 
   @doc """
@@ -812,7 +966,7 @@ defmodule Snapex7.Client do
   """
   @spec get_last_error(GenServer.server()) :: {:ok, map} | {:error, map} | {:error, :einval}
   def get_last_error(pid) do
-    GenServer.call(pid, :get_last_error)
+    call(pid, :get_last_error)
   end
 
   @doc """
@@ -820,7 +974,7 @@ defmodule Snapex7.Client do
   """
   @spec get_pdu_length(GenServer.server()) :: {:ok, list} | {:error, map} | {:error, :einval}
   def get_pdu_length(pid) do
-    GenServer.call(pid, :get_pdu_length)
+    call(pid, :get_pdu_length)
   end
 
   @doc """
@@ -828,7 +982,30 @@ defmodule Snapex7.Client do
   """
   @spec get_connected(GenServer.server()) :: {:ok, boolean} | {:error, map} | {:error, :einval}
   def get_connected(pid) do
-    GenServer.call(pid, :get_connected)
+    call(pid, :get_connected)
+  end
+
+  @doc """
+  Returns the C port stats since it started (or since the last reset):
+
+    * `:commands` - for every command called at least once, the amount of `:calls`
+      and `:errors`, and a latency summary of its `:decode`, `:plc_io` and `:encode`
+      phases (`%{count, min, max, mean, p50, p90, p99, p999}`, in nanoseconds, within 12.5%).
+
+    * `:bytes_in`/`:bytes_out` - bytes received from and sent to Elixir.
+
+    * `:errors` - error counts by snap7 class, `%{es7: %{errCliJobTimeout: 2}, eiso: %{}, etcp: 0, other: 0}`,
+      `other` are the non snap7 errors (e.g. `:einval`).
+
+    * `:rate_limit` - the `Snapex7.RateLimit.usage/1` of the budget, with a `:rate_limit`.
+
+  The following options are available:
+
+    * `:reset` - (boolean) clears the stats after reading them (default false).
+  """
+  @spec get_stats(GenServer.server(), [{:reset, boolean}]) :: {:ok, map} | {:error, :einval} | {:error, :enotsup}
+  def get_stats(pid, opts \\ []) do
+    call(pid, {:get_stats, opts})
   end
 
   @doc """
@@ -838,31 +1015,66 @@ defmodule Snapex7.Client do
   has no arguments), for example:
     request = {:connect_to , [ip: "192.168.1.100", rack: 0, slot: 0]},
     request = :get_connected
+
+  `timeout` (ms) is the request deadline, see "Deadlines" in the README, functions taking
+  keyword options also accept it as `timeout:` (default 5000), as well as the C port
+  `priority:`, `:realtime`, `:normal` or `:bulk` (see "Priorities" in the README).
   """
-  @spec command(GenServer.server(), term) :: :ok | {:ok, term} | {:error, map} | {:error, :einval}
-  def command(pid, request) do
-    GenServer.call(pid, request)
+  @spec command(GenServer.server(), term, timeout | nil) ::
+          :ok | {:ok, term} | {:error, map} | {:error, :einval} | {:error, :timeout}
+  def command(pid, request, timeout \\ nil) do
+    call(pid, request, timeout)
   end
 
-  @spec init([]) :: {:ok, Snapex7.Client.State.t()}
-  def init([]) do
-    snap7_dir = :code.priv_dir(:snapex7) |> List.to_string()
-    System.put_env("LD_LIBRARY_PATH", snap7_dir)
-    System.put_env("DYLD_LIBRARY_PATH", snap7_dir)
+  @doc """
+  Runs a list of `command/3` requests back to back in a single port message and returns
+  their results in the same order, e.g.
 
-    executable = :code.priv_dir(:snapex7) ++ ~c"/s7_client.o"
+      {:ok, [{:ok, true}, {:ok, :S7CpuStatusRun}, {:ok, <<_::32>>}]} =
+        Snapex7.Client.batch(pid, [:get_connected, :get_plc_status, {:db_read, [db_number: 1, start: 0, amount: 4]}])
 
-    port =
-      Port.open({:spawn_executable, executable}, [
-        {:args, []},
-        {:packet, 2},
-        :use_stdio,
-        :binary,
-        :exit_status
-      ])
+  Requests changing the client state (`connect_to/2`, `connect/1`, `disconnect/1`) and
+  `get_plc_date_time/1` can't be batched, the whole batch is then `{:error, :einval}`.
+  The following options are available:
+
+    * `:stop_on_error` - (boolean) the results end with the first `{:error, _}` one,
+      the following requests aren't run (default false).
+
+    * `:timeout` - (int) deadline of the whole batch in ms (default 5000).
+  """
+  @spec batch(GenServer.server(), [term], keyword) :: {:ok, [term]} | {:error, :einval} | {:error, :timeout}
+  def batch(pid, requests, opts \\ []) do
+    call(pid, {:batch, [requests: requests] ++ opts})
+  end
+
+  @spec init(keyword) :: {:ok, Snapex7.Client.State.t()} | {:stop, term}
+  def init(opts) do
+    backend =
+      case Keyword.get(opts, :backend, :port) do
+        :port -> init_port(opts)
+        :nif -> init_nif()
+      end
 
-    state = %State{port: port}
-    {:ok, state}
+    with {:ok, state} <- backend do
+      reconnect = reconnect_opts(Keyword.get(opts, :reconnect, false))
+      {:ok, %State{state | reconnect: reconnect, rate_limit: rate_limit(Keyword.get(opts, :rate_limit))}}
+    end
+  end
+
+  # Requests sent by the public functions carry the time they were issued at, their deadline
+  # and their priority. Those over the :rate_limit budget are parked until it has room.
+  def handle_call({:call, _issued_at, _deadline, _priority, _request} = envelope, from, state) do
+    case throttle(envelope, state) do
+      :ok ->
+        dispatch_request(envelope, from, state)
+
+      {:wait, delay} ->
+        Process.send_after(self(), {:throttled, envelope, from}, delay)
+        {:noreply, state}
+
+      error ->
+        {:reply, error, state}
+    end
   end
 
   # Administrative funtions
@@ -872,8 +1084,18 @@ defmodule Snapex7.Client do
     rack = Keyword.get(opts, :rack, 0)
     slot = Keyword.get(opts, :slot, 0)
     active = Keyword.get(opts, :active, false)
+    state = %State{state | ip: ip}
 
-    response = call_port(state, :connect_to, {ip, rack, slot})
+    response =
+      case Keyword.fetch(opts, :port) do
+        {:ok, port_number} ->
+          with :ok <- call_port(state, :set_params, {2, port_number}) do
+            call_port(state, :connect_to, {ip, rack, slot})
+          end
+
+        :error ->
+          call_port(state, :connect_to, {ip, rack, slot})
+      end
 
     new_state =
       case response do
@@ -885,7 +1107,7 @@ defmodule Snapex7.Client do
               rack: rack,
               slot: slot,
               is_active: active,
-              controlling_process: from_pid
+              controlling_process: Keyword.get(opts, :notify, from_pid)
           }
 
         {:error, _x} ->
@@ -1282,27 +1504,613 @@ defmodule Snapex7.Client do
     {:reply, response, state}
   end
 
+  def handle_call({:batch, opts}, from, state) do
+    requests = Keyword.fetch!(opts, :requests)
+    stop_on_error = Keyword.get(opts, :stop_on_error, false)
+
+    response =
+      case batch_jobs(requests, from, state, []) do
+        {:ok, jobs} -> call_port(state, :batch, {stop_on_error, jobs})
+        error -> error
+      end
+
+    {:reply, response, state}
+  end
+
+  def handle_call({:get_stats, opts}, _from, state) do
+    reset = Keyword.get(opts, :reset, false)
+    response =
+      case call_port(state, :get_stats, reset) do
+        {:ok, stats} -> {:ok, put_rate_limit(stats, state.rate_limit)}
+        error -> error
+      end
+
+    {:reply, response, state}
+  end
+
   def handle_call(request, _from, state) do
     Logger.error("(#{__MODULE__}) Invalid request: #{inspect(request)}")
     response = {:error, :einval}
     {:reply, response, state}
   end
 
-  defp call_port(state, command, arguments, timeout \\ @c_timeout) do
-    msg = {command, arguments}
-    send(state.port, {self(), {:command, :erlang.term_to_binary(msg)}})
-    # Block until the response comes back since the C side
-    # doesn't want to handle any queuing of requests. REVISIT
+  def handle_info(:reconnect, %State{state: :reconnecting} = state) do
+    case replay_session(state) do
+      :ok ->
+        Logger.info("(#{__MODULE__}) Reconnected to #{state.ip} after #{state.attempts + 1} attempt(s)")
+        :telemetry.execute([:snapex7, :client, :reconnect], %{attempts: state.attempts + 1}, %{ip: state.ip})
+        {:noreply, release_held(%State{state | state: :connected, attempts: 0})}
+
+      error ->
+        attempts = state.attempts + 1
+        Logger.debug("(#{__MODULE__}) Reconnect attempt #{attempts} failed: #{inspect(error)}")
+        Process.send_after(self(), :reconnect, backoff(state.reconnect, attempts))
+        {:noreply, %State{state | attempts: attempts}}
+    end
+  end
+
+  # connect_to/disconnect got there first
+  def handle_info(:reconnect, state), do: {:noreply, state}
+
+  # Pushed by the port when the idle connection dies (see :health)
+  def handle_info({port, {:data, <<?n, notification::binary>>}}, %State{port: port} = state) do
+    {:disconnected, reason} = :erlang.binary_to_term(notification)
+
+    if state.controlling_process do
+      send(state.controlling_process, {:snapex7, self(), {:disconnected, reason}})
+    end
+
+    case state do
+      %State{state: :connected} -> {:noreply, connection_lost(state, reason)}
+      _ -> {:noreply, state}
+    end
+  end
+
+  # Parked by handle_call/3 until the :rate_limit budget had room
+  def handle_info({:throttled, envelope, from}, state) do
+    case dispatch_request(envelope, from, state) do
+      {:reply, response, state} ->
+        GenServer.reply(from, response)
+        {:noreply, state}
+
+      {:noreply, state} ->
+        {:noreply, state}
+    end
+  end
+
+  def handle_info({:held_timeout, ref}, state) do
+    case List.keytake(state.held, ref, 0) do
+      {{^ref, from, _envelope}, held} ->
+        GenServer.reply(from, {:error, :timeout})
+        {:noreply, %State{state | held: held}}
+
+      nil ->
+        {:noreply, state}
+    end
+  end
+
+  def handle_info({port, {:data, <<?j, stale_id::32, _exec_ns::64, response::binary>>}}, %State{port: port} = state) do
+    Logger.debug("(#{__MODULE__}) Dropped the late reply of job #{stale_id}")
+    # frees its shared memory slot
+    take_shm(:erlang.binary_to_term(response), state)
+    {:noreply, state}
+  end
+
+  def handle_info({port, {:data, <<?b, stale_id::32, _exec_ns::64, _reply::binary>>}}, %State{port: port} = state) do
+    Logger.debug("(#{__MODULE__}) Dropped the late binary reply of job #{stale_id}")
+    {:noreply, state}
+  end
+
+  def handle_info(msg, state) do
+    Logger.warn("(#{__MODULE__}) Unexpected message: #{inspect(msg)}")
+    {:noreply, state}
+  end
+
+  # While reconnecting, only the @offline_requests reach the port
+  defp dispatch_request({:call, _issued_at, _deadline, _priority, request} = envelope, from, %State{state: :reconnecting} = state) do
+    if request_command(request) in @offline_requests do
+      run_request(envelope, from, state)
+    else
+      hold_request(envelope, from, state)
+    end
+  end
+
+  defp dispatch_request(envelope, from, state), do: run_request(envelope, from, state)
+
+  defp throttle(_envelope, %State{rate_limit: nil}), do: :ok
+
+  defp throttle({:call, _issued_at, deadline, priority, request}, state) do
+    command = request_command(request)
+
+    if command in @unmetered_commands do
+      :ok
+    else
+      max_wait = max(deadline - System.os_time(:millisecond), 0)
+      bytes = :erlang.external_size(request)
+
+      case Snapex7.RateLimit.acquire(state.rate_limit, request_pdus(request), bytes, priority, max_wait) do
+        {:ok, 0} ->
+          :ok
+
+        {:ok, delay} ->
+          metadata = %{command: command, ip: state.ip, priority: priority}
+          :telemetry.execute([:snapex7, :client, :throttled], %{delay: delay}, metadata)
+          {:wait, delay}
+
+        error ->
+          error
+      end
+    end
+  end
+
+  defp request_pdus({:batch, opts}), do: max(length(Keyword.get(opts, :requests, [])), 1)
+  defp request_pdus(_request), do: 1
+
+  # The reply (and the PDUs of a long transfer) is charged to the :rate_limit budget
+  defp charge(%State{rate_limit: nil}, _request, _priority, _response), do: :ok
+
+  defp charge(state, request, priority, response) do
+    if request_command(request) not in @unmetered_commands do
+      Snapex7.RateLimit.charge(state.rate_limit, :erlang.external_size(response), priority)
+    end
+
+    :ok
+  end
+
+  defp run_request({:call, issued_at, deadline, priority, request}, from, state) do
+    queue_wait = System.monotonic_time() - issued_at
+    state = %State{state | queue_wait: queue_wait, deadline: deadline, priority: priority}
+    {:reply, response, new_state} = handle_call(request, from, state)
+    new_state = carry_interleaved(new_state, state)
+    charge(state, request, priority, response)
+
+    if coalesced_read?(request) do
+      reply_coalesced(request, response, System.monotonic_time(), 0)
+    end
+
+    new_state =
+      %State{new_state | queue_wait: 0, deadline: nil, priority: :normal}
+      |> cache_session(request, response)
+      |> check_connection(state.state, response)
+
+    {:reply, response, new_state}
+  end
+
+  # Connection changes of the realtime requests interleaved by receive_reply/3, unless the
+  # request changed the connection itself (connect_to/disconnect)
+  defp carry_interleaved(new_state, state) do
+    interleaved = Process.delete(:snapex7_interleaved_state)
+
+    if interleaved != nil and new_state.state == state.state do
+      %State{new_state | state: interleaved.state, attempts: interleaved.attempts, held: interleaved.held}
+    else
+      new_state
+    end
+  end
+
+  defp request_command({command, _args}), do: command
+  defp request_command(command), do: command
+
+  # Settings replayed by the reconnect, snap7 keeps them but not a restarted PLC session
+  defp cache_session(state, {:set_connection_type, type}, :ok) do
+    put_in(state.session[:connection_type], Keyword.fetch!(@connection_types, type))
+  end
+
+  defp cache_session(state, {:set_params, param_number, value}, :ok) do
+    put_in(state.session.params[param_number], value)
+  end
+
+  defp cache_session(state, {:connect_to, opts}, :ok) do
+    case Keyword.fetch(opts, :port) do
+      {:ok, port_number} -> put_in(state.session.params[2], port_number)
+      :error -> state
+    end
+  end
+
+  defp cache_session(state, {:set_session_password, password}, :ok) do
+    put_in(state.session[:password], password)
+  end
+
+  defp cache_session(state, :clear_session_password, :ok) do
+    %State{state | session: Map.delete(state.session, :password)}
+  end
+
+  defp cache_session(state, _request, _response), do: state
+
+  defp check_connection(%State{reconnect: nil} = state, _old_state, _response), do: state
+
+  # connect_to/disconnect while reconnecting, the held requests go on
+  defp check_connection(%State{state: new_state} = state, :reconnecting, _response)
+       when new_state != :reconnecting do
+    release_held(%State{state | attempts: 0})
+  end
+
+  defp check_connection(%State{state: :connected} = state, _old_state, {:error, %{} = reasons}) do
+    if Map.get(reasons, :eiso) in @connection_errors or is_integer(Map.get(reasons, :etcp)) do
+      connection_lost(state, reasons)
+    else
+      state
+    end
+  end
+
+  defp check_connection(state, _old_state, _response), do: state
+
+  defp connection_lost(%State{reconnect: nil} = state, reason) do
+    Logger.warn("(#{__MODULE__}) Connection to #{state.ip} lost: #{inspect(reason)}")
+    %State{state | state: :idle}
+  end
+
+  defp connection_lost(state, reason) do
+    Logger.warn("(#{__MODULE__}) Connection to #{state.ip} lost: #{inspect(reason)}")
+    send(self(), :reconnect)
+    %State{state | state: :reconnecting, attempts: 0}
+  end
+
+  defp set_health(_state, nil), do: :ok
+
+  defp set_health(state, opts) do
+    {idle, interval, count} = Keyword.get(opts, :keepalive, {0, 0, 0})
+    user_timeout = Keyword.get(opts, :user_timeout, 0)
+    probe_interval = Keyword.get(opts, :probe_interval, 0)
+    probe_timeout = Keyword.get(opts, :probe_timeout, 0)
+    call_port(state, :set_health, {idle, interval, count, user_timeout, probe_interval, probe_timeout})
+  end
+
+  defp hold_request(_envelope, _from, %State{reconnect: %{on_disconnect: :fail_fast}} = state) do
+    {:reply, {:error, :disconnected}, state}
+  end
+
+  defp hold_request({:call, _issued_at, deadline, _priority, _request} = envelope, from, state) do
+    ref = make_ref()
+    Process.send_after(self(), {:held_timeout, ref}, max(deadline - System.os_time(:millisecond), 0))
+    {:noreply, %State{state | held: [{ref, from, envelope} | state.held]}}
+  end
+
+  # Runs the held requests in order, they are held again if the connection drops meanwhile
+  defp release_held(%State{held: held} = state) do
+    held
+    |> Enum.reverse()
+    |> Enum.reduce(%State{state | held: []}, fn {_ref, from, envelope}, state ->
+      # already through the :rate_limit budget
+      case dispatch_request(envelope, from, state) do
+        {:reply, response, state} ->
+          GenServer.reply(from, response)
+          state
+
+        {:noreply, state} ->
+          state
+      end
+    end)
+  end
+
+  defp replay_session(%State{session: session} = state) do
+    # drops what's left of the old socket
+    call_port(state, :disconnect, nil)
+
+    with :ok <- replay(state, :set_connection_type, session[:connection_type]),
+         :ok <- replay_params(state, Map.to_list(session.params)),
+         :ok <- call_port(state, :connect, nil) do
+      replay(state, :set_session_password, session[:password])
+    end
+  end
+
+  defp replay(_state, _command, nil), do: :ok
+  defp replay(state, command, arguments), do: call_port(state, command, arguments)
+
+  defp replay_params(_state, []), do: :ok
+
+  defp replay_params(state, [{param_number, value} | params]) do
+    with :ok <- call_port(state, :set_params, {param_number, value}) do
+      replay_params(state, params)
+    end
+  end
+
+  # the first attempt is right away, then backoff_min * 2^n ms (+ 10% jitter) up to backoff_max
+  defp backoff(reconnect, attempts) do
+    delay = min(reconnect.backoff_min * trunc(:math.pow(2, min(attempts - 1, 20))), reconnect.backoff_max)
+    delay + :rand.uniform(div(delay, 10) + 1) - 1
+  end
+
+  defp reconnect_opts(false), do: nil
+  defp reconnect_opts(true), do: reconnect_opts([])
+
+  defp reconnect_opts(opts) do
+    %{
+      backoff_min: Keyword.get(opts, :backoff_min, 100),
+      backoff_max: Keyword.get(opts, :backoff_max, 30_000),
+      on_disconnect: Keyword.get(opts, :on_disconnect, :queue)
+    }
+  end
+
+  # Runs each request handler with batching on to get its {command, arguments}
+  defp batch_jobs([], _from, _state, jobs), do: {:ok, Enum.reverse(jobs)}
+
+  defp batch_jobs([request | requests], from, state, jobs) do
+    command = if is_tuple(request), do: elem(request, 0), else: request
+
+    try do
+      if command in @unbatched_requests do
+        {:error, :einval}
+      else
+        handle_call(request, from, %State{state | batching: true})
+      end
+    catch
+      :throw, {:batched, job} -> batch_jobs(requests, from, state, [job | jobs])
+    else
+      # rejected before reaching the port
+      _response -> {:error, :einval}
+    end
+  end
+
+  defp coalesced_read?({command, _opts}), do: command in @coalesced_reads
+  defp coalesced_read?(_request), do: false
+
+  # Single-flight: the same read issued before this one completed gets its
+  # response instead of another round trip to the PLC.
+  defp reply_coalesced(request, response, completed_at, count) do
     receive do
-      {_, {:data, <<?r, response::binary>>}} ->
-        :erlang.binary_to_term(response)
+      {:"$gen_call", from, {:call, issued_at, _deadline, _priority, ^request}}
+      when issued_at <= completed_at ->
+        GenServer.reply(from, response)
+        reply_coalesced(request, response, completed_at, count + 1)
     after
-      timeout ->
-        # Not sure how this can be recovered
-        exit(:port_timed_out)
+      0 ->
+        if count > 0 do
+          {command, _opts} = request
+          :telemetry.execute([:snapex7, :client, :coalesced], %{count: count}, %{command: command})
+        end
     end
   end
 
+  defp call(pid, request, timeout \\ nil) do
+    timeout = timeout || request_timeout(request)
+    deadline = System.os_time(:millisecond) + timeout
+    envelope = {:call, System.monotonic_time(), deadline, request_priority(request), request}
+    GenServer.call(pid, envelope, timeout + @call_margin)
+  end
+
+  defp request_timeout({_command, [{_key, _value} | _] = opts}), do: Keyword.get(opts, :timeout, @c_timeout)
+  defp request_timeout(_request), do: @c_timeout
+
+  defp request_priority({command, [{_key, _value} | _] = opts}) do
+    Keyword.get(opts, :priority, default_priority(command))
+  end
+
+  defp request_priority({command, _args}), do: default_priority(command)
+  defp request_priority(_request), do: :normal
+
+  defp default_priority(command) when command in @bulk_requests, do: :bulk
+  defp default_priority(_command), do: :normal
+
+  # Every request is a job {{id, deadline, priority}, command, arguments}, the C side caps the
+  # snap7 timeouts with the deadline and answers overdue jobs with {:error, :timeout}.
+  # Replies carry the job id, so a late reply to a job given up on is just dropped.
+  defp call_port(%State{batching: true}, command, arguments) do
+    throw({:batched, {command, arguments}})
+  end
+
+  # The NIF backend runs the command in this process (on a dirty I/O scheduler), a batch
+  # runs its commands one after the other
+  defp call_port(%State{nif: client} = state, command, arguments) when client != nil do
+    metadata = %{command: command, ip: state.ip, payload_size: 0}
+
+    :telemetry.span([:snapex7, :client, :call], metadata, fn ->
+      started_at = System.monotonic_time()
+
+      response =
+        cond do
+          state.deadline != nil and System.os_time(:millisecond) > state.deadline -> {:error, :timeout}
+          command == :batch -> nif_batch(client, arguments)
+          true -> Snapex7.Nif.command(client, command, arguments)
+        end
+
+      measurements = %{queue_wait: state.queue_wait, exec_time: System.monotonic_time() - started_at}
+      {response, measurements, Map.put(metadata, :result, result_type(response))}
+    end)
+  end
+
+  defp call_port(state, command, arguments) do
+    deadline = state.deadline || System.os_time(:millisecond) + @c_timeout
+    id = rem(System.unique_integer([:positive]), 0x100000000)
+    priority = Keyword.get(@priorities, state.priority, 1)
+    request = encode_request(state, {id, deadline, priority}, command, arguments)
+    metadata = %{command: command, ip: state.ip, payload_size: byte_size(request)}
+
+    :telemetry.span([:snapex7, :client, :call], metadata, fn ->
+      send(state.port, {self(), {:command, request}})
+      wait = max(deadline - System.os_time(:millisecond), 0) + @call_margin
+      wait_until = System.monotonic_time(:millisecond) + wait
+      {response, exec_ns, interleaved_state} = receive_reply(state, id, wait_until)
+      response = take_shm(response, state)
+
+      if interleaved_state != state do
+        Process.put(:snapex7_interleaved_state, interleaved_state)
+      end
+
+      measurements = %{
+        queue_wait: state.queue_wait,
+        exec_time: System.convert_time_unit(exec_ns, :nanosecond, :native)
+      }
+
+      {response, measurements, Map.put(metadata, :result, result_type(response))}
+    end)
+  end
+
+  # Realtime reads/writes arriving meanwhile are sent to the port right away (interleave),
+  # the C side runs them before the rest of the job. Other replies stay in the mailbox
+  # (the reply of the outer job, or late ones dropped by handle_info/2). The client state
+  # left by the interleaved requests (e.g. a lost connection) is returned too.
+  defp receive_reply(%State{port: port} = state, id, wait_until) do
+    interleave = state.priority != :realtime and state.state == :connected
+
+    receive do
+      {^port, {:data, <<?j, ^id::32, exec_ns::64, response::binary>>}} ->
+        {:erlang.binary_to_term(response), exec_ns, state}
+
+      {^port, {:data, <<?b, ^id::32, exec_ns::64, @raw_read, data::binary>>}} ->
+        {{:ok, data}, exec_ns, state}
+
+      {^port, {:data, <<?b, ^id::32, exec_ns::64, @raw_write>>}} ->
+        {:ok, exec_ns, state}
+
+      {:"$gen_call", from, {:call, _issued_at, _deadline, :realtime, {command, _opts}} = envelope}
+      when interleave and command in @interleaved_requests ->
+        receive_reply(interleave_request(envelope, from, state), id, wait_until)
+    after
+      max(wait_until - System.monotonic_time(:millisecond), 0) ->
+        # the C side is stuck past the deadline, its reply will be dropped when it comes
+        {{:error, :timeout}, 0, state}
+    end
+  end
+
+  # Runs with its own deadline and priority, the outer job keeps its ones
+  defp interleave_request(envelope, from, state) do
+    new_state =
+      case handle_call(envelope, from, state) do
+        {:reply, response, new_state} ->
+          GenServer.reply(from, response)
+          new_state
+
+        {:noreply, new_state} ->
+          new_state
+      end
+
+    %State{new_state | queue_wait: state.queue_wait, deadline: state.deadline, priority: state.priority}
+  end
+
+  # bulk transfers stay in ETF, only those get split in chunks by the C side
+  defp encode_request(%State{binary_protocol: true, priority: priority}, job, command, arguments)
+       when priority != :bulk do
+    case raw_args(command, arguments) do
+      {opcode, area, db_number, start, amount, word_len, data}
+      when is_integer(area) and is_integer(db_number) and is_integer(start) and
+             is_integer(amount) and is_integer(word_len) and is_binary(data) ->
+        {id, deadline, priority} = job
+
+        <<opcode::8, id::32, deadline::64, priority::8, area::8, db_number::16, start::32,
+          amount::32, word_len::8, data::binary>>
+
+      _not_raw ->
+        :erlang.term_to_binary({job, command, arguments})
+    end
+  end
+
+  defp encode_request(_state, job, command, arguments) do
+    :erlang.term_to_binary({job, command, arguments})
+  end
+
+  defp raw_args(:read_area, {area, db_number, start, amount, word_len}),
+    do: {@raw_read, area, db_number, start, amount, word_len, <<>>}
+
+  defp raw_args(:write_area, {area, db_number, start, amount, word_len, data}),
+    do: {@raw_write, area, db_number, start, amount, word_len, data}
+
+  defp raw_args(:db_read, {db_number, start, amount}),
+    do: {@raw_read, 0x84, db_number, start, amount, 0x02, <<>>}
+
+  defp raw_args(:db_write, {db_number, start, amount, data}),
+    do: {@raw_write, 0x84, db_number, start, amount, 0x02, data}
+
+  defp raw_args(command, {start, amount}) when command in [:ab_read, :eb_read, :mb_read, :tm_read, :ct_read] do
+    {area, word_len} = Keyword.fetch!(@raw_areas, command)
+    {@raw_read, area, 0, start, amount, word_len, <<>>}
+  end
+
+  defp raw_args(command, {start, amount, data})
+       when command in [:ab_write, :eb_write, :mb_write, :tm_write, :ct_write] do
+    {area, word_len} = Keyword.fetch!(@raw_areas, command)
+    {@raw_write, area, 0, start, amount, word_len, data}
+  end
+
+  defp raw_args(_command, _arguments), do: nil
+
+  defp init_nif do
+    case Snapex7.Nif.create() do
+      {:ok, client} -> {:ok, %State{nif: client}}
+      {:error, reason} -> {:stop, reason}
+    end
+  end
+
+  defp init_port(opts) do
+    port =
+      case checkout_port(Keyword.get(opts, :port_pool, Snapex7.PortPool)) do
+        {:ok, port} ->
+          port
+
+        {:error, _reason} ->
+          Snapex7.PortPool.put_library_path()
+          Snapex7.PortPool.open_port()
+      end
+
+    state = %State{port: port, binary_protocol: Keyword.get(opts, :binary_protocol, false)}
+    state = open_shm(state, Keyword.get(opts, :shm, false))
+
+    case set_health(state, Keyword.get(opts, :health)) do
+      :ok -> {:ok, state}
+      error -> {:stop, error}
+    end
+  end
+
+  defp put_rate_limit(stats, nil), do: stats
+  defp put_rate_limit(stats, limiter), do: Map.put(stats, :rate_limit, Snapex7.RateLimit.usage(limiter))
+
+  defp rate_limit(nil), do: nil
+  defp rate_limit(%Snapex7.RateLimit{} = limiter), do: limiter
+  defp rate_limit(opts), do: Snapex7.RateLimit.new(opts)
+
+  defp checkout_port(false), do: {:error, :disabled}
+  defp checkout_port(pool), do: Snapex7.PortPool.checkout(pool)
+
+  defp nif_batch(client, {stop_on_error, jobs}) do
+    results =
+      Enum.reduce_while(jobs, [], fn {command, arguments}, results ->
+        result = Snapex7.Nif.command(client, command, arguments)
+
+        if stop_on_error and match?({:error, _reason}, result) do
+          {:halt, [result | results]}
+        else
+          {:cont, [result | results]}
+        end
+      end)
+
+    {:ok, Enum.reverse(results)}
+  end
+
+  defp open_shm(state, false), do: state
+
+  defp open_shm(state, true), do: open_shm(state, [])
+
+  defp open_shm(state, opts) do
+    slots = Keyword.get(opts, :slots, 8)
+    slot_size = Keyword.get(opts, :slot_size, 65535)
+
+    with {:ok, name} <- call_port(state, :shm_open, {slots, slot_size}),
+         {:ok, region} <- map_shm(name) do
+      %State{state | shm: region}
+    else
+      error ->
+        Logger.warn("(#{__MODULE__}) Shared memory unavailable: #{inspect(error)}")
+        call_port(state, :shm_close, nil)
+        state
+    end
+  end
+
+  # Snapex7.Shm.open/1 raises when its NIF isn't loaded
+  defp map_shm(name) do
+    Snapex7.Shm.open(name)
+  rescue
+    error in ErlangError -> {:error, error.original}
+  end
+
+  defp take_shm({:ok, {:"$shm", slot, size}}, %State{shm: region}) when region != nil do
+    Snapex7.Shm.take(region, slot, size)
+  end
+
+  defp take_shm(response, _state), do: response
+
+  defp result_type({:error, _reason}), do: :error
+  defp result_type(_response), do: :ok
+
   defp key2value(map) do
     area_key = Map.fetch!(map, :area)
     area_value = Keyword.fetch!(@area_types, area_key)
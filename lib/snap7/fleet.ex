@@ -0,0 +1,102 @@
+defmodule Snapex7.Fleet do
+  require Logger
+
+  @moduledoc """
+  Connects a whole plant of PLCs at once.
+
+  Every PLC gets its own `Snapex7.Client` (linked to and notifying the caller, see the
+  `:notify` option of `Snapex7.Client.connect_to/2`) and the ISO-TCP and PDU
+  negotiation handshakes run in parallel, at most `:max_concurrency` at a time. Each
+  handshake starts after a random delay of up to `:jitter` ms, so a few hundred PLCs don't
+  send their SYNs in the same millisecond through the shop-floor switches.
+
+      results =
+        Snapex7.Fleet.connect(
+          press_1: [ip: "192.168.0.1", rack: 0, slot: 1],
+          press_2: [ip: "192.168.0.2", rack: 0, slot: 1]
+        )
+
+      for {name, {:ok, client}, latency} <- results, do: ...
+
+  Every handshake also emits a `[:snapex7, :fleet, :connect]` telemetry event with the
+  `:latency` (native units) measurement and the `:name`, `:ip` and `:result` metadata.
+  """
+
+  @type connect_opt ::
+          {:max_concurrency, pos_integer}
+          | {:jitter, non_neg_integer}
+          | {:timeout, pos_integer}
+          | {:client_opts, keyword}
+
+  @type result :: {term, {:ok, pid} | {:error, term}, latency :: non_neg_integer | nil}
+
+  @doc """
+  Starts a client per PLC and connects them in parallel, `plcs` are `{name, connect_opts}`
+  pairs (see `Snapex7.Client.connect_to/2`). Returns `{name, {:ok, client} | {:error, reason},
+  latency}` in the order of `plcs`, the latency is the time of the handshake in ms
+  (without the jitter). Clients that can't connect are stopped.
+  The following options are available:
+
+    * `:max_concurrency` - (int) handshakes running at the same time (default 32).
+
+    * `:jitter` - (int) maximum random delay in ms before each handshake (default 100).
+
+    * `:timeout` - (int) timeout of each handshake in ms (default 5000).
+
+    * `:client_opts` - (keyword) options of `Snapex7.Client.start_link/1`.
+  """
+  @spec connect([{term, [Snapex7.Client.connect_opt()]}], [connect_opt]) :: [result]
+  def connect(plcs, opts \\ []) do
+    max_concurrency = Keyword.get(opts, :max_concurrency, 32)
+    jitter = Keyword.get(opts, :jitter, 100)
+    timeout = Keyword.get(opts, :timeout, 5000)
+    client_opts = Keyword.get(opts, :client_opts, [])
+
+    clients =
+      for {name, connect_opts} <- plcs do
+        {:ok, client} = Snapex7.Client.start_link(client_opts)
+        # the handshake runs in a task, the client tells the caller instead
+        connect_opts = connect_opts |> Keyword.put_new(:timeout, timeout) |> Keyword.put_new(:notify, self())
+        {name, client, connect_opts}
+      end
+
+    clients
+    |> Task.async_stream(&handshake(&1, jitter),
+      max_concurrency: max_concurrency,
+      # the client gives up on its own at the timeout, this only covers a stuck task
+      timeout: jitter + timeout + 2000,
+      on_timeout: :kill_task,
+      ordered: true
+    )
+    |> Enum.zip(clients)
+    |> Enum.map(fn
+      {{:ok, {:ok, latency}}, {name, client, _connect_opts}} ->
+        {name, {:ok, client}, latency}
+
+      {{:ok, {error, latency}}, {name, client, _connect_opts}} ->
+        Snapex7.Client.stop(client)
+        {name, error, latency}
+
+      {{:exit, reason}, {name, client, _connect_opts}} ->
+        Snapex7.Client.stop(client)
+        {name, {:error, reason}, nil}
+    end)
+  end
+
+  defp handshake({name, client, connect_opts}, jitter) do
+    if jitter > 0, do: Process.sleep(:rand.uniform(jitter + 1) - 1)
+
+    started_at = System.monotonic_time()
+    result = Snapex7.Client.connect_to(client, connect_opts)
+    latency = System.monotonic_time() - started_at
+
+    metadata = %{name: name, ip: Keyword.get(connect_opts, :ip), result: result}
+    :telemetry.execute([:snapex7, :fleet, :connect], %{latency: latency}, metadata)
+
+    if result != :ok do
+      Logger.debug("(#{__MODULE__}) #{inspect(name)} can't connect: #{inspect(result)}")
+    end
+
+    {result, System.convert_time_unit(latency, :native, :millisecond)}
+  end
+end
@@ -0,0 +1,36 @@
+defmodule Snapex7.Nif do
+  @moduledoc """
+  In-VM snap7 client, the `backend: :nif` of `Snapex7.Client`.
+
+  libsnap is linked into the VM and every command runs on a dirty I/O scheduler, requests
+  and replies skip the port pipe and the ETF round trip. A crash in snap7 takes the whole
+  VM down though, the port backend stays the default for fault isolation.
+
+  Commands take the `{command, arguments}` of the client port and answer the same terms,
+  only the administrative, data I/O, security and miscellaneous ones are served, the rest
+  answer `{:error, :enotsup}`.
+  """
+
+  @on_load :load_nif
+
+  @doc false
+  def load_nif do
+    path = :filename.join(:code.priv_dir(:snapex7), ~c"s7_client_nif")
+
+    # Without the NIF only the port backend is available
+    _ = :erlang.load_nif(path, 0)
+    :ok
+  end
+
+  @doc """
+  Creates a (disconnected) snap7 client, destroyed when its reference is garbage collected.
+  """
+  @spec create() :: {:ok, reference} | {:error, atom}
+  def create, do: :erlang.nif_error(:nif_not_loaded)
+
+  @doc """
+  Runs a client port command, e.g. `command(client, :db_read, {1, 0, 4})`.
+  """
+  @spec command(reference, atom, term) :: :ok | {:ok, term} | {:error, map} | {:error, atom}
+  def command(_client, _command, _arguments), do: :erlang.nif_error(:nif_not_loaded)
+end
@@ -0,0 +1,192 @@
+defmodule Snapex7.Pool do
+  use GenServer
+  require Logger
+
+  @moduledoc """
+  A pool of `Snapex7.Client` sessions to the same PLC.
+
+  S7-300/400/1500 CPUs accept several simultaneous PG/OP/S7 Basic connections, every
+  session is an independent C port (and snap7 client), so requests sent through the pool
+  run in parallel. Each request goes to the session with the fewest requests in flight,
+  a slow `full_upload/4` keeps one session busy while fast reads use the others.
+
+      {:ok, pool} = Snapex7.Pool.start_link(size: 4, connect: [ip: "192.168.0.1", rack: 0, slot: 1])
+      {:ok, data} = Snapex7.Pool.db_read(pool, db_number: 1, start: 0, amount: 4)
+      {:ok, blocks} = Snapex7.Pool.run(pool, &Snapex7.Client.list_blocks/1)
+
+  Requests that depend on the session state (e.g. `Snapex7.Client.set_session_password/2`) must be
+  sent to every session, see `sessions/1`.
+  """
+
+  defmodule State do
+    @moduledoc false
+
+    # sessions: tuple of Snapex7.Client pids
+    # in_flight: atomics with the requests in flight per session
+    defstruct sessions: {},
+              in_flight: nil
+  end
+
+  @type pool_opt ::
+          {:size, pos_integer}
+          | {:connect, [Snapex7.Client.connect_opt()]}
+          | {:connection_type, atom}
+          | {:client_opts, keyword}
+
+  @doc """
+  Start up a pool of sessions connected to the same PLC.
+  The following options are available:
+
+    * `:size` - (int) amount of sessions (default 2), check the PLC connection resources.
+
+    * `:connect` - (keyword) options of `Snapex7.Client.connect_to/2` used by every session.
+
+    * `:connection_type` - (atom) `:PG`, `:OP` or `:S7_basic`, set before connecting
+      (snap7 uses `:PG` by default).
+
+    * `:client_opts` - (keyword) options of `Snapex7.Client.start_link/1`, e.g. a
+      `Snapex7.RateLimit` shared by the sessions as `:rate_limit`.
+  """
+  @spec start_link([pool_opt], GenServer.options()) :: {:ok, pid} | {:error, term}
+  def start_link(opts, gen_opts \\ []) do
+    GenServer.start_link(__MODULE__, opts, gen_opts)
+  end
+
+  @doc """
+  Stop the pool and all its sessions.
+  """
+  @spec stop(GenServer.server()) :: :ok
+  def stop(pool) do
+    GenServer.stop(pool)
+  end
+
+  @doc """
+  Returns the `Snapex7.Client` pid of every session.
+  """
+  @spec sessions(GenServer.server()) :: [pid]
+  def sessions(pool) do
+    {sessions, _in_flight} = lookup(pool)
+    Tuple.to_list(sessions)
+  end
+
+  @doc """
+  Runs `fun` with the least busy session, e.g. `run(pool, &Snapex7.Client.list_blocks/1)`.
+  """
+  @spec run(GenServer.server(), (pid -> result)) :: result when result: term
+  def run(pool, fun) do
+    {sessions, in_flight} = lookup(pool)
+    index = least_busy(in_flight, tuple_size(sessions))
+    :atomics.add(in_flight, index, 1)
+
+    try do
+      fun.(elem(sessions, index - 1))
+    after
+      :atomics.sub(in_flight, index, 1)
+    end
+  end
+
+  @doc """
+  Sends a `Snapex7.Client.command/2` request through the least busy session.
+  """
+  @spec command(GenServer.server(), term) :: :ok | {:ok, term} | {:error, map} | {:error, :einval}
+  def command(pool, request) do
+    run(pool, &Snapex7.Client.command(&1, request))
+  end
+
+  @doc """
+  See `Snapex7.Client.read_area/2`.
+  """
+  @spec read_area(GenServer.server(), keyword) :: {:ok, bitstring} | {:error, map} | {:error, :einval}
+  def read_area(pool, opts), do: run(pool, &Snapex7.Client.read_area(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.write_area/2`.
+  """
+  @spec write_area(GenServer.server(), keyword) :: :ok | {:error, map} | {:error, :einval}
+  def write_area(pool, opts), do: run(pool, &Snapex7.Client.write_area(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.db_read/2`.
+  """
+  @spec db_read(GenServer.server(), keyword) :: {:ok, bitstring} | {:error, map} | {:error, :einval}
+  def db_read(pool, opts), do: run(pool, &Snapex7.Client.db_read(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.db_write/2`.
+  """
+  @spec db_write(GenServer.server(), keyword) :: :ok | {:error, map} | {:error, :einval}
+  def db_write(pool, opts), do: run(pool, &Snapex7.Client.db_write(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.read_multi_vars/2`.
+  """
+  @spec read_multi_vars(GenServer.server(), keyword) :: {:ok, list} | {:error, map} | {:error, :einval}
+  def read_multi_vars(pool, opts), do: run(pool, &Snapex7.Client.read_multi_vars(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.write_multi_vars/2`.
+  """
+  @spec write_multi_vars(GenServer.server(), keyword) :: :ok | {:error, map} | {:error, :einval}
+  def write_multi_vars(pool, opts), do: run(pool, &Snapex7.Client.write_multi_vars(&1, opts))
+
+  @spec init([pool_opt]) :: {:ok, Snapex7.Pool.State.t()} | {:stop, term}
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+    size = Keyword.get(opts, :size, 2)
+    connect_opts = Keyword.fetch!(opts, :connect)
+    connection_type = Keyword.get(opts, :connection_type)
+    client_opts = Keyword.get(opts, :client_opts, [])
+
+    sessions = for _ <- 1..size, do: start_session(connect_opts, connection_type, client_opts)
+
+    case Enum.find(sessions, &match?({:error, _reason}, &1)) do
+      nil ->
+        sessions = sessions |> Enum.map(fn {:ok, pid} -> pid end) |> List.to_tuple()
+        state = %State{sessions: sessions, in_flight: :atomics.new(size, signed: true)}
+        :persistent_term.put({__MODULE__, self()}, {state.sessions, state.in_flight})
+        {:ok, state}
+
+      {:error, reason} ->
+        for {:ok, pid} <- sessions, do: Snapex7.Client.stop(pid)
+        {:stop, reason}
+    end
+  end
+
+  def handle_info({:EXIT, _pid, reason}, state) do
+    {:stop, reason, state}
+  end
+
+  def terminate(_reason, state) do
+    :persistent_term.erase({__MODULE__, self()})
+
+    state.sessions
+    |> Tuple.to_list()
+    |> Enum.filter(&Process.alive?/1)
+    |> Enum.each(&Snapex7.Client.stop/1)
+  end
+
+  defp start_session(connect_opts, connection_type, client_opts) do
+    {:ok, pid} = Snapex7.Client.start_link(client_opts)
+
+    with :ok <- set_connection_type(pid, connection_type),
+         :ok <- Snapex7.Client.connect_to(pid, connect_opts) do
+      {:ok, pid}
+    else
+      error ->
+        Logger.error("(#{__MODULE__}) Can't connect a session: #{inspect(error)}")
+        Snapex7.Client.stop(pid)
+        {:error, error}
+    end
+  end
+
+  defp set_connection_type(_pid, nil), do: :ok
+  defp set_connection_type(pid, type), do: Snapex7.Client.set_connection_type(pid, type)
+
+  defp lookup(pool) do
+    :persistent_term.get({__MODULE__, GenServer.whereis(pool)})
+  end
+
+  defp least_busy(in_flight, size) do
+    Enum.min_by(1..size, &:atomics.get(in_flight, &1))
+  end
+end
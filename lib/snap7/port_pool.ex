@@ -0,0 +1,174 @@
+defmodule Snapex7.PortPool do
+  use GenServer
+  require Logger
+
+  @moduledoc """
+  A warm pool of already spawned `s7_client.o` ports.
+
+  Starting a `Snapex7.Client` forks and execs the C port, which then dynamically loads
+  `libsnap`. When a whole line restarts, hundreds of clients do that at once. With a pool
+  running, a client checks out a started port instead (a message), and the pool spawns
+  a replacement once the pending checkouts are served.
+
+      children = [
+        {Snapex7.PortPool, size: 32},
+        ...
+      ]
+
+  Clients use the pool registered as `Snapex7.PortPool` by default (see the `:port_pool`
+  option of `Snapex7.Client.start_link/1`). They spawn their own port when it isn't
+  running or is empty.
+  """
+
+  defmodule State do
+    @moduledoc false
+
+    # size: amount of warm ports kept
+    # ports: queue of warm ports, owned by the pool until checked out
+    defstruct size: 0,
+              ports: :queue.new()
+  end
+
+  @type pool_opt :: {:size, non_neg_integer} | {:name, GenServer.name()}
+
+  @doc """
+  Start up a pool of warm ports.
+  The following options are available:
+
+    * `:size` - (int) amount of warm ports (default 8).
+
+    * `:name` - name of the pool (default `Snapex7.PortPool`).
+  """
+  @spec start_link([pool_opt]) :: {:ok, pid} | {:error, term}
+  def start_link(opts \\ []) do
+    {name, opts} = Keyword.pop(opts, :name, __MODULE__)
+    GenServer.start_link(__MODULE__, opts, name: name)
+  end
+
+  @doc false
+  def child_spec(opts) do
+    %{id: Keyword.get(opts, :name, __MODULE__), start: {__MODULE__, :start_link, [opts]}}
+  end
+
+  @doc """
+  Stop the pool, its warm ports are closed.
+  """
+  @spec stop(GenServer.server()) :: :ok
+  def stop(pool \\ __MODULE__) do
+    GenServer.stop(pool)
+  end
+
+  @doc """
+  Hands a warm port to the calling process (it becomes its connected process), or
+  `{:error, :empty}` when there is none left.
+  """
+  @spec checkout(GenServer.server()) :: {:ok, port} | {:error, :empty} | {:error, :noproc}
+  def checkout(pool \\ __MODULE__) do
+    if GenServer.whereis(pool) do
+      port_or_error = GenServer.call(pool, :checkout)
+
+      with {:ok, port} <- port_or_error do
+        Process.link(port)
+        {:ok, port}
+      end
+    else
+      {:error, :noproc}
+    end
+  catch
+    # the pool stopped meanwhile
+    :exit, _reason -> {:error, :noproc}
+  end
+
+  @doc """
+  Returns the amount of warm ports.
+  """
+  @spec available(GenServer.server()) :: non_neg_integer
+  def available(pool \\ __MODULE__) do
+    GenServer.call(pool, :available)
+  end
+
+  @doc false
+  # Spawns a client port linked to the caller
+  @spec open_port() :: port
+  def open_port do
+    executable = :code.priv_dir(:snapex7) ++ ~c"/s7_client.o"
+
+    Port.open({:spawn_executable, executable}, [
+      {:args, []},
+      {:packet, 2},
+      :use_stdio,
+      :binary,
+      :exit_status
+    ])
+  end
+
+  @doc false
+  # The ports find libsnap through the environment they inherit
+  @spec put_library_path() :: :ok
+  def put_library_path do
+    snap7_dir = :code.priv_dir(:snapex7) |> List.to_string()
+    System.put_env("LD_LIBRARY_PATH", snap7_dir)
+    System.put_env("DYLD_LIBRARY_PATH", snap7_dir)
+  end
+
+  @spec init([pool_opt]) :: {:ok, Snapex7.PortPool.State.t(), {:continue, :replenish}}
+  def init(opts) do
+    put_library_path()
+    {:ok, %State{size: Keyword.get(opts, :size, 8)}, {:continue, :replenish}}
+  end
+
+  def handle_continue(:replenish, state) do
+    {:noreply, replenish(state)}
+  end
+
+  def handle_call(:checkout, {pid, _tag}, state) do
+    case :queue.out(state.ports) do
+      {{:value, port}, ports} ->
+        # the client links the port, the pool lets go of it
+        Port.connect(port, pid)
+        Process.unlink(port)
+        # spawned after the checkouts already in the mailbox (e.g. a burst of clients)
+        send(self(), :replenish)
+        {:reply, {:ok, port}, %State{state | ports: ports}}
+
+      {:empty, _ports} ->
+        send(self(), :replenish)
+        {:reply, {:error, :empty}, state}
+    end
+  end
+
+  def handle_call(:available, _from, state) do
+    {:reply, :queue.len(state.ports), state}
+  end
+
+  def handle_info({port, {:exit_status, status}}, state) when is_port(port) do
+    Logger.error("(#{__MODULE__}) A warm port exited with status #{status}")
+    ports = :queue.filter(&(&1 != port), state.ports)
+    {:noreply, replenish(%State{state | ports: ports})}
+  end
+
+  def handle_info(:replenish, state) do
+    {:noreply, replenish(state)}
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  def terminate(_reason, state) do
+    state.ports
+    |> :queue.to_list()
+    |> Enum.each(&Port.close/1)
+  end
+
+  defp replenish(state) do
+    missing = max(state.size - :queue.len(state.ports), 0)
+
+    ports =
+      Stream.repeatedly(&open_port/0)
+      |> Enum.take(missing)
+      |> Enum.reduce(state.ports, &:queue.in/2)
+
+    %State{state | ports: ports}
+  end
+end
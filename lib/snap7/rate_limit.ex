@@ -0,0 +1,219 @@
+defmodule Snapex7.RateLimit do
+  @moduledoc """
+  A communication budget of a PLC, in PDUs/s and bytes/s.
+
+  S7-1200 CPUs serve PUT/GET requests in the scan cycle communication load, a flood of
+  requests makes their scan time grow. A `Snapex7.Client` started with a `:rate_limit`
+  parks a request that doesn't fit in the budget until it has room (the client goes on
+  with the requests that fit), so many processes sharing it (or several clients sharing a
+  limiter, e.g. the sessions of a `Snapex7.Pool`) can't go over it:
+
+      limiter = Snapex7.RateLimit.new(pdus: 50, bytes: 20_000, bulk_share: 0.25)
+      {:ok, pool} =
+        Snapex7.Pool.start_link(
+          size: 4,
+          connect: [ip: "192.168.0.1", rack: 0, slot: 1],
+          client_opts: [rate_limit: limiter]
+        )
+
+  Every request costs a PDU and its bytes before it is sent, the bytes of the reply (and the
+  PDUs a long transfer is split in) are charged once it comes. The budget is a token bucket
+  (a GCRA, with the theoretical arrival time of each bucket in an `:atomics`, no process in
+  between) refilled continuously, `:burst` ms of it can be spent at once.
+
+  Bulk requests (block transfers, SZL, see "Priorities" in the README) also go through a
+  bucket of `:bulk_share` of the budget: they are shaped first and leave the rest to the
+  other requests. Realtime requests are charged but never wait. A request that would wait
+  past its deadline is answered `{:error, :timeout}` without reaching the PLC.
+
+  Each wait emits a `[:snapex7, :client, :throttled]` telemetry event with the `:delay` (ms)
+  measurement and the `:command`, `:ip` and `:priority` metadata, `usage/1` tells how much
+  of the budget is being used.
+  """
+
+  # buckets: the theoretical arrival time (native units) of each one
+  @pdus 1
+  @bytes 2
+  @bulk_pdus 3
+  @bulk_bytes 4
+  # counters
+  @delayed 5
+  @delay 6
+  @timeouts 7
+
+  defstruct ref: nil,
+            pdu_interval: nil,
+            byte_interval: nil,
+            bulk_pdu_interval: nil,
+            bulk_byte_interval: nil,
+            pdu_size: 240,
+            tolerance: 0
+
+  @type t :: %__MODULE__{}
+
+  @type rate_limit_opt ::
+          {:pdus, pos_integer}
+          | {:bytes, pos_integer}
+          | {:burst, non_neg_integer}
+          | {:bulk_share, float}
+          | {:pdu_size, pos_integer}
+
+  @doc """
+  Creates a budget, pass it as the `:rate_limit` of the clients sharing it.
+  The following options are available:
+
+    * `:pdus` - (int) PDUs per second (default unlimited).
+
+    * `:bytes` - (int) data bytes per second, requests and replies (default unlimited).
+
+    * `:burst` - (int) ms of budget that can be spent back to back (default 100).
+
+    * `:bulk_share` - (float) share of the budget bulk requests can use, above 0 and up to
+      1 (default 0.5).
+
+    * `:pdu_size` - (int) bytes of data in a PDU, to count the PDUs of long transfers
+      (default 240, the smallest S7 PDU).
+  """
+  @spec new([rate_limit_opt]) :: t
+  def new(opts \\ []) do
+    pdus = Keyword.get(opts, :pdus)
+    bytes = Keyword.get(opts, :bytes)
+    bulk_share = Keyword.get(opts, :bulk_share, 0.5)
+
+    unless is_number(bulk_share) and bulk_share > 0 and bulk_share <= 1 do
+      raise ArgumentError, "bulk_share must be above 0 and up to 1, got: #{inspect(bulk_share)}"
+    end
+
+    ref = :atomics.new(7, signed: true)
+    now = System.monotonic_time()
+    for bucket <- [@pdus, @bytes, @bulk_pdus, @bulk_bytes], do: :atomics.put(ref, bucket, now)
+
+    %__MODULE__{
+      ref: ref,
+      pdu_interval: interval(pdus, 1),
+      byte_interval: interval(bytes, 1),
+      bulk_pdu_interval: interval(pdus, bulk_share),
+      bulk_byte_interval: interval(bytes, bulk_share),
+      pdu_size: Keyword.get(opts, :pdu_size, 240),
+      tolerance: System.convert_time_unit(Keyword.get(opts, :burst, 100), :millisecond, :native)
+    }
+  end
+
+  @doc """
+  Takes `pdus` and `bytes` from the budget, returns the ms to wait before sending the
+  request, or `{:error, :timeout}` (nothing taken) when that is more than `max_wait` ms.
+  Realtime requests never wait.
+  """
+  @spec acquire(t, non_neg_integer, non_neg_integer, atom, non_neg_integer) ::
+          {:ok, non_neg_integer} | {:error, :timeout}
+  def acquire(limiter, pdus, bytes, priority, max_wait) do
+    buckets = buckets(limiter, pdus, bytes, priority)
+    now = System.monotonic_time()
+
+    if priority != :realtime and wait(limiter, buckets, now, &peek/4) > ms(max_wait) do
+      :atomics.add(limiter.ref, @timeouts, 1)
+      {:error, :timeout}
+    else
+      delay = wait(limiter, buckets, now, &take/4)
+
+      if priority != :realtime and delay > 0 do
+        :atomics.add(limiter.ref, @delayed, 1)
+        :atomics.add(limiter.ref, @delay, delay)
+        {:ok, System.convert_time_unit(delay, :native, :millisecond) + 1}
+      else
+        {:ok, 0}
+      end
+    end
+  end
+
+  @doc """
+  Charges the bytes of a reply, with the PDUs past the first one, to the budget, the next
+  requests wait for them.
+  """
+  @spec charge(t, non_neg_integer, atom) :: :ok
+  def charge(limiter, bytes, priority) do
+    buckets = buckets(limiter, div(bytes, limiter.pdu_size), bytes, priority)
+    wait(limiter, buckets, System.monotonic_time(), &take/4)
+    :ok
+  end
+
+  @doc """
+  Returns the budget usage:
+
+    * `:pdus`/`:bytes` - used part of the burst (or of a PDU/byte interval without a burst),
+      0.0 when idle and 1.0 when it is spent, above that requests are waiting (nil when
+      unlimited).
+
+    * `:delayed` - requests that waited, for `:delay` ms overall.
+
+    * `:timeouts` - requests answered `{:error, :timeout}` instead of waiting.
+  """
+  @spec usage(t) :: %{
+          pdus: float | nil,
+          bytes: float | nil,
+          delayed: non_neg_integer,
+          delay: non_neg_integer,
+          timeouts: non_neg_integer
+        }
+  def usage(limiter) do
+    now = System.monotonic_time()
+
+    %{
+      pdus: used(limiter, limiter.pdu_interval, @pdus, now),
+      bytes: used(limiter, limiter.byte_interval, @bytes, now),
+      delayed: :atomics.get(limiter.ref, @delayed),
+      delay: System.convert_time_unit(:atomics.get(limiter.ref, @delay), :native, :millisecond),
+      timeouts: :atomics.get(limiter.ref, @timeouts)
+    }
+  end
+
+  defp used(_limiter, nil, _bucket, _now), do: nil
+
+  defp used(limiter, interval, bucket, now) do
+    max(:atomics.get(limiter.ref, bucket) - now, 0) / max(limiter.tolerance, interval)
+  end
+
+  defp buckets(limiter, pdus, bytes, priority) do
+    buckets = [{@pdus, limiter.pdu_interval, pdus}, {@bytes, limiter.byte_interval, bytes}]
+
+    if priority == :bulk do
+      [{@bulk_pdus, limiter.bulk_pdu_interval, pdus}, {@bulk_bytes, limiter.bulk_byte_interval, bytes} | buckets]
+    else
+      buckets
+    end
+  end
+
+  # The longest wait of the buckets, each one is peeked at or taken from. A request starts
+  # once the theoretical arrival time of the bucket is at most the burst tolerance ahead.
+  defp wait(limiter, buckets, now, fun) do
+    Enum.reduce(buckets, 0, fn
+      {_bucket, nil, _cost}, delay ->
+        delay
+
+      {bucket, interval, cost}, delay ->
+        start = fun.(limiter.ref, bucket, now, cost * interval)
+        max(start - limiter.tolerance - now, delay)
+    end)
+  end
+
+  defp peek(ref, bucket, now, _cost), do: max(:atomics.get(ref, bucket), now)
+
+  defp take(ref, bucket, now, cost) do
+    tat = :atomics.get(ref, bucket)
+    start = max(tat, now)
+
+    case :atomics.compare_exchange(ref, bucket, tat, start + cost) do
+      :ok -> start
+      # another client took from the bucket meanwhile
+      _changed -> take(ref, bucket, now, cost)
+    end
+  end
+
+  defp interval(nil, _share), do: nil
+
+  defp interval(rate, share) do
+    max(round(System.convert_time_unit(1, :second, :native) / (rate * share)), 1)
+  end
+
+  defp ms(time), do: System.convert_time_unit(time, :millisecond, :native)
+end
@@ -0,0 +1,389 @@
+defmodule Snapex7.Redundant do
+  use GenServer
+  require Logger
+
+  @moduledoc """
+  A redundant (H-system) connection to the two CPUs of a S7-400H / S7-1500R/H.
+
+  Both CPUs get a hot `Snapex7.Client` session. Requests go to the master one, a request
+  failing with a dropped connection (ISO connect/send/receive, TCP errors or
+  `{:error, :disconnected}`) switches the master to the standby and is sent again there,
+  so the switchover costs a PDU instead of a reconnect and the PDU negotiation. The
+  requests queued in the failed session fail fast and follow the same path.
+
+      {:ok, h} =
+        Snapex7.Redundant.start_link(
+          cpus: [[ip: "192.168.0.1", rack: 0, slot: 3], [ip: "192.168.0.2", rack: 1, slot: 3]]
+        )
+
+      {:ok, data} = Snapex7.Redundant.db_read(h, db_number: 1, start: 0, amount: 4)
+
+  The master is checked every `:check_interval` ms with the `:master?` function, by default
+  the CPU in RUN (`Snapex7.Client.get_plc_status/1`). The checks and the reconnects of a
+  failed CPU run in a task, a switchover never waits for them. The H-CPUs also tell which one is the
+  master in the SZL 0x0071 (H CPU group information), check the record layout of your CPU:
+
+      master? = fn client ->
+        case Snapex7.Client.read_szl(client, 0x0071, 0) do
+          {:ok, szl} -> master_flag?(szl)
+          _error -> false
+        end
+      end
+
+  Every switchover emits a `[:snapex7, :redundant, :switchover]` telemetry event with the
+  `:from`/`:to` CPU indexes and the `:reason`.
+  """
+
+  defmodule State do
+    @moduledoc false
+
+    # sessions: {cpu 0, cpu 1} Snapex7.Client pids
+    # master: atomics with the index of the master session
+    # cpus: connect opts of each CPU
+    # connected: {cpu 0, cpu 1} connection state as of the last check or notification
+    # check: ref of the running check task
+    defstruct sessions: {},
+              master: nil,
+              cpus: {},
+              connected: {false, false},
+              master?: nil,
+              check_interval: 1000,
+              check: nil
+  end
+
+  @type redundant_opt ::
+          {:cpus, [[Snapex7.Client.connect_opt()]]}
+          | {:writes, :master | :mirror}
+          | {:master?, (pid -> boolean)}
+          | {:check_interval, pos_integer}
+          | {:connection_type, atom}
+          | {:client_opts, keyword}
+
+  @doc """
+  Start up the sessions to both CPUs, it fails when none of them connects.
+  The following options are available:
+
+    * `:cpus` - (list) the `Snapex7.Client.connect_to/2` options of both CPUs, the first one
+      is preferred as master.
+
+    * `:writes` - `:master` (default) writes to the master only, the H-system synchronizes
+      the standby, `:mirror` writes to both CPUs and returns the master result.
+
+    * `:master?` - (fun) tells if the CPU of a session is the master (default: in RUN).
+
+    * `:check_interval` - (int) master check period in ms (default 1000), disconnected
+      sessions are connected again then.
+
+    * `:connection_type` - (atom) `:PG`, `:OP` or `:S7_basic`, set before connecting.
+
+    * `:client_opts` - (keyword) options of `Snapex7.Client.start_link/1`.
+  """
+  @spec start_link([redundant_opt], GenServer.options()) :: {:ok, pid} | {:error, term}
+  def start_link(opts, gen_opts \\ []) do
+    GenServer.start_link(__MODULE__, opts, gen_opts)
+  end
+
+  @doc """
+  Stop the redundant connection and both sessions.
+  """
+  @spec stop(GenServer.server()) :: :ok
+  def stop(redundant) do
+    GenServer.stop(redundant)
+  end
+
+  @doc """
+  Returns the `Snapex7.Client` pid of each CPU session.
+  """
+  @spec sessions(GenServer.server()) :: [pid]
+  def sessions(redundant) do
+    {sessions, _master, _writes} = lookup(redundant)
+    Tuple.to_list(sessions)
+  end
+
+  @doc """
+  Returns the `Snapex7.Client` pid of the master CPU.
+  """
+  @spec master(GenServer.server()) :: pid
+  def master(redundant) do
+    {sessions, master, _writes} = lookup(redundant)
+    elem(sessions, :atomics.get(master, 1))
+  end
+
+  @doc """
+  Runs `fun` with the master session, and once more with the new master when it fails with
+  a dropped connection, e.g. `run(h, &Snapex7.Client.list_blocks/1)`.
+  """
+  @spec run(GenServer.server(), (pid -> result)) :: result when result: term
+  def run(redundant, fun) do
+    {sessions, master, _writes} = lookup(redundant)
+    index = :atomics.get(master, 1)
+    result = fun.(elem(sessions, index))
+
+    if connection_error?(result) do
+      case GenServer.call(redundant, {:failover, index, result}) do
+        {:ok, new_index} -> fun.(elem(sessions, new_index))
+        :error -> result
+      end
+    else
+      result
+    end
+  end
+
+  @doc """
+  Runs the write `fun` according to the `:writes` policy, the result is the master one.
+  A mirrored write isn't sent again when the master fails, the standby result is returned.
+  """
+  @spec run_write(GenServer.server(), (pid -> result)) :: result when result: term
+  def run_write(redundant, fun) do
+    case lookup(redundant) do
+      {sessions, master, :mirror} ->
+        index = :atomics.get(master, 1)
+        mirror = Task.async(fn -> fun.(elem(sessions, 1 - index)) end)
+        result = fun.(elem(sessions, index))
+        mirrored = Task.await(mirror, :infinity)
+
+        cond do
+          connection_error?(result) ->
+            GenServer.call(redundant, {:failover, index, result})
+            mirrored
+
+          mirrored != :ok ->
+            Logger.debug("(#{__MODULE__}) Mirrored write failed: #{inspect(mirrored)}")
+            result
+
+          true ->
+            result
+        end
+
+      _master ->
+        run(redundant, fun)
+    end
+  end
+
+  @doc """
+  Sends a `Snapex7.Client.command/2` request to the master CPU (requests ending in
+  `_write`, `download`, `delete` and `db_fill` follow the `:writes` policy).
+  """
+  @spec command(GenServer.server(), term) :: :ok | {:ok, term} | {:error, map} | {:error, :einval}
+  def command(redundant, request) do
+    if write_request?(request) do
+      run_write(redundant, &Snapex7.Client.command(&1, request))
+    else
+      run(redundant, &Snapex7.Client.command(&1, request))
+    end
+  end
+
+  @doc """
+  See `Snapex7.Client.read_area/2`.
+  """
+  @spec read_area(GenServer.server(), keyword) :: {:ok, bitstring} | {:error, map} | {:error, :einval}
+  def read_area(redundant, opts), do: run(redundant, &Snapex7.Client.read_area(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.write_area/2`.
+  """
+  @spec write_area(GenServer.server(), keyword) :: :ok | {:error, map} | {:error, :einval}
+  def write_area(redundant, opts), do: run_write(redundant, &Snapex7.Client.write_area(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.db_read/2`.
+  """
+  @spec db_read(GenServer.server(), keyword) :: {:ok, bitstring} | {:error, map} | {:error, :einval}
+  def db_read(redundant, opts), do: run(redundant, &Snapex7.Client.db_read(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.db_write/2`.
+  """
+  @spec db_write(GenServer.server(), keyword) :: :ok | {:error, map} | {:error, :einval}
+  def db_write(redundant, opts), do: run_write(redundant, &Snapex7.Client.db_write(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.read_multi_vars/2`.
+  """
+  @spec read_multi_vars(GenServer.server(), keyword) :: {:ok, list} | {:error, map} | {:error, :einval}
+  def read_multi_vars(redundant, opts), do: run(redundant, &Snapex7.Client.read_multi_vars(&1, opts))
+
+  @doc """
+  See `Snapex7.Client.write_multi_vars/2`.
+  """
+  @spec write_multi_vars(GenServer.server(), keyword) :: :ok | {:error, map} | {:error, :einval}
+  def write_multi_vars(redundant, opts),
+    do: run_write(redundant, &Snapex7.Client.write_multi_vars(&1, opts))
+
+  @spec init([redundant_opt]) :: {:ok, Snapex7.Redundant.State.t()} | {:stop, term}
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+    [cpu_0, cpu_1] = Keyword.fetch!(opts, :cpus)
+    client_opts = Keyword.get(opts, :client_opts, [])
+    connection_type = Keyword.get(opts, :connection_type)
+
+    sessions =
+      for _cpu <- [cpu_0, cpu_1] do
+        {:ok, pid} = Snapex7.Client.start_link(client_opts)
+        :ok = set_connection_type(pid, connection_type)
+        pid
+      end
+
+    state = %State{
+      sessions: List.to_tuple(sessions),
+      master: :atomics.new(1, signed: false),
+      # the checks reconnect the sessions from a task, they notify this process anyway
+      cpus: {Keyword.put_new(cpu_0, :notify, self()), Keyword.put_new(cpu_1, :notify, self())},
+      master?: Keyword.get(opts, :master?, &running?/1),
+      check_interval: Keyword.get(opts, :check_interval, 1000)
+    }
+
+    connected = for index <- [0, 1], connect(state, index) == :ok, do: index
+    state = %State{state | connected: {0 in connected, 1 in connected}}
+
+    case Enum.find(connected, &state.master?.(elem(state.sessions, &1))) || List.first(connected) do
+      nil ->
+        Enum.each(sessions, &Snapex7.Client.stop/1)
+        {:stop, :no_cpu}
+
+      index ->
+        :atomics.put(state.master, 1, index)
+        writes = Keyword.get(opts, :writes, :master)
+        :persistent_term.put({__MODULE__, self()}, {state.sessions, state.master, writes})
+        Process.send_after(self(), :check, state.check_interval)
+        {:ok, state}
+    end
+  end
+
+  # A caller saw the master connection drop, only the first one switches
+  def handle_call({:failover, index, reason}, _from, state) do
+    case :atomics.get(state.master, 1) do
+      ^index -> {:reply, switchover(state, index, reason), state}
+      new_index -> {:reply, {:ok, new_index}, state}
+    end
+  end
+
+  # Dead peer notification of a session (see the :health option of Snapex7.Client)
+  def handle_info({:snapex7, session, {:disconnected, reason}}, state) do
+    index = :atomics.get(state.master, 1)
+
+    state =
+      case Enum.find([0, 1], &(elem(state.sessions, &1) == session)) do
+        nil -> state
+        cpu -> %State{state | connected: put_elem(state.connected, cpu, false)}
+      end
+
+    if elem(state.sessions, index) == session do
+      switchover(state, index, reason)
+    end
+
+    {:noreply, state}
+  end
+
+  def handle_info(:check, state) do
+    index = :atomics.get(state.master, 1)
+    %Task{ref: ref} = Task.async(fn -> check(state, index) end)
+    {:noreply, %State{state | check: ref}}
+  end
+
+  def handle_info({ref, {connected, switch}}, %State{check: ref} = state) do
+    Process.demonitor(ref, [:flush])
+    state = %State{state | connected: connected, check: nil}
+    index = :atomics.get(state.master, 1)
+
+    # the master may have changed while checking
+    if switch == index do
+      switchover(state, index, :standby_is_master)
+    end
+
+    Process.send_after(self(), :check, state.check_interval)
+    {:noreply, state}
+  end
+
+  def handle_info({:DOWN, ref, :process, _pid, reason}, %State{check: ref} = state) do
+    Logger.error("(#{__MODULE__}) Master check crashed: #{inspect(reason)}")
+    Process.send_after(self(), :check, state.check_interval)
+    {:noreply, %State{state | check: nil}}
+  end
+
+  def handle_info({:EXIT, pid, reason}, state) do
+    if pid in Tuple.to_list(state.sessions) do
+      {:stop, reason, state}
+    else
+      # a check task
+      {:noreply, state}
+    end
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  def terminate(_reason, state) do
+    :persistent_term.erase({__MODULE__, self()})
+
+    state.sessions
+    |> Tuple.to_list()
+    |> Enum.filter(&Process.alive?/1)
+    |> Enum.each(&Snapex7.Client.stop/1)
+  end
+
+  # Reconnects the failed CPUs and tells which master to switch over from, run by a task
+  defp check(state, index) do
+    connected =
+      for cpu <- [0, 1] do
+        Snapex7.Client.get_connected(elem(state.sessions, cpu)) == {:ok, true} or connect(state, cpu) == :ok
+      end
+
+    switch =
+      if not state.master?.(elem(state.sessions, index)) and state.master?.(elem(state.sessions, 1 - index)) do
+        index
+      end
+
+    {List.to_tuple(connected), switch}
+  end
+
+  defp switchover(state, index, reason) do
+    standby = 1 - index
+
+    if elem(state.connected, standby) do
+      :atomics.put(state.master, 1, standby)
+      Logger.warn("(#{__MODULE__}) Switched over to CPU #{standby}: #{inspect(reason)}")
+      :telemetry.execute([:snapex7, :redundant, :switchover], %{}, %{from: index, to: standby, reason: reason})
+      {:ok, standby}
+    else
+      :error
+    end
+  end
+
+  defp connect(state, index) do
+    response = Snapex7.Client.connect_to(elem(state.sessions, index), elem(state.cpus, index))
+
+    if response != :ok do
+      Logger.debug("(#{__MODULE__}) Can't connect CPU #{index}: #{inspect(response)}")
+    end
+
+    response
+  end
+
+  defp running?(session) do
+    Snapex7.Client.get_plc_status(session) == {:ok, :S7CpuStatusRun}
+  end
+
+  defp set_connection_type(_pid, nil), do: :ok
+  defp set_connection_type(pid, type), do: Snapex7.Client.set_connection_type(pid, type)
+
+  defp connection_error?({:error, :disconnected}), do: true
+
+  defp connection_error?({:error, %{} = reasons}) do
+    Map.get(reasons, :eiso) in [:errIsoConnect, :errIsoDisconnect, :errIsoSendPacket, :errIsoRecvPacket] or
+      is_integer(Map.get(reasons, :etcp))
+  end
+
+  defp connection_error?(_result), do: false
+
+  defp write_request?({command, _args}) do
+    command in [:download, :delete, :db_fill] or String.ends_with?(Atom.to_string(command), "_write")
+  end
+
+  defp write_request?(_request), do: false
+
+  defp lookup(redundant) do
+    :persistent_term.get({__MODULE__, GenServer.whereis(redundant)})
+  end
+end
@@ -0,0 +1,372 @@
+defmodule Snapex7.Scheduler do
+  use GenServer
+  require Logger
+
+  @moduledoc """
+  Polls many PLCs from a single scheduler, earliest deadline first.
+
+  Every poll group runs a client request (as in `Snapex7.Client.command/2`) once per
+  `:cycle` ms and should be done within `:deadline` ms of its release. Released polls wait
+  in a single queue ordered by their absolute deadline and start as soon as their client
+  is idle (a client runs one request at a time), at most `:max_concurrency` at once. The
+  first release of each group is shifted by a fraction of its cycle, so groups with the
+  same cycle don't all hit the network in the same millisecond.
+
+  Groups of rarely changing data (recipes, configuration) can poll adaptively: with a
+  `:max_cycle`, every poll returning the same value as the previous one doubles the cycle,
+  up to `:max_cycle`, and a changed value brings it back to `:cycle`.
+
+      {:ok, _pid} =
+        Snapex7.Scheduler.start_link(
+          name: :polls,
+          cache: :plc_cache,
+          groups: [
+            press_1: [client: press_1, request: {:db_read, [db_number: 1, start: 0, amount: 8]}, cycle: 100],
+            press_2: [client: press_2, request: {:db_read, [db_number: 1, start: 0, amount: 8]}, cycle: 100],
+            oven: [client: oven, request: {:read_area, [area: :MK, start: 0, amount: 16]}, cycle: 500, deadline: 200]
+          ]
+        )
+
+      Snapex7.Scheduler.stats(:polls)
+
+  Successful values are published in the `Snapex7.Cache` named by `:cache` (under the group
+  name) and every result is passed to `:on_result`. Each run emits a
+  `[:snapex7, :scheduler, :run]` telemetry event with the `:jitter` and `:duration`
+  (native units) measurements and the `:group` and `:late` metadata.
+  """
+
+  defmodule State do
+    @moduledoc false
+
+    # groups: %{name => %{client, request, cycle, max_cycle, current, deadline, release,
+    #   released, pending, last, stats}}, current is the adaptive cycle, release the next
+    #   release time, released the last one, pending the absolute deadline of a released
+    #   poll and last the last value
+    # ready: gb_set of {deadline, seq, name}, released polls in EDF order
+    # running: %{task ref => {name, client, release, started_at}}
+    # busy: clients with a poll running
+    # tasks: Task.Supervisor of the polls, a crashing poll doesn't take the scheduler down
+    defstruct groups: %{},
+              ready: :gb_sets.empty(),
+              running: %{},
+              busy: MapSet.new(),
+              seq: 0,
+              max_concurrency: 16,
+              cache: nil,
+              on_result: nil,
+              timer: nil,
+              tasks: nil
+  end
+
+  @type group_opt ::
+          {:client, GenServer.server()}
+          | {:request, term}
+          | {:cycle, pos_integer}
+          | {:max_cycle, pos_integer}
+          | {:deadline, pos_integer}
+
+  @type scheduler_opt ::
+          {:name, GenServer.name()}
+          | {:groups, [{term, [group_opt]}]}
+          | {:max_concurrency, pos_integer}
+          | {:cache, atom}
+          | {:on_result, (term, term -> any)}
+
+  @doc """
+  Start up a poll scheduler.
+  The following options are available:
+
+    * `:groups` - (keyword) poll groups, each with its `Snapex7.Client` `:client`, the
+      `:request`, the `:cycle` in ms (default 1000), the `:max_cycle` of the adaptive
+      polling in ms (default the cycle, not adaptive) and the `:deadline` in ms after each
+      release (default the cycle).
+
+    * `:max_concurrency` - (int) polls running at the same time (default 16).
+
+    * `:cache` - (atom) `Snapex7.Cache` the successful values are published to.
+
+    * `:on_result` - (fun) called with the group name and the result of every poll.
+
+    * `:name` - name of the scheduler.
+  """
+  @spec start_link([scheduler_opt]) :: {:ok, pid} | {:error, term}
+  def start_link(opts) do
+    {gen_opts, opts} = Keyword.split(opts, [:name])
+    GenServer.start_link(__MODULE__, opts, gen_opts)
+  end
+
+  @doc """
+  Stop the scheduler, the polls running are dropped.
+  """
+  @spec stop(GenServer.server()) :: :ok
+  def stop(scheduler) do
+    GenServer.stop(scheduler)
+  end
+
+  @doc """
+  Returns the stats of every group since it started (or since the last reset):
+
+    * `:runs` - polls done.
+
+    * `:late` - polls done after their deadline.
+
+    * `:skipped` - releases dropped because the previous poll of the group wasn't done
+      (cycle overruns).
+
+    * `:jitter` - delay between the release and the start of the polls (`%{min, max, mean}`,
+      in microseconds).
+
+    * `:duration` - duration of the polls (`%{min, max, mean}`, in microseconds).
+
+    * `:cycle` - current cycle in ms (see `:max_cycle`).
+
+  The following options are available:
+
+    * `:reset` - (boolean) clears the stats after reading them (default false).
+  """
+  @spec stats(GenServer.server(), [{:reset, boolean}]) :: %{term => map}
+  def stats(scheduler, opts \\ []) do
+    GenServer.call(scheduler, {:stats, Keyword.get(opts, :reset, false)})
+  end
+
+  @spec init([scheduler_opt]) :: {:ok, Snapex7.Scheduler.State.t()}
+  def init(opts) do
+    groups = Keyword.get(opts, :groups, [])
+    count = max(length(groups), 1)
+    now = now()
+
+    groups =
+      groups
+      |> Enum.with_index()
+      |> Map.new(fn {{name, group_opts}, index} ->
+        cycle = Keyword.get(group_opts, :cycle, 1000)
+
+        group = %{
+          client: Keyword.fetch!(group_opts, :client),
+          request: Keyword.fetch!(group_opts, :request),
+          cycle: cycle,
+          max_cycle: max(Keyword.get(group_opts, :max_cycle, cycle), cycle),
+          current: cycle,
+          deadline: Keyword.get(group_opts, :deadline, cycle),
+          # phases spread over the cycle
+          release: now + div(index * ms(cycle), count),
+          released: nil,
+          pending: nil,
+          last: nil,
+          stats: new_stats()
+        }
+
+        {name, group}
+      end)
+
+    {:ok, tasks} = Task.Supervisor.start_link()
+
+    state = %State{
+      tasks: tasks,
+      groups: groups,
+      max_concurrency: Keyword.get(opts, :max_concurrency, 16),
+      cache: Keyword.get(opts, :cache),
+      on_result: Keyword.get(opts, :on_result)
+    }
+
+    {:ok, schedule(state)}
+  end
+
+  def handle_call({:stats, reset}, _from, state) do
+    stats =
+      Map.new(state.groups, fn {name, group} ->
+        {name, Map.put(report(group.stats), :cycle, group.current)}
+      end)
+
+    groups =
+      if reset do
+        Map.new(state.groups, fn {name, group} -> {name, %{group | stats: new_stats()}} end)
+      else
+        state.groups
+      end
+
+    {:reply, stats, %State{state | groups: groups}}
+  end
+
+  def handle_info({:timeout, timer, :release}, %State{timer: timer} = state) do
+    {:noreply, state |> release(now()) |> dispatch() |> schedule()}
+  end
+
+  def handle_info({:timeout, _timer, :release}, state), do: {:noreply, state}
+
+  def handle_info({ref, result}, state) when is_reference(ref) do
+    case Map.pop(state.running, ref) do
+      {nil, _running} ->
+        {:noreply, state}
+
+      {{name, client, release, started_at}, running} ->
+        Process.demonitor(ref, [:flush])
+        done_at = now()
+        group = Map.fetch!(state.groups, name)
+        late = done_at > group.pending
+
+        jitter = started_at - release
+        duration = done_at - started_at
+        measurements = %{jitter: jitter, duration: duration}
+        :telemetry.execute([:snapex7, :scheduler, :run], measurements, %{group: name, late: late})
+        publish(state, name, result)
+
+        group = %{group | pending: nil, stats: record(group.stats, jitter, duration, late)}
+        group = adapt(group, result, done_at)
+        {:noreply, state |> done(name, group, client, running) |> dispatch() |> schedule()}
+    end
+  end
+
+  def handle_info({:DOWN, ref, :process, _pid, reason}, state) do
+    case Map.pop(state.running, ref) do
+      {nil, _running} ->
+        {:noreply, state}
+
+      {{name, client, _release, _started_at}, running} ->
+        Logger.error("(#{__MODULE__}) #{inspect(name)} poll crashed: #{inspect(reason)}")
+        group = %{Map.fetch!(state.groups, name) | pending: nil}
+        {:noreply, state |> done(name, group, client, running) |> dispatch() |> schedule()}
+    end
+  end
+
+  def handle_info(_msg, state) do
+    {:noreply, state}
+  end
+
+  # Queues the groups due at `now`, a group whose previous poll isn't done skips the release
+  defp release(state, now) do
+    Enum.reduce(state.groups, state, fn
+      {name, %{release: release} = group}, state when release <= now ->
+        # missed releases (e.g. a long GC) are skipped, not run back to back
+        missed = div(now - release, ms(group.current))
+        released = release + missed * ms(group.current)
+        next = released + ms(group.current)
+
+        if group.pending == nil do
+          deadline = released + ms(group.deadline)
+          ready = :gb_sets.add({deadline, state.seq, name}, state.ready)
+          stats = skip(group.stats, missed)
+          group = %{group | release: next, released: released, pending: deadline, stats: stats}
+          %State{state | groups: Map.put(state.groups, name, group), ready: ready, seq: state.seq + 1}
+        else
+          group = %{group | release: next, stats: skip(group.stats, missed + 1)}
+          %State{state | groups: Map.put(state.groups, name, group)}
+        end
+
+      _group, state ->
+        state
+    end)
+  end
+
+  # Starts the released polls in deadline order, skipping the ones of busy clients
+  defp dispatch(state) do
+    {started, state} =
+      state.ready
+      |> :gb_sets.to_list()
+      |> Enum.reduce({[], state}, fn {deadline, _seq, name} = job, {started, state} ->
+        group = Map.fetch!(state.groups, name)
+
+        if map_size(state.running) >= state.max_concurrency or MapSet.member?(state.busy, group.client) do
+          {started, state}
+        else
+          {[job | started], start(state, name, group, deadline - ms(group.deadline))}
+        end
+      end)
+
+    %State{state | ready: Enum.reduce(started, state.ready, &:gb_sets.delete/2)}
+  end
+
+  defp start(state, name, group, release) do
+    task =
+      Task.Supervisor.async_nolink(state.tasks, fn ->
+        try do
+          Snapex7.Client.command(group.client, group.request)
+        catch
+          # the client is gone or stuck, the scheduler goes on
+          :exit, reason -> {:error, {:exit, reason}}
+        end
+      end)
+
+    running = Map.put(state.running, task.ref, {name, group.client, release, now()})
+    %State{state | running: running, busy: MapSet.put(state.busy, group.client)}
+  end
+
+  defp done(state, name, group, client, running) do
+    %State{
+      state
+      | groups: Map.put(state.groups, name, group),
+        running: running,
+        busy: MapSet.delete(state.busy, client)
+    }
+  end
+
+  defp schedule(state) do
+    if state.timer, do: :erlang.cancel_timer(state.timer)
+
+    case Enum.min_by(Map.values(state.groups), & &1.release, fn -> nil end) do
+      nil ->
+        %State{state | timer: nil}
+
+      group ->
+        # rounded up, a timer firing before the release would spin
+        time = System.convert_time_unit(group.release + ms(1) - 1, :native, :millisecond)
+        timer = :erlang.start_timer(time, self(), :release, abs: true)
+        %State{state | timer: timer}
+    end
+  end
+
+  defp adapt(%{cycle: cycle, max_cycle: cycle} = group, _result, _now), do: group
+
+  defp adapt(group, {:ok, value}, now) do
+    current = Snapex7.Adaptive.next_interval(group.current, group.cycle, group.max_cycle, group.last, value)
+    # the next release follows the new cycle right away
+    release = max(group.released + ms(current), now)
+    %{group | current: current, last: value, release: release}
+  end
+
+  defp adapt(group, _error, _now), do: group
+
+  defp publish(state, name, result) do
+    case result do
+      {:ok, value} -> if state.cache, do: Snapex7.Cache.put(state.cache, name, value)
+      _error -> :ok
+    end
+
+    if state.on_result, do: state.on_result.(name, result)
+  end
+
+  defp new_stats do
+    %{runs: 0, late: 0, skipped: 0, jitter: {nil, 0, 0}, duration: {nil, 0, 0}}
+  end
+
+  defp record(stats, jitter, duration, late) do
+    %{
+      stats
+      | runs: stats.runs + 1,
+        late: stats.late + if(late, do: 1, else: 0),
+        jitter: summary(stats.jitter, jitter),
+        duration: summary(stats.duration, duration)
+    }
+  end
+
+  defp skip(stats, 0), do: stats
+  defp skip(stats, count), do: %{stats | skipped: stats.skipped + count}
+
+  # {min, max, sum}
+  defp summary({nil, _max, _sum}, value), do: {value, value, value}
+  defp summary({min, max, sum}, value), do: {min(min, value), max(max, value), sum + value}
+
+  defp report(stats) do
+    %{stats | jitter: report(stats.jitter, stats.runs), duration: report(stats.duration, stats.runs)}
+  end
+
+  defp report({nil, _max, _sum}, _runs), do: %{min: 0, max: 0, mean: 0}
+
+  defp report({min, max, sum}, runs) do
+    %{min: us(min), max: us(max), mean: us(div(sum, runs))}
+  end
+
+  defp now, do: System.monotonic_time()
+  defp ms(time), do: System.convert_time_unit(time, :millisecond, :native)
+  defp us(time), do: System.convert_time_unit(time, :native, :microsecond)
+end
@@ -0,0 +1,211 @@
+defmodule Snapex7.Server do
+  use GenServer
+  require Logger
+
+  @c_timeout 5000
+
+  @area_types [
+    PE: 0,
+    PA: 1,
+    MK: 2,
+    CT: 3,
+    TM: 4,
+    DB: 5
+  ]
+
+  defmodule State do
+    @moduledoc false
+
+    # port: C port process
+    # ip: the address the server is bound to
+    # port_number: the TCP port the server listens on
+    defstruct port: nil,
+              ip: nil,
+              port_number: nil
+  end
+
+  @type area_opt ::
+          {:PE, integer}
+          | {:PA, integer}
+          | {:MK, integer}
+          | {:CT, integer}
+          | {:TM, integer}
+          | {:DB, [{integer, integer}]}
+
+  @type server_opt ::
+          {:ip, bitstring}
+          | {:port, integer}
+          | {:areas, [area_opt]}
+
+  @doc """
+  Start up a Snap7 Server GenServer, it is mostly useful as a loopback PLC for
+  tests and benchmarks.
+  The following options are available:
+
+    * `:ip` - (string) IPV4 Address to bind (default "127.0.0.1").
+
+    * `:port` - (int) TCP port to listen on (default 102, which usually needs root).
+
+    * `:areas` - (keyword) areas to register before starting, `PE`, `PA`, `MK`, `CT` and `TM`
+      take a size in bytes, `DB` takes a list of `{db_number, size}`, e.g.
+      `[DB: [{1, 256}], MK: 256, PE: 64, PA: 64, TM: 64, CT: 64]`.
+  """
+  @spec start_link([server_opt], GenServer.options()) :: {:ok, pid} | {:error, term}
+  def start_link(opts \\ [], gen_opts \\ []) do
+    GenServer.start_link(__MODULE__, opts, gen_opts)
+  end
+
+  @doc """
+  Stop the Snap7 Server GenServer.
+  """
+  @spec stop(GenServer.server()) :: :ok
+  def stop(pid) do
+    GenServer.stop(pid)
+  end
+
+  @doc """
+  Shares a new zero filled area with the clients, `index` is the DB number when `area: :DB`.
+  """
+  @spec register_area(GenServer.server(), atom, integer, integer) ::
+          :ok | {:error, map} | {:error, :einval}
+  def register_area(pid, area, index \\ 0, size) do
+    GenServer.call(pid, {:register_area, area, index, size})
+  end
+
+  @doc """
+  Writes `data` into a registered area at `start` (bytes offset).
+  """
+  @spec write_area(GenServer.server(), atom, integer, integer, bitstring) ::
+          :ok | {:error, :einval} | {:error, :enoent}
+  def write_area(pid, area, index \\ 0, start, data) do
+    GenServer.call(pid, {:write_area, area, index, start, data})
+  end
+
+  @doc """
+  Reads `size` bytes from a registered area at `start` (bytes offset).
+  """
+  @spec read_area(GenServer.server(), atom, integer, integer, integer) ::
+          {:ok, bitstring} | {:error, :einval} | {:error, :enoent}
+  def read_area(pid, area, index \\ 0, start, size) do
+    GenServer.call(pid, {:read_area, area, index, start, size})
+  end
+
+  @doc """
+  Returns the server status, the CPU status and the amount of connected clients.
+  """
+  @spec get_status(GenServer.server()) :: {:ok, map} | {:error, map}
+  def get_status(pid) do
+    GenServer.call(pid, :get_status)
+  end
+
+  @doc """
+  Returns the options needed by `Snapex7.Client.connect_to/2` to reach this server.
+  """
+  @spec connect_opts(GenServer.server()) :: keyword
+  def connect_opts(pid) do
+    GenServer.call(pid, :connect_opts)
+  end
+
+  @spec init([server_opt]) :: {:ok, Snapex7.Server.State.t()} | {:stop, term}
+  def init(opts) do
+    snap7_dir = :code.priv_dir(:snapex7) |> List.to_string()
+    System.put_env("LD_LIBRARY_PATH", snap7_dir)
+    System.put_env("DYLD_LIBRARY_PATH", snap7_dir)
+
+    executable = :code.priv_dir(:snapex7) ++ ~c"/s7_server.o"
+
+    port =
+      Port.open({:spawn_executable, executable}, [
+        {:args, []},
+        {:packet, 2},
+        :use_stdio,
+        :binary,
+        :exit_status
+      ])
+
+    ip = Keyword.get(opts, :ip, "127.0.0.1")
+    port_number = Keyword.get(opts, :port, 102)
+    state = %State{port: port, ip: ip, port_number: port_number}
+
+    with :ok <- call_port(state, :set_params, {1, port_number}),
+         :ok <- register_areas(state, Keyword.get(opts, :areas, [])),
+         :ok <- call_port(state, :start_to, ip) do
+      {:ok, state}
+    else
+      error ->
+        Port.close(port)
+        {:stop, error}
+    end
+  end
+
+  def handle_call({:register_area, area, index, size}, _from, state) do
+    response = do_register_area(state, area, index, size)
+    {:reply, response, state}
+  end
+
+  def handle_call({:write_area, area, index, start, data}, _from, state) do
+    area_code = Keyword.fetch!(@area_types, area)
+    response = call_port(state, :write_area, {area_code, index, start, data})
+    {:reply, response, state}
+  end
+
+  def handle_call({:read_area, area, index, start, size}, _from, state) do
+    area_code = Keyword.fetch!(@area_types, area)
+    response = call_port(state, :read_area, {area_code, index, start, size})
+    {:reply, response, state}
+  end
+
+  def handle_call(:get_status, _from, state) do
+    response = call_port(state, :get_status, nil)
+    {:reply, response, state}
+  end
+
+  def handle_call(:connect_opts, _from, state) do
+    {:reply, [ip: state.ip, port: state.port_number, rack: 0, slot: 1], state}
+  end
+
+  def handle_call(request, _from, state) do
+    Logger.error("(#{__MODULE__}) Invalid request: #{inspect(request)}")
+    response = {:error, :einval}
+    {:reply, response, state}
+  end
+
+  def terminate(_reason, state) do
+    call_port(state, :stop, nil)
+  end
+
+  defp register_areas(state, areas) do
+    Enum.reduce_while(areas, :ok, fn
+      {:DB, dbs}, :ok ->
+        dbs
+        |> Enum.reduce_while(:ok, fn {db_number, size}, :ok ->
+          halt_on_error(do_register_area(state, :DB, db_number, size))
+        end)
+        |> halt_on_error()
+
+      {area, size}, :ok ->
+        halt_on_error(do_register_area(state, area, 0, size))
+    end)
+  end
+
+  defp halt_on_error(:ok), do: {:cont, :ok}
+  defp halt_on_error(error), do: {:halt, error}
+
+  defp do_register_area(state, area, index, size) do
+    area_code = Keyword.fetch!(@area_types, area)
+    call_port(state, :register_area, {area_code, index, size})
+  end
+
+  defp call_port(state, command, arguments, timeout \\ @c_timeout) do
+    msg = {command, arguments}
+    send(state.port, {self(), {:command, :erlang.term_to_binary(msg)}})
+
+    receive do
+      {_, {:data, <<?r, response::binary>>}} ->
+        :erlang.binary_to_term(response)
+    after
+      timeout ->
+        exit(:port_timed_out)
+    end
+  end
+end
@@ -0,0 +1,34 @@
+defmodule Snapex7.Shm do
+  @moduledoc """
+  Shared memory data plane between a `Snapex7.Client` port and the BEAM.
+
+  With `Snapex7.Client.start_link(shm: true)` the C port creates a POSIX shared memory
+  ring of slots that this NIF maps. Binaries of data replies bigger than 512 bytes
+  (e.g. `full_upload/4` or big `db_read/2`) are written to a slot and the pipe only
+  carries the slot index, `take/3` copies the slot out and frees it. When every slot is
+  taken the reply goes through the pipe as usual.
+  """
+
+  @on_load :load_nif
+
+  @doc false
+  def load_nif do
+    path = :filename.join(:code.priv_dir(:snapex7), ~c"s7_shm_nif")
+
+    # Without the NIF (e.g. Windows) open/1 raises and clients keep to the pipe
+    _ = :erlang.load_nif(path, 0)
+    :ok
+  end
+
+  @doc """
+  Maps the region created by the port and unlinks its name.
+  """
+  @spec open(binary) :: {:ok, reference} | {:error, atom}
+  def open(_name), do: :erlang.nif_error(:nif_not_loaded)
+
+  @doc """
+  Copies `size` bytes out of `slot` and frees it.
+  """
+  @spec take(reference, non_neg_integer, non_neg_integer) :: {:ok, binary} | {:error, :empty}
+  def take(_region, _slot, _size), do: :erlang.nif_error(:nif_not_loaded)
+end
@@ -6,6 +6,7 @@ defmodule Snapex7.MixProject do
       app: :snapex7,
       version: "0.1.4",
       elixir: "~> 1.8",
+      elixirc_paths: elixirc_paths(Mix.env()),
       name: "Snapex7",
       description: description(),
       package: package(),
@@ -78,6 +79,9 @@ defmodule Snapex7.MixProject do
     end
   end
 
+  defp elixirc_paths(:test), do: ["lib", "test/support"]
+  defp elixirc_paths(_), do: ["lib"]
+
   # Run "mix help compile.app" to learn about applications.
   def application do
     [
@@ -113,6 +117,7 @@ defmodule Snapex7.MixProject do
   defp deps do
     [
       {:elixir_make, "~> 0.5", runtime: false},
+      {:telemetry, "~> 1.1"},
       {:ex_doc, "~> 0.24", only: :dev, runtime: false},
     ]
   end
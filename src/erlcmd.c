@@ -24,6 +24,12 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifndef __WIN32__
+#include <sys/uio.h>
+#endif
+
+#define RING_MASK (ERLCMD_RING_SIZE - 1)
+
 #ifdef __WIN32__
 // Assume that all windows platforms are little endian
 #define TO_BIGENDIAN16(X) _byteswap_ushort(X)
@@ -106,9 +112,12 @@ static DWORD WINAPI pipe_copy_thread(LPVOID lpParam)
 
 static void start_async_read(struct erlcmd *handler)
 {
+    // Up to the end of the ring, the next read wraps around
+    size_t pos = handler->tail & RING_MASK;
+    size_t room = ERLCMD_RING_SIZE - (handler->tail - handler->head);
     ReadFile(handler->h,
-               handler->buffer + handler->index,
-               sizeof(handler->buffer) - handler->index,
+               handler->ring + pos,
+               room < ERLCMD_RING_SIZE - pos ? room : ERLCMD_RING_SIZE - pos,
                NULL,
                &handler->overlapped);
 }
@@ -187,59 +196,149 @@ void erlcmd_init(struct erlcmd *handler,
 #endif
 }
 
+static char out_buffer[ERLCMD_OUT_SIZE];
+static size_t out_len = 0;
+
 /**
- * @brief Synchronously send a response back to Erlang
- *
- * @param response what to send back
+ * @brief Write the queued replies followed by response (may be NULL)
  */
-void erlcmd_send(char *response, size_t len)
+static void erlcmd_write(const char *response, size_t len)
 {
-    uint16_t be_len = TO_BIGENDIAN16(len - sizeof(uint16_t));
-    memcpy(response, &be_len, sizeof(be_len));
-
 #ifdef __WIN32__
-    BOOL rc = WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), response, len, NULL, NULL);
-    if (!rc)
+    HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+    if ((out_len != 0 && !WriteFile(out, out_buffer, out_len, NULL, NULL)) ||
+            (len != 0 && !WriteFile(out, response, len, NULL, NULL)))
         errx(EXIT_FAILURE, "WriteFile to stdout failed (Erlang exit?)");
 #else
-    size_t wrote = 0;
-    do {        
-        ssize_t amount_written = write(STDOUT_FILENO, response + wrote, len - wrote);
+    struct iovec iov[2];
+    iov[0].iov_base = out_buffer;
+    iov[0].iov_len = out_len;
+    iov[1].iov_base = (void *) response;
+    iov[1].iov_len = len;
+
+    struct iovec *next = out_len != 0 ? &iov[0] : &iov[1];
+    int count = (out_len != 0) + (len != 0);
+    while (count > 0) {
+        ssize_t amount_written = writev(STDOUT_FILENO, next, count);
         if (amount_written < 0) {
             if (errno == EINTR)
                 continue;
 
-            err(EXIT_FAILURE, "write");
+            err(EXIT_FAILURE, "writev");
+        }
+
+        /* Skip what was written, partial writes go on from the middle of an iovec */
+        while (count > 0 && (size_t) amount_written >= next->iov_len) {
+            amount_written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (char *) next->iov_base + amount_written;
+            next->iov_len -= amount_written;
         }
-        wrote += amount_written;
-    } while (wrote < len);
+    }
 #endif
+    out_len = 0;
+}
+
+/**
+ * @brief Queue a response back to Erlang
+ *
+ * @param response what to send back, with room for the length field
+ * @param flags ERLCMD_FLUSH to write it (and the queue) right away
+ */
+void erlcmd_queue(char *response, size_t len, int flags)
+{
+    uint16_t be_len = TO_BIGENDIAN16(len - sizeof(uint16_t));
+    memcpy(response, &be_len, sizeof(be_len));
+
+    if ((flags & ERLCMD_FLUSH) || out_len + len > sizeof(out_buffer)) {
+        /* Written along with the queue, without copying it */
+        erlcmd_write(response, len);
+        return;
+    }
+
+    memcpy(out_buffer + out_len, response, len);
+    out_len += len;
+    if (out_len >= ERLCMD_FLUSH_THRESHOLD)
+        erlcmd_flush();
 }
 
 /**
- * @brief Dispatch commands in the buffer
+ * @brief Write the queued responses
+ */
+void erlcmd_flush()
+{
+    if (out_len != 0)
+        erlcmd_write(NULL, 0);
+}
+
+/**
+ * @brief Synchronously send a response back to Erlang
+ *
+ * @param response what to send back
+ */
+void erlcmd_send(char *response, size_t len)
+{
+    erlcmd_queue(response, len, ERLCMD_FLUSH);
+}
+
+/**
+ * @brief Dispatch the command at the head of the ring
  * @return the number of bytes processed
  */
 static size_t erlcmd_try_dispatch(struct erlcmd *handler)
 {
+    size_t available = handler->tail - handler->head;
+    size_t pos = handler->head & RING_MASK;
+
     /* Check for length field */
-    if (handler->index < sizeof(uint16_t))
+    if (available < sizeof(uint16_t))
         return 0;
 
-    uint16_t be_len;
-    memcpy(&be_len, handler->buffer, sizeof(uint16_t));
-    size_t msglen = FROM_BIGENDIAN16(be_len);
+    size_t msglen = ((uint8_t) handler->ring[pos]) << 8 |
+                    (uint8_t) handler->ring[(pos + 1) & RING_MASK];
     if (msglen + sizeof(uint16_t) > sizeof(handler->buffer))
         errx(EXIT_FAILURE, "Message too long: %d bytes. Max is %d bytes",
              (int) (msglen + sizeof(uint16_t)), (int) sizeof(handler->buffer));
 
     /* Check whether we've received the entire message */
-    if (msglen + sizeof(uint16_t) > handler->index)
+    size_t len = msglen + sizeof(uint16_t);
+    if (len > available)
         return 0;
 
-    handler->request_handler(handler->buffer, handler->cookie);
+    const char *msg = handler->ring + pos;
+    if (pos + len > ERLCMD_RING_SIZE) {
+        /* Wraps around the end of the ring, handlers get contiguous messages */
+        size_t first = ERLCMD_RING_SIZE - pos;
+        memcpy(handler->buffer, handler->ring + pos, first);
+        memcpy(handler->buffer + first, handler->ring, len - first);
+        msg = handler->buffer;
+    }
+
+    handler->request_handler(msg, handler->cookie);
 
-    return msglen + sizeof(uint16_t);
+    return len;
+}
+
+/**
+ * @brief Whether the message being dispatched is the last complete one in the ring,
+ *  i.e. no other request is already waiting behind it
+ */
+int erlcmd_last_message(const struct erlcmd *handler)
+{
+    size_t pos = handler->head & RING_MASK;
+    size_t len = (((uint8_t) handler->ring[pos]) << 8 |
+                  (uint8_t) handler->ring[(pos + 1) & RING_MASK]) + sizeof(uint16_t);
+    size_t available = handler->tail - handler->head - len;
+    if (available < sizeof(uint16_t))
+        return 1;
+
+    pos = (pos + len) & RING_MASK;
+    size_t next_len = (((uint8_t) handler->ring[pos]) << 8 |
+                       (uint8_t) handler->ring[(pos + 1) & RING_MASK]) + sizeof(uint16_t);
+    return next_len > available;
 }
 
 /**
@@ -269,7 +368,16 @@ int erlcmd_process(struct erlcmd *handler)
 
     ResetEvent(handler->overlapped.hEvent);
 #else
-    ssize_t amount_read = read(STDIN_FILENO, handler->buffer + handler->index, sizeof(handler->buffer) - handler->index);
+    /* Fill all the free room, it may be split by the end of the ring */
+    size_t pos = handler->tail & RING_MASK;
+    size_t room = ERLCMD_RING_SIZE - (handler->tail - handler->head);
+    struct iovec iov[2];
+    iov[0].iov_base = handler->ring + pos;
+    iov[0].iov_len = room < ERLCMD_RING_SIZE - pos ? room : ERLCMD_RING_SIZE - pos;
+    iov[1].iov_base = handler->ring;
+    iov[1].iov_len = room - iov[0].iov_len;
+
+    ssize_t amount_read = readv(STDIN_FILENO, iov, iov[1].iov_len != 0 ? 2 : 1);
     if (amount_read < 0) {
         /* EINTR is ok to get, since we were interrupted by a signal. */
         if (errno == EINTR)
@@ -282,7 +390,7 @@ int erlcmd_process(struct erlcmd *handler)
         return 1;
     }
 #endif
-    handler->index += amount_read;
+    handler->tail += amount_read;
 
     for (;;) {
         size_t bytes_processed = erlcmd_try_dispatch(handler);
@@ -290,15 +398,14 @@ int erlcmd_process(struct erlcmd *handler)
         if (bytes_processed == 0) {
             /* Only have part of the command to process. */
             break;
-        } else if (handler->index > bytes_processed) {
-            /* Processed the command and there's more data. */
-            memmove(handler->buffer, &handler->buffer[bytes_processed], handler->index - bytes_processed);
-            handler->index -= bytes_processed;
-        } else {
-            /* Processed the whole buffer. */
-            handler->index = 0;
-            break;
         }
+        handler->head += bytes_processed;
+    }
+
+    if (handler->head == handler->tail) {
+        /* Processed the whole ring, restart at its beginning so fewer messages wrap. */
+        handler->head = 0;
+        handler->tail = 0;
     }
 
 #ifdef __WIN32__
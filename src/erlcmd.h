@@ -26,11 +26,20 @@
 /*
  * Erlang request/response processing
  */
-#define ERLCMD_BUF_SIZE 16384 // Large size is to support large UART writes
+#define ERLCMD_BUF_SIZE 16384 // Max message size, large to support large UART writes
+
+/*
+ * Received bytes go to a ring (power of two size) and messages are dispatched in
+ * place, only a message wrapping around the end of the ring is copied to buffer.
+ * head and tail are free running byte counters.
+ */
+#define ERLCMD_RING_SIZE (4 * ERLCMD_BUF_SIZE)
 struct erlcmd
 {
+    char ring[ERLCMD_RING_SIZE];
+    size_t head; // next byte to dispatch
+    size_t tail; // next byte to receive
     char buffer[ERLCMD_BUF_SIZE];
-    size_t index;
 
     void (*request_handler)(const char *emsg, void *cookie);
     void *cookie;
@@ -50,7 +59,18 @@ void erlcmd_init(struct erlcmd *handler,
 		 void (*request_handler)(const char *req, void *cookie),
 		 void *cookie);
 void erlcmd_send(char *response, size_t len);
+
+/*
+ * Replies may be queued and written together (writev) by erlcmd_flush, when the
+ * queue reaches ERLCMD_FLUSH_THRESHOLD bytes, or along with an ERLCMD_FLUSH one.
+ */
+#define ERLCMD_OUT_SIZE (8 * ERLCMD_BUF_SIZE)
+#define ERLCMD_FLUSH_THRESHOLD ERLCMD_BUF_SIZE
+#define ERLCMD_FLUSH 0x01 // latency-critical, written right away
+void erlcmd_queue(char *response, size_t len, int flags);
+void erlcmd_flush(void);
 int erlcmd_process(struct erlcmd *handler);
+int erlcmd_last_message(const struct erlcmd *handler);
 
 #ifdef __WIN32__
 HANDLE erlcmd_wfmo_event(struct erlcmd *handler);
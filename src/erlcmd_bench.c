@@ -0,0 +1,379 @@
+/*
+ *  Microbenchmarks of the port plumbing, without a PLC nor an Erlang VM.
+ *
+ *  erlcmd.c, s7_stats.c, s7_shm.c and s7_client.c are included as-is so their static
+ *  functions (erlcmd_try_dispatch, handle_elixir_request, send_data_response,
+ *  ...) can be driven directly with synthetic buffers. Replies go to /dev/null, stdin
+ *  is a pipe fed by the benchmark and the snap7 client is never connected,
+ *  so the handlers return right after the (failed) PLC call.
+ *
+ *  Allocations are counted by wrapping malloc/calloc/realloc at link time
+ *  (-Wl,--wrap), which covers ei_x_* and the handlers but not libsnap.
+ *
+ *  usage: erlcmd_bench.o [iterations]
+ */
+
+#define S7_CLIENT_NO_MAIN
+#include "erlcmd.c"
+#include "s7_stats.c"
+#include "s7_shm.c"
+#include "s7_client.c"
+
+#include <fcntl.h>
+#include <time.h>
+
+static unsigned long alloc_count = 0;
+static unsigned long alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+static FILE *report;
+static long iterations = 100000;
+
+struct bench_result
+{
+    uint64_t ns;
+    unsigned long allocs;
+    unsigned long bytes;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ((uint64_t) tp.tv_sec) * 1000000000ULL + tp.tv_nsec;
+}
+
+static void bench_begin(struct bench_result *r)
+{
+    r->allocs = alloc_count;
+    r->bytes = alloc_bytes;
+    r->ns = now_ns();
+}
+
+static void bench_end(struct bench_result *r, const char *name, long ops)
+{
+    uint64_t elapsed = now_ns() - r->ns;
+    fprintf(report, "%-40s %10ld %12.1f %12.2f %12.1f\n", name, ops,
+            (double) elapsed / ops,
+            (double) (alloc_count - r->allocs) / ops,
+            (double) (alloc_bytes - r->bytes) / ops);
+    fflush(report);
+}
+
+/*
+ * Synthetic requests, framed as erlcmd expects them: 2 bytes of length
+ * followed by the term_to_binary({cmd, args}) payload.
+ */
+struct frame
+{
+    char buf[ERLCMD_BUF_SIZE];
+    size_t len;
+};
+
+static void frame_from_x(struct frame *f, ei_x_buff *x)
+{
+    if (x->index + sizeof(uint16_t) > sizeof(f->buf))
+        errx(EXIT_FAILURE, "synthetic frame too big: %d", x->index);
+
+    uint16_t be_len = TO_BIGENDIAN16(x->index);
+    memcpy(f->buf, &be_len, sizeof(be_len));
+    memcpy(f->buf + sizeof(uint16_t), x->buff, x->index);
+    f->len = x->index + sizeof(uint16_t);
+    ei_x_free(x);
+}
+
+static void make_test(struct frame *f)
+{
+    ei_x_buff x;
+    ei_x_new_with_version(&x);
+    ei_x_encode_tuple_header(&x, 2);
+    ei_x_encode_atom(&x, "test");
+    ei_x_encode_atom(&x, "nil");
+    frame_from_x(f, &x);
+}
+
+static void make_db_read(struct frame *f)
+{
+    ei_x_buff x;
+    ei_x_new_with_version(&x);
+    ei_x_encode_tuple_header(&x, 2);
+    ei_x_encode_atom(&x, "db_read");
+    ei_x_encode_tuple_header(&x, 3);
+    ei_x_encode_ulong(&x, 1);
+    ei_x_encode_ulong(&x, 0);
+    ei_x_encode_ulong(&x, 4);
+    frame_from_x(f, &x);
+}
+
+static void make_db_write(struct frame *f, int size)
+{
+    byte *data = calloc(size, 1);
+    ei_x_buff x;
+    ei_x_new_with_version(&x);
+    ei_x_encode_tuple_header(&x, 2);
+    ei_x_encode_atom(&x, "db_write");
+    ei_x_encode_tuple_header(&x, 4);
+    ei_x_encode_ulong(&x, 1);
+    ei_x_encode_ulong(&x, 0);
+    ei_x_encode_ulong(&x, size);
+    ei_x_encode_binary(&x, data, size);
+    frame_from_x(f, &x);
+    free(data);
+}
+
+// Same request in the binary protocol (see handle_raw_request), no deadline
+static void make_raw(struct frame *f, char opcode, int amount)
+{
+    int len = RAW_JOB_SIZE + RAW_ARGS_SIZE + (opcode == RAW_WRITE ? amount : 0);
+    char *req = f->buf + sizeof(uint16_t);
+    memset(req, 0, len);
+    req[0] = opcode;
+    encode_be(&req[RAW_JOB_SIZE - 1], PRIORITY_NORMAL, 1);
+    encode_be(&req[RAW_JOB_SIZE], S7AreaDB, 1);
+    encode_be(&req[RAW_JOB_SIZE + 1], 1, 2);
+    encode_be(&req[RAW_JOB_SIZE + 7], amount, 4);
+    encode_be(&req[RAW_JOB_SIZE + 11], S7WLByte, 1);
+    encode_be(f->buf, len, sizeof(uint16_t));
+    f->len = len + sizeof(uint16_t);
+}
+
+static void make_multi_vars(struct frame *f, const char *cmd, int n_vars, int with_data)
+{
+    byte data[4] = {0};
+    ei_x_buff x;
+    ei_x_new_with_version(&x);
+    ei_x_encode_tuple_header(&x, 2);
+    ei_x_encode_atom(&x, cmd);
+    ei_x_encode_tuple_header(&x, 2);
+    ei_x_encode_ulong(&x, n_vars);
+    ei_x_encode_list_header(&x, n_vars);
+    for (int i = 0; i < n_vars; i++) {
+        ei_x_encode_map_header(&x, with_data ? 6 : 5);
+        ei_x_encode_atom(&x, "amount");
+        ei_x_encode_ulong(&x, sizeof(data));
+        ei_x_encode_atom(&x, "area");
+        ei_x_encode_ulong(&x, S7AreaDB);
+        ei_x_encode_atom(&x, "db_number");
+        ei_x_encode_ulong(&x, 1);
+        ei_x_encode_atom(&x, "start");
+        ei_x_encode_ulong(&x, i * sizeof(data));
+        ei_x_encode_atom(&x, "word_len");
+        ei_x_encode_ulong(&x, S7WLByte);
+        if (with_data) {
+            ei_x_encode_atom(&x, "data");
+            ei_x_encode_binary(&x, data, sizeof(data));
+        }
+    }
+    ei_x_encode_empty_list(&x);
+    frame_from_x(f, &x);
+}
+
+static void noop_request_handler(const char *req, void *cookie)
+{
+    (void) req;
+    (void) cookie;
+}
+
+/*
+ * Benchmarks
+ */
+
+static void bench_handle_elixir_request(const char *name, struct frame *f)
+{
+    struct bench_result r;
+    bench_begin(&r);
+    for (long i = 0; i < iterations; i++)
+        handle_elixir_request(f->buf, NULL);
+    bench_end(&r, name, iterations);
+}
+
+static void bench_try_dispatch(const char *name, struct frame *f)
+{
+    struct erlcmd handler;
+    erlcmd_init(&handler, noop_request_handler, NULL);
+
+    struct bench_result r;
+    bench_begin(&r);
+    for (long i = 0; i < iterations; i++) {
+        memcpy(handler.ring, f->buf, f->len);
+        handler.head = 0;
+        handler.tail = f->len;
+        if (erlcmd_try_dispatch(&handler) != f->len)
+            errx(EXIT_FAILURE, "erlcmd_try_dispatch didn't consume the frame");
+    }
+    bench_end(&r, name, iterations);
+}
+
+static long dispatched = 0;
+
+static void counting_noop_handler(const char *req, void *cookie)
+{
+    (void) req;
+    (void) cookie;
+    dispatched++;
+}
+
+static void counting_elixir_handler(const char *req, void *cookie)
+{
+    handle_elixir_request(req, cookie);
+    dispatched++;
+}
+
+/*
+ * Feeds a pipe with batches of frames (no more than what fits in the pipe
+ * buffer, so the writer never blocks) and lets erlcmd_process read and
+ * dispatch them.
+ */
+static void bench_erlcmd_process(const char *name, struct frame *f,
+                                 void (*request_handler)(const char *, void *))
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        err(EXIT_FAILURE, "pipe");
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+
+    long batch_len = 32768 / f->len;
+    if (batch_len == 0)
+        batch_len = 1;
+    size_t batch_size = batch_len * f->len;
+    char *batch = malloc(batch_size);
+    for (long i = 0; i < batch_len; i++)
+        memcpy(batch + i * f->len, f->buf, f->len);
+
+    struct erlcmd *handler = malloc(sizeof(struct erlcmd));
+    erlcmd_init(handler, request_handler, NULL);
+
+    dispatched = 0;
+    struct bench_result r;
+    bench_begin(&r);
+    while (dispatched < iterations) {
+        long target = dispatched + batch_len;
+        if (write(fds[1], batch, batch_size) != (ssize_t) batch_size)
+            err(EXIT_FAILURE, "write");
+        while (dispatched < target)
+            erlcmd_process(handler);
+    }
+    bench_end(&r, name, dispatched);
+
+    close(fds[1]);
+    free(handler);
+    free(batch);
+}
+
+static void bench_send_data_response(const char *name, void *data, int data_type, int data_len)
+{
+    struct bench_result r;
+    bench_begin(&r);
+    for (long i = 0; i < iterations; i++)
+        send_data_response(data, data_type, data_len);
+    bench_end(&r, name, iterations);
+}
+
+static void bench_send_snap7_errors(const char *name, uint32_t code)
+{
+    struct bench_result r;
+    bench_begin(&r);
+    for (long i = 0; i < iterations; i++)
+        send_snap7_errors(code);
+    bench_end(&r, name, iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        iterations = atol(argv[1]);
+
+    // Keep stdout for the report, replies are thrown away
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    Client = Cli_Create();
+
+    struct frame *test = malloc(sizeof(struct frame));
+    struct frame *db_read = malloc(sizeof(struct frame));
+    struct frame *db_write_big = malloc(sizeof(struct frame));
+    struct frame *read_multi = malloc(sizeof(struct frame));
+    struct frame *write_multi = malloc(sizeof(struct frame));
+    struct frame *raw_read = malloc(sizeof(struct frame));
+    struct frame *raw_write_big = malloc(sizeof(struct frame));
+    make_test(test);
+    make_db_read(db_read);
+    make_db_write(db_write_big, 8192);
+    make_multi_vars(read_multi, "read_multi_vars", 20, 0);
+    make_multi_vars(write_multi, "write_multi_vars", 20, 1);
+    make_raw(raw_read, RAW_READ, 4);
+    make_raw(raw_write_big, RAW_WRITE, 8192);
+
+    fprintf(report, "%-40s %10s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+
+    bench_try_dispatch("erlcmd_try_dispatch/test", test);
+    bench_try_dispatch("erlcmd_try_dispatch/db_write_8k", db_write_big);
+
+    bench_erlcmd_process("erlcmd_process/test (noop handler)", test, counting_noop_handler);
+    bench_erlcmd_process("erlcmd_process/db_write_8k (noop handler)", db_write_big, counting_noop_handler);
+    bench_erlcmd_process("erlcmd_process/test", test, counting_elixir_handler);
+
+    bench_handle_elixir_request("handle_elixir_request/test", test);
+    bench_handle_elixir_request("handle_elixir_request/db_read", db_read);
+    bench_handle_elixir_request("handle_elixir_request/db_write_8k", db_write_big);
+    bench_handle_elixir_request("handle_elixir_request/read_multi_vars_20", read_multi);
+    bench_handle_elixir_request("handle_elixir_request/write_multi_vars_20", write_multi);
+    bench_handle_elixir_request("handle_elixir_request/raw_read", raw_read);
+    bench_handle_elixir_request("handle_elixir_request/raw_write_8k", raw_write_big);
+
+    uint32_t code = 0x00900000 | 0x0009;
+    byte *big = calloc(16384, 1);
+    byte multi_data[20][4] = {{0}};
+    TS7DataItem items[20];
+    for (int i = 0; i < 20; i++) {
+        items[i].Area = S7AreaDB;
+        items[i].WordLen = S7WLByte;
+        items[i].DBNumber = 1;
+        items[i].Start = i * 4;
+        items[i].Amount = 4;
+        items[i].pdata = multi_data[i];
+    }
+    bench_send_data_response("send_data_response/binary_4", big, 5, 4);
+    bench_send_data_response("send_data_response/binary_16k", big, 5, 16384);
+    bench_send_data_response("send_data_response/multi_vars_20", items, 7, 20);
+    bench_send_data_response("send_data_response/error_map", &code, 16, 0);
+    bench_send_snap7_errors("send_snap7_errors", code);
+
+    free(big);
+    free(test);
+    free(db_read);
+    free(db_write_big);
+    free(read_multi);
+    free(write_multi);
+    free(raw_read);
+    free(raw_write_big);
+    Cli_Destroy(&Client);
+    return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ *  Latency/throughput benchmark of the snap7 client calls used by the port.
+ *
+ *  It starts an in-process snap7 server on the loopback (unless --ip is given)
+ *  and runs every command for each payload size and amount of threads, each
+ *  thread owns its own client connection. Results are printed as one line per
+ *  case: command, size, threads, ops, ops/s, p50 and p99 (microseconds).
+ *  full_upload and db_get need a PLC (--ip), a snap7 server can't serve uploads.
+ *
+ *  usage: s7_bench.o [--ip 127.0.0.1] [--port 10102] [--duration 1000]
+ *                    [--sizes 4,64,512,4096] [--threads 1,4,16]
+ */
+
+#include "snap7.h"
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_CASES 16
+#define DB_SIZE 0xFFFF
+#define N_MULTI_VARS 4
+
+struct bench_config
+{
+    const char *ip;
+    int port;
+    int duration_ms;
+    int sizes[MAX_CASES];
+    int n_sizes;
+    int threads[MAX_CASES];
+    int n_threads;
+};
+
+struct bench_thread
+{
+    const struct bench_config *config;
+    const char *command;
+    int size;
+    uint64_t *samples;  // latencies in ns
+    size_t n_samples;
+    size_t cap_samples;
+    unsigned long errors;
+};
+
+static byte server_db[DB_SIZE];
+static byte server_mk[256];
+
+static uint64_t now_ns()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ((uint64_t) tp.tv_sec) * 1000000000ULL + tp.tv_nsec;
+}
+
+static int parse_list(const char *arg, int *list)
+{
+    int n = 0;
+    char *copy = strdup(arg);
+    for (char *tok = strtok(copy, ","); tok != NULL && n < MAX_CASES; tok = strtok(NULL, ","))
+        list[n++] = atoi(tok);
+    free(copy);
+    return n;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: s7_bench.o [--ip 127.0.0.1] [--port 10102] [--duration 1000]\n"
+                    "                  [--sizes 4,64,512,4096] [--threads 1,4,16]\n");
+    exit(EXIT_FAILURE);
+}
+
+static bool is_upload(const char *command)
+{
+    return !strcmp(command, "full_upload") || !strcmp(command, "db_get");
+}
+
+static int run_command(S7Object client, const char *command, int size, byte *buffer)
+{
+    int length = size;
+
+    if (!strcmp(command, "db_read"))
+        return Cli_DBRead(client, 1, 0, size, buffer);
+
+    if (!strcmp(command, "read_area"))
+        return Cli_ReadArea(client, S7AreaDB, 1, 0, size, S7WLByte, buffer);
+
+    if (!strcmp(command, "full_upload"))
+        return Cli_FullUpload(client, 0x41, 1, buffer, &length);
+
+    if (!strcmp(command, "db_get"))
+        return Cli_DBGet(client, 1, buffer, &length);
+
+    // multi vars: the payload is split between N_MULTI_VARS items
+    TS7DataItem items[N_MULTI_VARS];
+    int amount = size / N_MULTI_VARS > 0 ? size / N_MULTI_VARS : 1;
+    for (int i = 0; i < N_MULTI_VARS; i++) {
+        items[i].Area = S7AreaDB;
+        items[i].WordLen = S7WLByte;
+        items[i].DBNumber = 1;
+        items[i].Start = i * amount;
+        items[i].Amount = amount;
+        items[i].pdata = buffer + i * amount;
+    }
+
+    if (!strcmp(command, "read_multi_vars"))
+        return Cli_ReadMultiVars(client, items, N_MULTI_VARS);
+
+    return Cli_WriteMultiVars(client, items, N_MULTI_VARS);
+}
+
+static void *bench_thread_run(void *arg)
+{
+    struct bench_thread *bt = (struct bench_thread *) arg;
+    const struct bench_config *config = bt->config;
+    byte *buffer = calloc(DB_SIZE, 1);
+    S7Object client = Cli_Create();
+
+    uint16_t remote_port = (uint16_t) config->port;
+    Cli_SetParam(client, p_u16_RemotePort, &remote_port);
+    if (Cli_ConnectTo(client, config->ip, 0, 1) != 0)
+        errx(EXIT_FAILURE, "can't connect to %s:%d", config->ip, config->port);
+
+    uint64_t deadline = now_ns() + (uint64_t) config->duration_ms * 1000000ULL;
+    for (;;) {
+        uint64_t start = now_ns();
+        if (start >= deadline)
+            break;
+
+        if (run_command(client, bt->command, bt->size, buffer) != 0)
+            bt->errors++;
+
+        if (bt->n_samples == bt->cap_samples) {
+            bt->cap_samples = bt->cap_samples ? bt->cap_samples * 2 : 4096;
+            bt->samples = realloc(bt->samples, bt->cap_samples * sizeof(uint64_t));
+        }
+        bt->samples[bt->n_samples++] = now_ns() - start;
+    }
+
+    Cli_Disconnect(client);
+    Cli_Destroy(&client);
+    free(buffer);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void run_case(const struct bench_config *config, const char *command, int size, int n_threads)
+{
+    pthread_t tids[n_threads];
+    struct bench_thread bts[n_threads];
+    memset(bts, 0, sizeof(bts));
+
+    uint64_t started = now_ns();
+    for (int i = 0; i < n_threads; i++) {
+        bts[i].config = config;
+        bts[i].command = command;
+        bts[i].size = size;
+        if (pthread_create(&tids[i], NULL, bench_thread_run, &bts[i]) != 0)
+            errx(EXIT_FAILURE, "pthread_create");
+    }
+
+    size_t total = 0;
+    unsigned long errors = 0;
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(tids[i], NULL);
+        total += bts[i].n_samples;
+        errors += bts[i].errors;
+    }
+    double elapsed_s = (now_ns() - started) / 1e9;
+
+    uint64_t *samples = malloc((total ? total : 1) * sizeof(uint64_t));
+    size_t offset = 0;
+    for (int i = 0; i < n_threads; i++) {
+        memcpy(samples + offset, bts[i].samples, bts[i].n_samples * sizeof(uint64_t));
+        offset += bts[i].n_samples;
+        free(bts[i].samples);
+    }
+    qsort(samples, total, sizeof(uint64_t), compare_u64);
+
+    double p50 = total ? samples[total / 2] / 1e3 : 0;
+    double p99 = total ? samples[(total * 99) / 100] / 1e3 : 0;
+    printf("%-16s %6d %7d %9zu %11.1f %10.1f %10.1f %7lu\n",
+           command, size, n_threads, total, total / elapsed_s, p50, p99, errors);
+    fflush(stdout);
+    free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *commands[] = {
+        "db_read", "read_area", "read_multi_vars", "write_multi_vars", "full_upload", "db_get", NULL
+    };
+    struct bench_config config = {
+        .ip = NULL,
+        .port = 10102,
+        .duration_ms = 1000,
+        .sizes = {4, 64, 512, 4096},
+        .n_sizes = 4,
+        .threads = {1, 4, 16},
+        .n_threads = 3
+    };
+
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 == argc) {
+            warnx("missing value of %s", argv[i]);
+            usage();
+        }
+
+        if (!strcmp(argv[i], "--ip"))
+            config.ip = argv[i + 1];
+        else if (!strcmp(argv[i], "--port"))
+            config.port = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--duration"))
+            config.duration_ms = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--sizes"))
+            config.n_sizes = parse_list(argv[i + 1], config.sizes);
+        else if (!strcmp(argv[i], "--threads"))
+            config.n_threads = parse_list(argv[i + 1], config.threads);
+        else {
+            warnx("unknown option %s", argv[i]);
+            usage();
+        }
+    }
+
+    S7Object server = 0;
+    if (config.ip == NULL) {
+        // No PLC given, benchmark against a loopback server
+        config.ip = "127.0.0.1";
+        uint16_t local_port = (uint16_t) config.port;
+        server = Srv_Create();
+        Srv_SetParam(server, p_u16_LocalPort, &local_port);
+        Srv_RegisterArea(server, srvAreaDB, 1, server_db, sizeof(server_db));
+        Srv_RegisterArea(server, srvAreaMK, 0, server_mk, sizeof(server_mk));
+        if (Srv_StartTo(server, config.ip) != 0)
+            errx(EXIT_FAILURE, "can't start the loopback server on port %d", config.port);
+    }
+
+    printf("%-16s %6s %7s %9s %11s %10s %10s %7s\n",
+           "command", "size", "threads", "ops", "ops/s", "p50(us)", "p99(us)", "errors");
+    for (const char **command = commands; *command != NULL; command++) {
+        // they would only time the error replies of the loopback server
+        if (server && is_upload(*command))
+            continue;
+
+        for (int s = 0; s < config.n_sizes; s++)
+            for (int t = 0; t < config.n_threads; t++)
+                run_case(&config, *command, config.sizes[s], config.threads[t]);
+    }
+
+    if (server) {
+        Srv_Stop(server);
+        Srv_Destroy(&server);
+    }
+    return 0;
+}
@@ -1,75 +1,133 @@
 #include "snap7.h"
 #include "erlcmd.h"
+#include "s7_stats.h"
+#include "s7_shm.h"
+#include "s7_errors.h"
 #include <err.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <poll.h>
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
 S7Object Client;
 
+// Replies are framed by {:packet, 2}, so a data reply can't exceed 64KB
+#define MAX_RESPONSE_SIZE (sizeof(uint16_t) + 0xFFFF)
+// Largest data of a request or reply, leaves room for the reply header within MAX_RESPONSE_SIZE
+#define MAX_DATA_SIZE 0xFF00
+// Max vars of Cli_ReadMultiVars/Cli_WriteMultiVars (snap7's MaxVars)
+#define MAX_VARS 20
+
 // Utilities for communication and error handling
 static const char response_id = 'r';
 static const char notification_id = 'n';
-const char err_s7[0x26][37] = { 
-    "errNegotiatingPDU",
-    "errCliInvalidParams", 
-    "errCliJobPending",
-    "errCliTooManyItems",
-    "errCliInvalidWordLen",
-    "errCliPartialDataWritten",
-    "errCliSizeOverPDU",
-    "errCliInvalidPlcAnswer",
-    "errCliAddressOutOfRange",
-    "errCliInvalidTransportSize",
-    "errCliWriteDataSizeMismatch",
-    "errCliItemNotAvailable",
-    "errCliInvalidValue",
-    "errCliCannotStartPLC",
-    "errCliAlreadyRun",
-    "errCliCannotStopPLC",
-    "errCliCannotCopyRamToRom",
-    "errCliCannotCompress",
-    "errCliAlreadyStop",
-    "errCliFunNotAvailable",
-    "errCliUploadSequenceFailed",
-    "errCliInvalidDataSizeRecvd",
-    "errCliInvalidBlockType",
-    "errCliInvalidBlockNumber",
-    "errCliInvalidBlockSize",
-    "errCliDownloadSequenceFailed",
-    "errCliInsertRefused",
-    "errCliDeleteRefused",
-    "errCliNeedPassword",
-    "errCliInvalidPassword",
-    "errCliNoPasswordToSetOrClear",
-    "errCliJobTimeout",
-    "errCliPartialDataRead",
-    "errCliBufferTooSmall",
-    "errCliFunctionRefused",
-    "errCliInvalidParamNumber",
-    "errCliDestroying",
-    "errCliCannotChangeParam"
-    };
-
-const char err_iso[0x0F][37] = {
-    "errIsoConnect",
-    "errIsoDisconnect",
-    "errIsoInvalidPDU",
-    "errIsoInvalidDataSize",
-    "errIsoNullPointer",
-    "errIsoShortPacket",
-    "errIsoTooManyFragments",
-    "errIsoPduOverflow",
-    "errIsoSendPacket",
-    "errIsoRecvPacket",
-    "errIsoInvalidParams",
-    "errIsoResvd_1",
-    "errIsoResvd_2",
-    "errIsoResvd_3",
-    "errIsoResvd_4"
+// Same as response_id, but followed by the C side execution time (uint64 ns)
+static const char timed_response_id = 't';
+// Reply to a job, followed by the job id (uint32) and the execution time (uint64 ns)
+static const char job_response_id = 'j';
+// Raw replies to requests in the binary protocol <<'b', id::32, exec_ns::64, opcode::8, data>>
+static const char raw_response_id = 'b';
+/*
+ * Port stats (see handle_get_stats), every command keeps a latency histogram
+ * for each phase: decoding the request, the snap7 call (PLC I/O) and encoding
+ * plus sending the reply.
+ */
+enum command_phase { PHASE_DECODE, PHASE_PLC_IO, PHASE_ENCODE, N_PHASES };
+static const char phase_names[N_PHASES][7] = { "decode", "plc_io", "encode" };
+
+struct command_stats
+{
+    uint64_t errors;
+    struct s7_histogram phases[N_PHASES];
+};
+
+static struct command_stats *current_stats = NULL;
+static uint64_t request_start_ns;
+static bool reply_timing = false;
+
+/*
+ * Jobs are requests with a correlation id and a deadline, {{id, deadline_ms}, cmd, args},
+ * the deadline is in ms since the epoch (0 for none). Its remaining time caps the snap7
+ * Ping/Send/RecvTimeout of the job and overdue jobs are answered {:error, :timeout}.
+ */
+static bool job_active = false;
+static uint32_t job_id;
+/*
+ * Replies are queued by erlcmd and written together before the next snap7 call or
+ * once the port loop runs out of jobs, realtime ones (ERLCMD_FLUSH) right away.
+ */
+static int reply_flags = 0;
+// Ping/Send/RecvTimeout as set through set_params, restored after every job
+static int32_t snap7_timeouts[3];
+static bool snap7_timeouts_loaded = false;
+/*
+ * Batches, {stop_on_error, [{cmd, args}]}, run their commands back to back. Their
+ * replies are collected here instead of being sent and go back in a single
+ * {:ok, [result]} reply (see handle_batch).
+ */
+static bool batch_active = false;
+static bool batch_error;
+static bool batch_overflow;
+static int batch_count;
+static int batch_len;
+static char batch_replies[MAX_RESPONSE_SIZE - 64];
+/*
+ * Connection health (see handle_set_health). snap7 doesn't expose its socket, so it
+ * is found among our fds by its peer address once connected and gets SO_KEEPALIVE and
+ * TCP_USER_TIMEOUT. While idle the main loop watches it and probes the PLC every
+ * probe_interval ms, a dead peer is pushed as a {:disconnected, reason} notification.
+ * All zeros (the default) leaves the socket alone.
+ */
+struct health_config
+{
+    unsigned long keepalive_idle_ms;
+    unsigned long keepalive_interval_ms;
+    unsigned long keepalive_count;
+    unsigned long user_timeout_ms;
+    unsigned long probe_interval_ms;
+    unsigned long probe_timeout_ms;
 };
+static struct health_config health;
+static char plc_ip[20];
+static int plc_socket = -1;
+#define MAX_SOCKET_FD 1024
+static uint64_t plc_io_begin_ns;
+static uint64_t plc_io_end_ns;
+static uint64_t bytes_in = 0;
+static uint64_t bytes_out = 0;
+static uint64_t errors_s7[0x26];
+static uint64_t errors_iso[0x0F];
+static uint64_t errors_tcp = 0;
+static uint64_t errors_other = 0;
+
+// Wraps every snap7 call so its time is accounted as the PLC I/O phase
+#define PLC_IO(call) (plc_io_begin(), plc_io_end(call))
+
+static void plc_io_begin()
+{
+    // queued replies must not wait for the PLC
+    erlcmd_flush();
+    plc_io_begin_ns = s7_stats_now_ns();
+}
+
+static int plc_io_end(int result)
+{
+    plc_io_end_ns = s7_stats_now_ns();
+    return result;
+}
+
+static void count_error()
+{
+    if (current_stats != NULL)
+        __atomic_fetch_add(&current_stats->errors, 1, __ATOMIC_RELAXED);
+}
 
 struct client_config
 {
@@ -79,6 +137,83 @@ struct client_config
     int socket;           // 1 or 2
 };
 
+/**
+ * @brief Write the reply tag, when reply timing is on it is followed by
+ *  room for the execution time (filled in by send_response)
+ */
+static void encode_response_header(char *resp, int *resp_index)
+{
+    if (job_active) {
+        resp[(*resp_index)++] = job_response_id;
+        *resp_index += sizeof(uint32_t) + sizeof(uint64_t);
+    } else if (reply_timing) {
+        resp[(*resp_index)++] = timed_response_id;
+        *resp_index += sizeof(uint64_t);
+    } else {
+        resp[(*resp_index)++] = response_id;
+    }
+}
+
+/**
+ * @brief Writes the `size` low bytes of `value` big-endian into `buf`
+ */
+static void encode_be(char *buf, uint64_t value, int size)
+{
+    for (int i = size - 1; i >= 0; i--) {
+        buf[i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+/**
+ * @brief Keeps the term of a batched command reply, sent with an 'r' tag and
+ *  the version byte first
+ */
+static void collect_batch_reply(const char *resp, int resp_index)
+{
+    const char *term = &resp[sizeof(uint16_t) + 2];
+    int len = resp_index - sizeof(uint16_t) - 2;
+    if (batch_len + len > (int) sizeof(batch_replies)) {
+        batch_overflow = true;
+        return;
+    }
+
+    int index = 0;
+    int arity;
+    char atom[MAXATOMLEN];
+    batch_error = ei_decode_tuple_header(term, &index, &arity) == 0 && arity == 2 &&
+                  ei_decode_atom(term, &index, atom) == 0 && strcmp(atom, "error") == 0;
+
+    memcpy(&batch_replies[batch_len], term, len);
+    batch_len += len;
+    batch_count++;
+}
+
+/**
+ * @brief Send a reply back to Elixir, accounting its size
+ */
+static void send_response(char *resp, int resp_index)
+{
+    int header = sizeof(uint16_t) + 1;
+    if (batch_active) {
+        collect_batch_reply(resp, resp_index);
+        return;
+    }
+
+    uint64_t exec_ns = s7_stats_now_ns() - request_start_ns;
+
+    if (resp[sizeof(uint16_t)] == timed_response_id) {
+        encode_be(&resp[header], exec_ns, sizeof(uint64_t));
+    } else if (resp[sizeof(uint16_t)] == job_response_id ||
+            resp[sizeof(uint16_t)] == raw_response_id) {
+        encode_be(&resp[header], job_id, sizeof(uint32_t));
+        encode_be(&resp[header + sizeof(uint32_t)], exec_ns, sizeof(uint64_t));
+    }
+
+    __atomic_fetch_add(&bytes_out, resp_index, __ATOMIC_RELAXED);
+    erlcmd_queue(resp, resp_index, reply_flags);
+}
+
 /**
  * @brief Send :ok back to Elixir
  */
@@ -86,24 +221,26 @@ static void send_ok_response()
 {
     char resp[256];
     int resp_index = sizeof(uint16_t); // Space for payload size
-    resp[resp_index++] = response_id;
+    encode_response_header(resp, &resp_index);
     ei_encode_version(resp, &resp_index);
     ei_encode_atom(resp, &resp_index, "ok");
-    erlcmd_send(resp, resp_index);
+    send_response(resp, resp_index);
 }
 
+static void send_error_response(const char *reason);
+
 /**
  * @brief Send data back to Elixir in form of {:ok, data}
  */
 static void send_data_response(void *data, int data_type, int data_len)
 {
-    char resp[256];
+    static char resp[MAX_RESPONSE_SIZE];
     char version[5];
     uint32_t code;
     byte r_len = 1;
     long i_struct;
     int resp_index = sizeof(uint16_t); // Space for payload size
-    resp[resp_index++] = response_id;
+    encode_response_header(resp, &resp_index);
     ei_encode_version(resp, &resp_index);
     ei_encode_tuple_header(resp, &resp_index, 2);
     ei_encode_atom(resp, &resp_index, "ok");
@@ -127,7 +264,18 @@ static void send_data_response(void *data, int data_type, int data_len)
         break;
 
         case 5: //arrays (byte type)
-            ei_encode_binary(resp, &resp_index, data, data_len);
+        {
+            // big ones go through the shared memory ring when there's one (not in batches)
+            int slot = batch_active ? -1 : s7_shm_put(data, data_len);
+            if (slot < 0) {
+                ei_encode_binary(resp, &resp_index, data, data_len);
+            } else {
+                ei_encode_tuple_header(resp, &resp_index, 3);
+                ei_encode_atom(resp, &resp_index, "$shm");
+                ei_encode_ulong(resp, &resp_index, slot);
+                ei_encode_ulong(resp, &resp_index, data_len);
+            }
+        }
         break;
 
         case 6: //atom
@@ -165,6 +313,18 @@ static void send_data_response(void *data, int data_type, int data_len)
         break;
 
         case 8: // array ulongs
+        {
+            // a list of words that doesn't fit in a reply is refused
+            int encoded_size = resp_index;
+            ei_encode_list_header(NULL, &encoded_size, data_len);
+            for (i_struct = 0; i_struct < data_len; i_struct++)
+                ei_encode_ulong(NULL, &encoded_size, ((uint16_t *) data)[i_struct]);
+            ei_encode_empty_list(NULL, &encoded_size);
+            if (encoded_size > (int) MAX_RESPONSE_SIZE) {
+                send_error_response("e2big");
+                return;
+            }
+
             ei_encode_list_header(resp, &resp_index, data_len);
             for(i_struct = 0; i_struct < data_len; i_struct++) 
             {
@@ -172,6 +332,7 @@ static void send_data_response(void *data, int data_type, int data_len)
                data+=2;
             }
             ei_encode_empty_list(resp, &resp_index);        
+        }
         break;
 
         case 9: // TS7BlocksList
@@ -443,7 +604,7 @@ static void send_data_response(void *data, int data_type, int data_len)
         break;
     }
 
-    erlcmd_send(resp, resp_index);
+    send_response(resp, resp_index);
 }
 
 /**
@@ -455,12 +616,16 @@ static void send_error_response(const char *reason)
 {
     char resp[256];
     int resp_index = sizeof(uint16_t); // Space for payload size
-    resp[resp_index++] = response_id;
+
+    count_error();
+    __atomic_fetch_add(&errors_other, 1, __ATOMIC_RELAXED);
+
+    encode_response_header(resp, &resp_index);
     ei_encode_version(resp, &resp_index);
     ei_encode_tuple_header(resp, &resp_index, 2);
     ei_encode_atom(resp, &resp_index, "error");
     ei_encode_atom(resp, &resp_index, reason);
-    erlcmd_send(resp, resp_index);
+    send_response(resp, resp_index);
 }
 
 /**
@@ -477,8 +642,16 @@ static void send_snap7_errors(uint32_t code)
     int index_iso = (code & 0x000F0000)/ 0x10000;
     int index_tcp = (code & 0xFFFF);
     int resp_index = sizeof(uint16_t); // Space for payload size
+
+    count_error();
+    if(index_s7 != 0)
+        __atomic_fetch_add(&errors_s7[index_s7-1], 1, __ATOMIC_RELAXED);
+    if(index_iso != 0)
+        __atomic_fetch_add(&errors_iso[index_iso-1], 1, __ATOMIC_RELAXED);
+    if(index_tcp != 0)
+        __atomic_fetch_add(&errors_tcp, 1, __ATOMIC_RELAXED);
     
-    resp[resp_index++] = response_id;
+    encode_response_header(resp, &resp_index);
     ei_encode_version(resp, &resp_index);
     ei_encode_tuple_header(resp, &resp_index, 2);
     ei_encode_atom(resp, &resp_index, "error");
@@ -503,7 +676,115 @@ static void send_snap7_errors(uint32_t code)
         ei_encode_atom(resp, &resp_index, "nil");
 
 
-    erlcmd_send(resp, resp_index);
+    send_response(resp, resp_index);
+}
+
+/**
+ * @brief Bytes of an item of the given snap7 word length, 0 when unknown
+ */
+static int word_size(uint64_t word_len)
+{
+    switch (word_len) {
+        case 0x01:
+        case 0x02:
+            return 1;
+
+        case 0x04:
+        case 0x1C:
+        case 0x1D:
+            return 2;
+
+        case 0x06:
+        case 0x08:
+            return 4;
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Decode a binary of exactly `size` bytes into data, the size is checked
+ *  before anything is copied
+ * @return -1 when the term isn't a binary of that size
+ */
+static int decode_binary(const char *req, int *req_index, void *data, unsigned long size)
+{
+    int term_type;
+    int term_size;
+    long bin_size;
+    if (ei_get_type(req, req_index, &term_type, &term_size) < 0 ||
+            term_type != ERL_BINARY_EXT ||
+            (unsigned long) term_size != size)
+        return -1;
+
+    return ei_decode_binary(req, req_index, data, &bin_size);
+}
+
+/**
+ * @brief Push a notification of the form {event, reason}, tagged with 'n'
+ */
+static void send_notification(const char *event, const char *reason)
+{
+    char resp[64];
+    int resp_index = sizeof(uint16_t); // Space for payload size
+
+    resp[resp_index++] = notification_id;
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, event);
+    ei_encode_atom(resp, &resp_index, reason);
+    __atomic_fetch_add(&bytes_out, resp_index, __ATOMIC_RELAXED);
+    erlcmd_queue(resp, resp_index, ERLCMD_FLUSH);
+}
+
+/**
+ * @brief Finds the snap7 socket (connected to plc_ip and the remote port) and applies
+ *  the keepalive and user timeout of the health config
+ */
+static void setup_plc_socket()
+{
+    struct in_addr addr;
+    uint16_t port = 102;
+    plc_socket = -1;
+    if (inet_pton(AF_INET, plc_ip, &addr) != 1)
+        return;
+    Cli_GetParam(Client, p_u16_RemotePort, &port);
+
+    for (int fd = STDERR_FILENO + 1; fd < MAX_SOCKET_FD; fd++) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr *) &peer, &len) == 0 && peer.sin_family == AF_INET &&
+                peer.sin_addr.s_addr == addr.s_addr && peer.sin_port == htons(port)) {
+            plc_socket = fd;
+            break;
+        }
+    }
+    if (plc_socket < 0)
+        return;
+
+    if (health.keepalive_idle_ms != 0) {
+        int on = 1;
+        int idle = (int) ((health.keepalive_idle_ms + 999) / 1000);
+        int interval = (int) ((health.keepalive_interval_ms + 999) / 1000);
+        int count = (int) health.keepalive_count;
+        setsockopt(plc_socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+        setsockopt(plc_socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#else
+        setsockopt(plc_socket, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle));
+#endif
+        if (interval > 0)
+            setsockopt(plc_socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        if (count > 0)
+            setsockopt(plc_socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    }
+#ifdef TCP_USER_TIMEOUT
+    if (health.user_timeout_ms != 0) {
+        unsigned int user_timeout = (unsigned int) health.user_timeout_ms;
+        setsockopt(plc_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+    }
+#endif
 }
 
 static void debug_str(const char *msg)
@@ -537,7 +818,7 @@ static void handle_set_connection_type(const char *req, int *req_index)
         return;
     }
 
-    int result = Cli_SetConnectionType(Client, val);
+    int result = PLC_IO(Cli_SetConnectionType(Client, val));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -558,8 +839,10 @@ static void handle_connect_to(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":connect_to requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     char ip[20];
     long binary_len;
@@ -586,13 +869,15 @@ static void handle_connect_to(const char *req, int *req_index)
         return;
     }
     
-    int result = Cli_ConnectTo(Client, ip, (int)rack, (int)slot);
+    int result = PLC_IO(Cli_ConnectTo(Client, ip, (int)rack, (int)slot));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
         return;
     }
-            
+
+    strcpy(plc_ip, ip);
+    setup_plc_socket();
     send_ok_response();
 }
 
@@ -608,8 +893,10 @@ static void handle_set_connection_params(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":set_connection_params requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     char ip[20];
     long binary_len;
@@ -636,13 +923,14 @@ static void handle_set_connection_params(const char *req, int *req_index)
         return;
     }
 
-    int result = Cli_SetConnectionParams(Client, ip, (uint16_t)local_tsap, (uint16_t)remote_tsap);
+    int result = PLC_IO(Cli_SetConnectionParams(Client, ip, (uint16_t)local_tsap, (uint16_t)remote_tsap));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
         return;
     }
-            
+
+    strcpy(plc_ip, ip);
     send_ok_response();
 }
 
@@ -653,13 +941,14 @@ static void handle_set_connection_params(const char *req, int *req_index)
 static void handle_connect(const char *req, int *req_index)
 {   
     
-    int result = Cli_Connect(Client);
+    int result = PLC_IO(Cli_Connect(Client));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
         return;
     }
-            
+
+    setup_plc_socket();
     send_ok_response();
 }
 /**
@@ -668,7 +957,8 @@ static void handle_connect(const char *req, int *req_index)
 static void handle_disconnect(const char *req, int *req_index)
 {   
     
-    int result = Cli_Disconnect(Client);
+    plc_socket = -1;
+    int result = PLC_IO(Cli_Disconnect(Client));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -698,7 +988,7 @@ static void handle_get_params(const char *req, int *req_index)
         case 7: // u16
         case 8: // 
         case 9: 
-            result = Cli_GetParam(Client, ind_param, &data);
+            result = PLC_IO(Cli_GetParam(Client, ind_param, &data));
             if (result != 0){
                 //the paramater was invalid.
                 send_snap7_errors(result);
@@ -711,7 +1001,7 @@ static void handle_get_params(const char *req, int *req_index)
         case 4: // s16
         case 5: //
         case 10:
-            result = Cli_GetParam(Client, ind_param, &data);
+            result = PLC_IO(Cli_GetParam(Client, ind_param, &data));
             if (result != 0){
                 //the paramater was invalid.
                 send_snap7_errors(result);
@@ -735,8 +1025,10 @@ static void handle_set_params(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":set_params requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     char ind_param;
     if (ei_decode_char(req, req_index, &ind_param) < 0) {
@@ -760,12 +1052,15 @@ static void handle_set_params(const char *req, int *req_index)
         case 4: 
         case 5: 
         case 10:
-            result = Cli_SetParam(Client, ind_param, &data);
+            result = PLC_IO(Cli_SetParam(Client, ind_param, &data));
             if (result != 0){
                 //the paramater was invalid.
                 send_snap7_errors(result);
                 return;
             }
+            // jobs restore these after applying their deadline
+            if (ind_param >= p_i32_PingTimeout && ind_param <= p_i32_RecvTimeout)
+                snap7_timeouts[ind_param - p_i32_PingTimeout] = (int32_t) data;
             send_ok_response();
         break;
 
@@ -788,8 +1083,10 @@ static void handle_read_area(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 5)
-        errx(EXIT_FAILURE, ":read_area requires a 5-tuple, term_size = %d", term_size);
+        term_size != 5) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long area;
     if (ei_decode_ulong(req, req_index, &area) < 0) {
@@ -821,27 +1118,14 @@ static void handle_read_area(const char *req, int *req_index)
         return;
     }
 
-    switch(data_type)
-    {
-        case 0x01:
-        case 0x02:  
-            data_len = 1;
-        break;
-
-        case 0x04: 
-        case 0x1C:
-        case 0x1D:  
-            data_len = 2;
-        break;
-        
-        case 0x06: 
-        case 0x08: 
-            data_len = 4;
-        break;
+    data_len = word_size(data_type);
+    if (data_len == 0 || amount > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
     }
     
     unsigned char data[data_len*amount];
-    int result = Cli_ReadArea(Client, (int)area, (int)db_number, (int)start, (int)amount, (int)data_type, &data);
+    int result = PLC_IO(Cli_ReadArea(Client, (int)area, (int)db_number, (int)start, (int)amount, (int)data_type, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -862,8 +1146,10 @@ static void handle_write_area(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 6)
-        errx(EXIT_FAILURE, ":write_area requires a 6-tuple, term_size = %d", term_size);
+        term_size != 6) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long area;
     if (ei_decode_ulong(req, req_index, &area) < 0) {
@@ -895,36 +1181,19 @@ static void handle_write_area(const char *req, int *req_index)
         return;
     }
 
-    switch(data_type)
-    {
-        case 0x01:
-        case 0x02:  
-            data_len = 1;
-        break;
-
-        case 0x04: 
-        case 0x1C:
-        case 0x1D:  
-            data_len = 2;
-        break;
-        
-        case 0x06: 
-        case 0x08: 
-            data_len = 4;
-        break;
-
-        default:
-            errx(EXIT_FAILURE, "inconsistent data_type = %ld", data_type);
-        break;
+    data_len = word_size(data_type);
+    if (data_len == 0 || amount > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
     }
     
     unsigned char data[data_len*amount];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != (data_len*amount))
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", (data_len*amount), bin_size);
+    if(decode_binary(req, req_index, data, data_len*amount) < 0) {
+        send_error_response("einval");
+        return;
+    }
     
-    int result = Cli_WriteArea(Client, (int)area, (int)db_number, (int)start, (int)amount, (int)data_type, &data);
+    int result = PLC_IO(Cli_WriteArea(Client, (int)area, (int)db_number, (int)start, (int)amount, (int)data_type, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -946,8 +1215,10 @@ static void handle_db_read(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":db_read requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long db_number;
     if (ei_decode_ulong(req, req_index, &db_number) < 0) {
@@ -967,8 +1238,13 @@ static void handle_db_read(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    int result = Cli_DBRead(Client, (int)db_number, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_DBRead(Client, (int)db_number, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -990,8 +1266,10 @@ static void handle_db_write(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 4)
-        errx(EXIT_FAILURE, ":db_write requires a 4-tuple, term_size = %d", term_size);
+        term_size != 4) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long db_number;
     if (ei_decode_ulong(req, req_index, &db_number) < 0) {
@@ -1011,13 +1289,18 @@ static void handle_db_write(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != (data_len*size))
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", (data_len*size), bin_size);
+    if(decode_binary(req, req_index, data, data_len*size) < 0) {
+        send_error_response("einval");
+        return;
+    }
     
-    int result = Cli_DBWrite(Client, (int)db_number, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_DBWrite(Client, (int)db_number, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1039,8 +1322,10 @@ static void handle_ab_read(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":ab_read requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1054,8 +1339,13 @@ static void handle_ab_read(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    int result = Cli_ABRead(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_ABRead(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1077,8 +1367,10 @@ static void handle_ab_write(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":ab_write requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1092,13 +1384,18 @@ static void handle_ab_write(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != (data_len*size))
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", (data_len*size), bin_size);
+    if(decode_binary(req, req_index, data, data_len*size) < 0) {
+        send_error_response("einval");
+        return;
+    }
     
-    int result = Cli_ABWrite(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_ABWrite(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1120,8 +1417,10 @@ static void handle_eb_read(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":eb_read requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1135,8 +1434,13 @@ static void handle_eb_read(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    int result = Cli_EBRead(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_EBRead(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1158,8 +1462,10 @@ static void handle_eb_write(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":eb_write requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1173,13 +1479,18 @@ static void handle_eb_write(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != (data_len*size))
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", (data_len*size), bin_size);
+    if(decode_binary(req, req_index, data, data_len*size) < 0) {
+        send_error_response("einval");
+        return;
+    }
     
-    int result = Cli_EBWrite(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_EBWrite(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1201,8 +1512,10 @@ static void handle_mb_read(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":mb_read requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1216,8 +1529,13 @@ static void handle_mb_read(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    int result = Cli_MBRead(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_MBRead(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1239,8 +1557,10 @@ static void handle_mb_write(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":mb_write requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1254,13 +1574,18 @@ static void handle_mb_write(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != (data_len*size))
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", (data_len*size), bin_size);
+    if(decode_binary(req, req_index, data, data_len*size) < 0) {
+        send_error_response("einval");
+        return;
+    }
     
-    int result = Cli_MBWrite(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_MBWrite(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1282,8 +1607,10 @@ static void handle_tm_read(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":tm_read requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1297,8 +1624,13 @@ static void handle_tm_read(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    int result = Cli_TMRead(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_TMRead(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1320,8 +1652,10 @@ static void handle_tm_write(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":tm_write requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1335,13 +1669,18 @@ static void handle_tm_write(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != (data_len*size))
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", (data_len*size), bin_size);
+    if(decode_binary(req, req_index, data, data_len*size) < 0) {
+        send_error_response("einval");
+        return;
+    }
     
-    int result = Cli_TMWrite(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_TMWrite(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1363,8 +1702,10 @@ static void handle_ct_read(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":ct_read requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1378,8 +1719,13 @@ static void handle_ct_read(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    int result = Cli_CTRead(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_CTRead(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1401,8 +1747,10 @@ static void handle_ct_write(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":ct_write requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long start;
     if (ei_decode_ulong(req, req_index, &start) < 0) {
@@ -1416,13 +1764,18 @@ static void handle_ct_write(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE / data_len) {
+        send_error_response("einval");
+        return;
+    }
+    
     unsigned char data[data_len*size];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != (data_len*size))
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", (data_len*size), bin_size);
+    if(decode_binary(req, req_index, data, data_len*size) < 0) {
+        send_error_response("einval");
+        return;
+    }
     
-    int result = Cli_CTWrite(Client, (int)start, (int)size, &data);
+    int result = PLC_IO(Cli_CTWrite(Client, (int)start, (int)size, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1442,34 +1795,37 @@ static void handle_read_multi_vars(const char *req, int *req_index)
     unsigned long i_struct;
     int i_key;
     const unsigned char n_keys = 5;
-    int term_type;
     int term_size;
-    long bin_size;
-    byte data_len;
+    unsigned long total = 0;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":read_multi_vars requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long n_vars;
-    if (ei_decode_ulong(req, req_index, &n_vars) < 0) {
+    if (ei_decode_ulong(req, req_index, &n_vars) < 0 ||
+        n_vars == 0 || n_vars > MAX_VARS) {
         send_error_response("einval");
         return;
     }
 
     if(ei_decode_list_header(req, req_index, &term_size) < 0 || 
-        term_size != n_vars)
-        errx(EXIT_FAILURE, ":read_multi_vars inconsistent argument size n_vars = %ld, n_maps = %d",
-        n_vars, term_size);
+        (unsigned long) term_size != n_vars) {
+        send_error_response("einval");
+        return;
+    }
     
     TS7DataItem Items[n_vars];
-    byte *data_ptrs[n_vars];
+    unsigned long sizes[n_vars];
 
     for(i_struct = 0; i_struct < n_vars; i_struct++) 
     {
         if(ei_decode_map_header(req, req_index, &term_size) < 0 || 
-        term_size != n_keys)
-        errx(EXIT_FAILURE, ":read_multi_vars inconsistent argument size n_keys = %d, arity = %d",
-        n_keys, term_size);
+            term_size != n_keys) {
+            send_error_response("einval");
+            return;
+        }
         
         for(i_key = 0; i_key < n_keys; i_key++)
         {
@@ -1488,56 +1844,45 @@ static void handle_read_multi_vars(const char *req, int *req_index)
             if(!strcmp(atom, "amount"))
                 Items[i_struct].Amount = (int)value;            
             else if(!strcmp(atom, "word_len"))
-            {
                 Items[i_struct].WordLen = (int)value;
-                switch(value)
-                {
-                    case 0x01:
-                    case 0x02:  
-                        data_len = 1;
-                    break;
-
-                    case 0x04: 
-                    case 0x1C:
-                    case 0x1D:  
-                        data_len = 2;
-                    break;
-                    
-                    case 0x06: 
-                    case 0x08: 
-                        data_len = 4;
-                    break;
-
-                    default:
-                        errx(EXIT_FAILURE, "inconsistent data_type = %ld", value);
-                    break;
-                }
-            }
             else if(!strcmp(atom, "db_number")) 
                 Items[i_struct].DBNumber = (int)value;
             else if(!strcmp(atom, "start")) 
                 Items[i_struct].Start = (int)value;
             else if(!strcmp(atom, "area")) 
                 Items[i_struct].Area = (int)value;
-            else
-                errx(EXIT_FAILURE, ":read_multi_vars invalid");            
+            else {
+                send_error_response("einval");
+                return;
+            }
         } 
-        data_ptrs[i_struct] = (byte *) malloc(Items[i_struct].Amount*data_len);
-        Items[i_struct].pdata = data_ptrs[i_struct];
+
+        // the replies of every var share the response
+        int data_len = word_size(Items[i_struct].WordLen);
+        if (data_len == 0 || Items[i_struct].Amount < 0 ||
+            (unsigned long) Items[i_struct].Amount > (MAX_DATA_SIZE - total) / data_len) {
+            send_error_response("einval");
+            return;
+        }
+        sizes[i_struct] = Items[i_struct].Amount * data_len;
+        total += sizes[i_struct];
     }
-    //errx(EXIT_FAILURE, ":read_multi_vars invalid %d", 232);            
-    int result = Cli_ReadMultiVars(Client, &Items[0], n_vars);
+
+    byte data[total];
+    for(i_struct = 0, total = 0; i_struct < n_vars; i_struct++) 
+    {
+        Items[i_struct].pdata = &data[total];
+        total += sizes[i_struct];
+    }
+
+    int result = PLC_IO(Cli_ReadMultiVars(Client, &Items[0], n_vars));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
-        for(i_struct = 0; i_struct < n_vars; i_struct++) 
-            free(data_ptrs[i_struct]);
         return;
     }    
                 
     send_data_response(&Items, 7, n_vars);
-    for(i_struct = 0; i_struct < n_vars; i_struct++) 
-        free(data_ptrs[i_struct]);
 }
 
 /**
@@ -1552,37 +1897,42 @@ static void handle_write_multi_vars(const char *req, int *req_index)
     const unsigned char n_keys = 6;
     int term_type;
     int term_size;
-    long bin_size;
     unsigned long value;
-    unsigned char data_len;
-    unsigned char tmp_ind;
-    byte data[256];
+    unsigned long total = 0;
 
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":write_multi_vars requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long n_vars;
-    if (ei_decode_ulong(req, req_index, &n_vars) < 0) {
+    if (ei_decode_ulong(req, req_index, &n_vars) < 0 ||
+        n_vars == 0 || n_vars > MAX_VARS) {
         send_error_response("einval");
         return;
     }
 
     if(ei_decode_list_header(req, req_index, &term_size) < 0 || 
-        term_size != n_vars)
-        errx(EXIT_FAILURE, ":write_multi_vars inconsistent argument size n_vars = %ld, n_maps = %d",
-        n_vars, term_size);
+        (unsigned long) term_size != n_vars) {
+        send_error_response("einval");
+        return;
+    }
     
     TS7DataItem Items[n_vars];
-    byte *data_ptrs[n_vars];
+    // index of the data binary of each var, decoded once its size is known
+    int data_index[n_vars];
+    byte data[MAX_DATA_SIZE];
 
     for(i_struct = 0; i_struct < n_vars; i_struct++) 
     {
         if(ei_decode_map_header(req, req_index, &term_size) < 0 || 
-        term_size != n_keys)
-        errx(EXIT_FAILURE, ":write_multi_vars inconsistent argument size n_keys = %d, arity = %d",
-        n_keys, term_size);
+            term_size != n_keys) {
+            send_error_response("einval");
+            return;
+        }
         
+        data_index[i_struct] = -1;
         for(i_key = 0; i_key < n_keys; i_key++)
         {
             char atom[10];
@@ -1593,78 +1943,61 @@ static void handle_write_multi_vars(const char *req, int *req_index)
             
             if(!strcmp(atom, "data")) 
             {
-                if(ei_decode_binary(req, req_index, data, &bin_size) < 0)
-                {
-                    send_error_response("einval_g");
+                data_index[i_struct] = *req_index;
+                if(ei_get_type(req, req_index, &term_type, &term_size) < 0 ||
+                    term_type != ERL_BINARY_EXT ||
+                    ei_skip_term(req, req_index) < 0) {
+                    send_error_response("einval");
                     return;
                 }
+                continue;
             }
-            else
-            {
-                if (ei_decode_ulong(req, req_index, &value) < 0) {
-                    send_error_response("einval_2");
-                    return;
-                }
+
+            if (ei_decode_ulong(req, req_index, &value) < 0) {
+                send_error_response("einval");
+                return;
             }
+
             if(!strcmp(atom, "amount"))
                 Items[i_struct].Amount = (int)value;            
             else if(!strcmp(atom, "word_len"))
-            { 
                 Items[i_struct].WordLen = (int)value;
-                switch(value)
-                {
-                    case 0x01:
-                    case 0x02:  
-                        data_len = 1;
-                    break;
-
-                    case 0x04: 
-                    case 0x1C:
-                    case 0x1D:  
-                        data_len = 2;
-                    break;
-                    
-                    case 0x06: 
-                    case 0x08: 
-                        data_len = 4;
-                    break;
-
-                    default:
-                        errx(EXIT_FAILURE, "write_multi_vars inconsistent data_type = %ld", value);
-                    break;
-                }
-            }
             else if(!strcmp(atom, "db_number")) 
                 Items[i_struct].DBNumber = (int)value;
             else if(!strcmp(atom, "start")) 
                 Items[i_struct].Start = (int)value;
             else if(!strcmp(atom, "area")) 
                 Items[i_struct].Area = (int)value;      
+            else {
+                send_error_response("einval");
+                return;
+            }
         } 
         
-        if(bin_size != (Items[i_struct].Amount*data_len))
-            errx(EXIT_FAILURE, ":write_multi_vars binary inconsistent, expected size = %d, real = %ld",
-            (Items[i_struct].Amount*data_len), bin_size); 
+        int data_len = word_size(Items[i_struct].WordLen);
+        if (data_index[i_struct] < 0 || data_len == 0 || Items[i_struct].Amount < 0 ||
+            (unsigned long) Items[i_struct].Amount > (MAX_DATA_SIZE - total) / data_len) {
+            send_error_response("einval");
+            return;
+        }
 
-        data_ptrs[i_struct] = (byte *) malloc(Items[i_struct].Amount*data_len);
-        
-        for(tmp_ind=0; tmp_ind < Items[i_struct].Amount*data_len; tmp_ind ++)
-            data_ptrs[i_struct][tmp_ind] = data[tmp_ind];
-        
-        Items[i_struct].pdata = data_ptrs[i_struct];
+        unsigned long size = Items[i_struct].Amount * data_len;
+        if (decode_binary(req, &data_index[i_struct], &data[total], size) < 0) {
+            send_error_response("einval");
+            return;
+        }
+
+        Items[i_struct].pdata = &data[total];
+        total += size;
     }
 
-    int result = Cli_WriteMultiVars(Client, &Items[0], n_vars);
+    int result = PLC_IO(Cli_WriteMultiVars(Client, &Items[0], n_vars));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
-        for(i_struct = 0; i_struct < n_vars; i_struct++) 
-           free(data_ptrs[i_struct]);
         return;
     }    
     send_ok_response();
-    for(i_struct = 0; i_struct < n_vars; i_struct++) 
-        free(data_ptrs[i_struct]);
 }
 
 // Directory functions
@@ -1676,7 +2009,7 @@ static void handle_list_blocks(const char *req, int *req_index)
 {
     const byte data_len = 7; //n items in TS7BlocksOfType struct
     TS7BlocksList List;
-    int result = Cli_ListBlocks(Client, &List);
+    int result = PLC_IO(Cli_ListBlocks(Client, &List));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1696,8 +2029,10 @@ static void handle_list_blocks_of_type(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":list_blocks_of_type requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
     
     unsigned long block_type;
     if (ei_decode_ulong(req, req_index, &block_type) < 0) {
@@ -1710,9 +2045,15 @@ static void handle_list_blocks_of_type(const char *req, int *req_index)
         send_error_response("einval");
         return;
     }
-    int items_count = (int) n_items;    //check for a better way of casting...
+
+    // block numbers are words, at most 0x8000 of them fit a stack buffer of MAX_DATA_SIZE
+    if (n_items == 0 || n_items > 0x8000) {
+        send_error_response("einval");
+        return;
+    }
+    int items_count = (int) n_items;
     short unsigned int data[items_count];
-    int result = Cli_ListBlocksOfType(Client, (int)block_type, &data, &items_count);
+    int result = PLC_IO(Cli_ListBlocksOfType(Client, (int)block_type, &data, &items_count));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1738,8 +2079,10 @@ static void handle_get_ag_block_info(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":get_ag_block_info requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
     
     unsigned long block_type;
     if (ei_decode_ulong(req, req_index, &block_type) < 0) {
@@ -1754,7 +2097,7 @@ static void handle_get_ag_block_info(const char *req, int *req_index)
     }
     
     TS7BlockInfo block_ag_info;
-    int result = Cli_GetAgBlockInfo(Client, (int)block_type, (int)block_num, &block_ag_info);
+    int result = PLC_IO(Cli_GetAgBlockInfo(Client, (int)block_type, (int)block_num, &block_ag_info));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1779,8 +2122,10 @@ static void handle_get_pg_block_info(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":get_pg_block_info requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
     
     unsigned long size;
     if (ei_decode_ulong(req, req_index, &size) < 0) {
@@ -1788,15 +2133,19 @@ static void handle_get_pg_block_info(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE) {
+        send_error_response("einval");
+        return;
+    }
+    
     byte data[size];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != size)
-        errx(EXIT_FAILURE, ":get_pg_block_info binary inconsistent, expected size = %ld, real = %ld",
-         size, bin_size);
+    if(decode_binary(req, req_index, data, size) < 0) {
+        send_error_response("einval");
+        return;
+    }
 
     TS7BlockInfo block_ag_info;
-    int result = Cli_GetPgBlockInfo(Client, &data, &block_ag_info, (int)size);
+    int result = PLC_IO(Cli_GetPgBlockInfo(Client, &data, &block_ag_info, (int)size));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1818,8 +2167,10 @@ static void handle_full_upload(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":full_upload requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long block_type;
     if (ei_decode_ulong(req, req_index, &block_type) < 0) {
@@ -1839,9 +2190,14 @@ static void handle_full_upload(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE) {
+        send_error_response("einval");
+        return;
+    }
+    
     byte data[size];
     int length = (int)size;    //check for a better way of casting...
-    int result = Cli_FullUpload(Client, (int)block_type, (int)block_num, &data, &length);
+    int result = PLC_IO(Cli_FullUpload(Client, (int)block_type, (int)block_num, &data, &length));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1860,8 +2216,10 @@ static void handle_upload(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":upload requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long block_type;
     if (ei_decode_ulong(req, req_index, &block_type) < 0) {
@@ -1881,9 +2239,14 @@ static void handle_upload(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE) {
+        send_error_response("einval");
+        return;
+    }
+    
     byte data[size];
     int length = (int)size;    //check for a better way of casting...
-    int result = Cli_Upload(Client, (int)block_type, (int)block_num, &data, &length);
+    int result = PLC_IO(Cli_Upload(Client, (int)block_type, (int)block_num, &data, &length));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1903,8 +2266,10 @@ static void handle_download(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 3)
-        errx(EXIT_FAILURE, ":download requires a 3-tuple, term_size = %d", term_size);
+        term_size != 3) {
+        send_error_response("einval");
+        return;
+    }
     
     unsigned long block_num;
     if (ei_decode_ulong(req, req_index, &block_num) < 0) {
@@ -1918,13 +2283,18 @@ static void handle_download(const char *req, int *req_index)
         return;
     }
     
+    if (size > MAX_DATA_SIZE) {
+        send_error_response("einval");
+        return;
+    }
+    
     byte data[size];
-    long bin_size;
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != size)
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", size, bin_size);
+    if(decode_binary(req, req_index, data, size) < 0) {
+        send_error_response("einval");
+        return;
+    }
 
-    int result = Cli_Download(Client, (int)block_num, &data, (int)size);
+    int result = PLC_IO(Cli_Download(Client, (int)block_num, &data, (int)size));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1943,8 +2313,10 @@ static void handle_delete(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":delete requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
     
     unsigned long block_type;
     if (ei_decode_ulong(req, req_index, &block_type) < 0) {
@@ -1958,7 +2330,7 @@ static void handle_delete(const char *req, int *req_index)
         return;
     }   
 
-    int result = Cli_Delete(Client, (int)block_num, (int)block_type);
+    int result = PLC_IO(Cli_Delete(Client, (int)block_num, (int)block_type));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -1979,8 +2351,10 @@ static void handle_db_get(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":db_get requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
     
     unsigned long db_number;
     if (ei_decode_ulong(req, req_index, &db_number) < 0) {
@@ -1994,16 +2368,23 @@ static void handle_db_get(const char *req, int *req_index)
         return;
     }
     
+    // S7 DBs are up to 64KB
+    if (size > 0x10000) {
+        send_error_response("einval");
+        return;
+    }
+    
     byte data[size];
     int length = (int)size;    //check for a better way of casting...
-    int result = Cli_DBGet(Client, (int)db_number, &data, &length);
+    int result = PLC_IO(Cli_DBGet(Client, (int)db_number, &data, &length));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
         return;
     }
-    
-    send_data_response(data, 8, (int)size);
+
+    // the DB is answered as a list of words, only the ones snap7 got (e2big past a reply)
+    send_data_response(data, 8, length / 2);
 }
 
 /**
@@ -2014,8 +2395,10 @@ static void handle_db_fill(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":db_fill requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
     
     unsigned long db_number;
     if (ei_decode_ulong(req, req_index, &db_number) < 0) {
@@ -2029,7 +2412,7 @@ static void handle_db_fill(const char *req, int *req_index)
         return;
     }
     
-    int result = Cli_DBFill(Client, (int)db_number, (int)fill_char);
+    int result = PLC_IO(Cli_DBFill(Client, (int)db_number, (int)fill_char));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2047,7 +2430,7 @@ static void handle_db_fill(const char *req, int *req_index)
 static void handle_get_plc_date_time(const char *req, int *req_index)
 {
     tm date;
-    int result = Cli_GetPlcDateTime(Client, &date);
+    int result = PLC_IO(Cli_GetPlcDateTime(Client, &date));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2067,8 +2450,10 @@ static void handle_set_plc_date_time(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 9)
-        errx(EXIT_FAILURE, ":set_plc_date_time requires a 9-tuple, term_size = %d", term_size);
+        term_size != 9) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long tm_sec;
     if (ei_decode_ulong(req, req_index, &tm_sec) < 0) {
@@ -2133,7 +2518,7 @@ static void handle_set_plc_date_time(const char *req, int *req_index)
     }
     date.tm_isdst = tm_isdst;
     
-    int result = Cli_SetPlcDateTime(Client, &date);
+    int result = PLC_IO(Cli_SetPlcDateTime(Client, &date));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2148,7 +2533,7 @@ static void handle_set_plc_date_time(const char *req, int *req_index)
 */
 static void handle_set_plc_system_date_time(const char *req, int *req_index)
 {
-    int result = Cli_SetPlcSystemDateTime(Client);
+    int result = PLC_IO(Cli_SetPlcSystemDateTime(Client));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2171,8 +2556,10 @@ static void handle_read_szl(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":read_szl requires a 2-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
     
     unsigned long ID;
     if (ei_decode_ulong(req, req_index, &ID) < 0) {
@@ -2188,7 +2575,7 @@ static void handle_read_szl(const char *req, int *req_index)
 
     TS7SZL data;
     int size = sizeof(data);
-    int result = Cli_ReadSZL(Client, (int)ID, (int)Index, &data, &size);
+    int result = PLC_IO(Cli_ReadSZL(Client, (int)ID, (int)Index, &data, &size));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2209,7 +2596,7 @@ static void handle_read_szl_list(const char *req, int *req_index)
 {
     TS7SZLList data;
     int size = sizeof(data);
-    int result = Cli_ReadSZLList(Client, &data, &size);
+    int result = PLC_IO(Cli_ReadSZLList(Client, &data, &size));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2225,7 +2612,7 @@ static void handle_read_szl_list(const char *req, int *req_index)
 static void handle_get_order_code(const char *req, int *req_index)
 {
     TS7OrderCode data;
-    int result = Cli_GetOrderCode(Client, &data);
+    int result = PLC_IO(Cli_GetOrderCode(Client, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2241,7 +2628,7 @@ static void handle_get_order_code(const char *req, int *req_index)
 static void handle_get_cpu_info(const char *req, int *req_index)
 {
     TS7CpuInfo data;
-    int result = Cli_GetCpuInfo(Client, &data);
+    int result = PLC_IO(Cli_GetCpuInfo(Client, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2258,7 +2645,7 @@ static void handle_get_cpu_info(const char *req, int *req_index)
 static void handle_get_cp_info(const char *req, int *req_index)
 {
     TS7CpInfo data;
-    int result = Cli_GetCpInfo(Client, &data);
+    int result = PLC_IO(Cli_GetCpInfo(Client, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2276,7 +2663,7 @@ static void handle_get_cp_info(const char *req, int *req_index)
 */
 static void handle_plc_hot_start(const char *req, int *req_index)
 {
-    int result = Cli_PlcHotStart(Client);
+    int result = PLC_IO(Cli_PlcHotStart(Client));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2291,7 +2678,7 @@ static void handle_plc_hot_start(const char *req, int *req_index)
 */
 static void handle_plc_cold_start(const char *req, int *req_index)
 {
-    int result = Cli_PlcColdStart(Client);
+    int result = PLC_IO(Cli_PlcColdStart(Client));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2306,7 +2693,7 @@ static void handle_plc_cold_start(const char *req, int *req_index)
 */
 static void handle_plc_stop(const char *req, int *req_index)
 {
-    int result = Cli_PlcStop(Client);
+    int result = PLC_IO(Cli_PlcStop(Client));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2328,7 +2715,7 @@ static void handle_copy_ram_to_rom(const char *req, int *req_index)
         return;
     }
 
-    int result = Cli_CopyRamToRom(Client, (int)timeout);
+    int result = PLC_IO(Cli_CopyRamToRom(Client, (int)timeout));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2350,7 +2737,7 @@ static void handle_compress(const char *req, int *req_index)
         return;
     }
 
-    int result = Cli_Compress(Client, (int)timeout);
+    int result = PLC_IO(Cli_Compress(Client, (int)timeout));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2366,7 +2753,7 @@ static void handle_compress(const char *req, int *req_index)
 static void handle_get_plc_status(const char *req, int *req_index)
 {
     int status;
-    int result = Cli_GetPlcStatus(Client, &status);
+    int result = PLC_IO(Cli_GetPlcStatus(Client, &status));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2388,7 +2775,7 @@ static void handle_get_plc_status(const char *req, int *req_index)
         break;
 
         default:
-            errx(EXIT_FAILURE, ":get_plc_status unknown snap7 status = %d", status);
+            send_data_response("S7CpuStatusUnknown", 6, 0);
         break;
     }
 }
@@ -2417,7 +2804,7 @@ static void handle_set_session_password(const char *req, int *req_index)
     }
     password[term_size] = '\0';
     
-    int result = Cli_SetSessionPassword(Client, password);
+    int result = PLC_IO(Cli_SetSessionPassword(Client, password));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2432,7 +2819,7 @@ static void handle_set_session_password(const char *req, int *req_index)
 */
 static void handle_clear_session_password(const char *req, int *req_index)
 {    
-    int result = Cli_ClearSessionPassword(Client);
+    int result = PLC_IO(Cli_ClearSessionPassword(Client));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2448,7 +2835,7 @@ static void handle_clear_session_password(const char *req, int *req_index)
 static void handle_get_protection(const char *req, int *req_index)
 {    
     TS7Protection data;
-    int result = Cli_GetProtection(Client, &data);
+    int result = PLC_IO(Cli_GetProtection(Client, &data));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2468,8 +2855,10 @@ static void handle_iso_exchange_buffer(const char *req, int *req_index)
     int term_type;
     int term_size;
     if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
-        term_size != 2)
-        errx(EXIT_FAILURE, ":db_write requires a 4-tuple, term_size = %d", term_size);
+        term_size != 2) {
+        send_error_response("einval");
+        return;
+    }
 
     unsigned long size;
     if (ei_decode_ulong(req, req_index, &size) < 0) {
@@ -2478,13 +2867,13 @@ static void handle_iso_exchange_buffer(const char *req, int *req_index)
     }
     
     unsigned char data[1024];
-    long bin_size;
     int length = (int)size;    //check for a better way of casting...
-    if(ei_decode_binary(req, req_index, data, &bin_size) < 0 ||
-        bin_size != size)
-        errx(EXIT_FAILURE, "binary inconsistent, expected size = %ld, real = %ld", size, bin_size);
+    if(size > sizeof(data) || decode_binary(req, req_index, data, size) < 0) {
+        send_error_response("einval");
+        return;
+    }
     
-    int result = Cli_IsoExchangeBuffer(Client, &data, &length);
+    int result = PLC_IO(Cli_IsoExchangeBuffer(Client, &data, &length));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2502,7 +2891,7 @@ static void handle_iso_exchange_buffer(const char *req, int *req_index)
 static void handle_get_exec_time(const char *req, int *req_index)
 {
     int Time;
-    int result = Cli_GetExecTime(Client, &Time);
+    int result = PLC_IO(Cli_GetExecTime(Client, &Time));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2518,7 +2907,7 @@ static void handle_get_exec_time(const char *req, int *req_index)
 static void handle_get_last_error(const char *req, int *req_index)
 {
     int error;
-    int result = Cli_GetLastError(Client, &error);
+    int result = PLC_IO(Cli_GetLastError(Client, &error));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2534,7 +2923,7 @@ static void handle_get_last_error(const char *req, int *req_index)
 static void handle_get_pdu_length(const char *req, int *req_index)
 {
     int req_neg[2];
-    int result = Cli_GetPduLength(Client, &req_neg[0], &req_neg[1]);
+    int result = PLC_IO(Cli_GetPduLength(Client, &req_neg[0], &req_neg[1]));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2550,7 +2939,7 @@ static void handle_get_pdu_length(const char *req, int *req_index)
 static void handle_get_connected(const char *req, int *req_index)
 {
     int status;
-    int result = Cli_GetConnected(Client, &status);
+    int result = PLC_IO(Cli_GetConnected(Client, &status));
     if (result != 0){
         //the paramater was invalid.
         send_snap7_errors(result);
@@ -2568,6 +2957,89 @@ static void handle_test(const char *req, int *req_index)
     send_ok_response();    
 }
 
+/**
+ *  Enables/disables the reply timing, replies are tagged with 't' and carry the
+ *  time spent handling the request, <<?t, exec_ns::64, term::binary>>.
+ *  :param enable: true or false
+*/
+static void handle_set_reply_timing(const char *req, int *req_index)
+{
+    char enable[MAXATOMLEN];
+    if (ei_decode_atom(req, req_index, enable) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    reply_timing = strcmp(enable, "true") == 0;
+    send_ok_response();
+}
+
+/**
+ *  Sets the connection health config (see struct health_config), applied on every
+ *  connect and right away when connected. 0 turns an item off.
+ *  :param health: {keepalive_idle_ms, keepalive_interval_ms, keepalive_count,
+ *                  user_timeout_ms, probe_interval_ms, probe_timeout_ms}
+*/
+static void handle_set_health(const char *req, int *req_index)
+{
+    int term_size;
+    struct health_config config;
+    if (ei_decode_tuple_header(req, req_index, &term_size) < 0 || term_size != 6 ||
+            ei_decode_ulong(req, req_index, &config.keepalive_idle_ms) < 0 ||
+            ei_decode_ulong(req, req_index, &config.keepalive_interval_ms) < 0 ||
+            ei_decode_ulong(req, req_index, &config.keepalive_count) < 0 ||
+            ei_decode_ulong(req, req_index, &config.user_timeout_ms) < 0 ||
+            ei_decode_ulong(req, req_index, &config.probe_interval_ms) < 0 ||
+            ei_decode_ulong(req, req_index, &config.probe_timeout_ms) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    health = config;
+    int connected = 0;
+    if (Cli_GetConnected(Client, &connected) == 0 && connected)
+        setup_plc_socket();
+    send_ok_response();
+}
+
+// Defined after the handler table, which it walks
+static void handle_get_stats(const char *req, int *req_index);
+
+/**
+ * @brief Creates the shared memory ring, {slots, slot_size}, replies {:ok, name}
+ *  to be mapped by Snapex7.Shm. See s7_shm.h
+ */
+static void handle_shm_open(const char *req, int *req_index)
+{
+    static int regions = 0;
+    int term_size;
+    unsigned long slots;
+    unsigned long slot_size;
+    if (ei_decode_tuple_header(req, req_index, &term_size) < 0 || term_size != 2 ||
+            ei_decode_ulong(req, req_index, &slots) < 0 ||
+            ei_decode_ulong(req, req_index, &slot_size) < 0 ||
+            slots == 0 || slots > 1024 || slot_size < S7_SHM_MIN_SIZE || slot_size > 0xFFFF) {
+        send_error_response("einval");
+        return;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/snapex7.%d.%d", (int) getpid(), regions++);
+    if (s7_shm_create(name, (uint32_t) slots, (uint32_t) slot_size) < 0) {
+        send_error_response("eshm");
+        return;
+    }
+
+    send_data_response(name, 5, strlen(name));
+}
+
+static void handle_shm_close(const char *req, int *req_index)
+{
+    s7_shm_destroy();
+    send_ok_response();
+}
+static void handle_batch(const char *req, int *req_index);
+
 /* Elixir request handler table
  * Ordered roughly based on most frequent calls to least.
  */
@@ -2633,9 +3105,425 @@ static struct request_handler request_handlers[] = {
     {"get_last_error", handle_get_last_error},
     {"get_pdu_length", handle_get_pdu_length},
     {"get_connected", handle_get_connected},
+    {"get_stats", handle_get_stats},
+    {"set_reply_timing", handle_set_reply_timing},
+    {"set_health", handle_set_health},
+    {"batch", handle_batch},
+    {"shm_open", handle_shm_open},
+    {"shm_close", handle_shm_close},
     { NULL, NULL }
 };
 
+static struct command_stats command_stats[sizeof(request_handlers) / sizeof(request_handlers[0])];
+
+static void encode_error_counts(char *resp, int *resp_index, const uint64_t *counts,
+                                const char names[][37], int n_names)
+{
+    int n_errors = 0;
+    for (int i = 0; i < n_names; i++)
+        if (counts[i] != 0)
+            n_errors++;
+
+    ei_encode_map_header(resp, resp_index, n_errors);
+    for (int i = 0; i < n_names; i++) {
+        if (counts[i] != 0) {
+            ei_encode_atom(resp, resp_index, names[i]);
+            ei_encode_ulonglong(resp, resp_index, counts[i]);
+        }
+    }
+}
+
+/**
+ *  Returns the port stats since it started (or the last reset):
+ *  %{commands: %{cmd => %{calls, errors, decode, plc_io, encode}}, bytes_in, bytes_out,
+ *    errors: %{es7: %{name => count}, eiso: %{name => count}, etcp: count, other: count}}
+ *  where every phase is a latency histogram summary in nanoseconds (see s7_histogram_encode).
+ *  Only commands called at least once are listed.
+ *  :param reset: clears the stats after reading them.
+*/
+static void handle_get_stats(const char *req, int *req_index)
+{
+    static char resp[MAX_RESPONSE_SIZE];
+    int resp_index = sizeof(uint16_t); // Space for payload size
+    char reset[MAXATOMLEN];
+    if (ei_decode_atom(req, req_index, reset) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    // this very call is accounted once the reply is sent
+    int n_commands = 0;
+    for (int i = 0; request_handlers[i].name != NULL; i++)
+        if (command_stats[i].phases[PHASE_DECODE].count != 0)
+            n_commands++;
+
+    encode_response_header(resp, &resp_index);
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, "ok");
+    ei_encode_map_header(resp, &resp_index, 4);
+
+    ei_encode_atom(resp, &resp_index, "commands");
+    ei_encode_map_header(resp, &resp_index, n_commands);
+    for (int i = 0; request_handlers[i].name != NULL; i++) {
+        struct command_stats *stats = &command_stats[i];
+        if (stats->phases[PHASE_DECODE].count == 0)
+            continue;
+
+        ei_encode_atom(resp, &resp_index, request_handlers[i].name);
+        ei_encode_map_header(resp, &resp_index, 2 + N_PHASES);
+        ei_encode_atom(resp, &resp_index, "calls");
+        ei_encode_ulonglong(resp, &resp_index, stats->phases[PHASE_DECODE].count);
+        ei_encode_atom(resp, &resp_index, "errors");
+        ei_encode_ulonglong(resp, &resp_index, stats->errors);
+        for (int phase = 0; phase < N_PHASES; phase++) {
+            ei_encode_atom(resp, &resp_index, phase_names[phase]);
+            s7_histogram_encode(resp, &resp_index, &stats->phases[phase]);
+        }
+    }
+
+    ei_encode_atom(resp, &resp_index, "bytes_in");
+    ei_encode_ulonglong(resp, &resp_index, bytes_in);
+    ei_encode_atom(resp, &resp_index, "bytes_out");
+    ei_encode_ulonglong(resp, &resp_index, bytes_out);
+
+    ei_encode_atom(resp, &resp_index, "errors");
+    ei_encode_map_header(resp, &resp_index, 4);
+    ei_encode_atom(resp, &resp_index, "es7");
+    encode_error_counts(resp, &resp_index, errors_s7, err_s7, 0x26);
+    ei_encode_atom(resp, &resp_index, "eiso");
+    encode_error_counts(resp, &resp_index, errors_iso, err_iso, 0x0F);
+    ei_encode_atom(resp, &resp_index, "etcp");
+    ei_encode_ulonglong(resp, &resp_index, errors_tcp);
+    ei_encode_atom(resp, &resp_index, "other");
+    ei_encode_ulonglong(resp, &resp_index, errors_other);
+
+    if (strcmp(reset, "true") == 0) {
+        memset(command_stats, 0, sizeof(command_stats));
+        memset(errors_s7, 0, sizeof(errors_s7));
+        memset(errors_iso, 0, sizeof(errors_iso));
+        bytes_in = bytes_out = errors_tcp = errors_other = 0;
+    }
+
+    send_response(resp, resp_index);
+}
+
+/**
+ * @brief Splits the handler time in phases, commands failing before reaching
+ *  snap7 (e.g. einval) account all of it as decoding.
+ */
+static void record_phases(struct command_stats *stats, uint64_t start_ns, uint64_t end_ns)
+{
+    if (plc_io_begin_ns < start_ns) {
+        s7_histogram_record(&stats->phases[PHASE_DECODE], end_ns - start_ns);
+        return;
+    }
+
+    s7_histogram_record(&stats->phases[PHASE_DECODE], plc_io_begin_ns - start_ns);
+    s7_histogram_record(&stats->phases[PHASE_PLC_IO], plc_io_end_ns - plc_io_begin_ns);
+    s7_histogram_record(&stats->phases[PHASE_ENCODE], end_ns - plc_io_end_ns);
+}
+
+static struct request_handler *find_request_handler(const char *cmd)
+{
+    for (struct request_handler *rh = request_handlers; rh->name != NULL; rh++) {
+        if (strcmp(cmd, rh->name) == 0)
+            return rh;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs a list of {cmd, args} back to back and replies {:ok, [result]}, when
+ *  stop_on_error is true the list ends with the first {:error, _} result.
+ *  Every command is accounted in its own stats, the batch accounts all of them as
+ *  its PLC I/O phase.
+ */
+static void handle_batch(const char *req, int *req_index)
+{
+    int term_size;
+    int count;
+    char stop_on_error[MAXATOMLEN];
+    if (batch_active ||
+            ei_decode_tuple_header(req, req_index, &term_size) < 0 || term_size != 2 ||
+            ei_decode_atom(req, req_index, stop_on_error) < 0 ||
+            ei_decode_list_header(req, req_index, &count) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    struct command_stats *stats = current_stats;
+    bool job = job_active;
+    bool timing = reply_timing;
+    bool stop = strcmp(stop_on_error, "true") == 0;
+    job_active = false;
+    reply_timing = false;
+    batch_active = true;
+    batch_overflow = false;
+    batch_count = 0;
+    batch_len = 0;
+
+    uint64_t begin_ns = s7_stats_now_ns();
+    for (int i = 0; i < count && !batch_overflow; i++) {
+        int next = *req_index;
+        if (ei_skip_term(req, &next) < 0)
+            errx(EXIT_FAILURE, "batch: can't skip the command %d", i);
+
+        int arity;
+        char cmd[MAXATOMLEN];
+        struct request_handler *rh = NULL;
+        if (ei_decode_tuple_header(req, req_index, &arity) == 0 && arity == 2 &&
+                ei_decode_atom(req, req_index, cmd) == 0)
+            rh = find_request_handler(cmd);
+
+        uint64_t start_ns = s7_stats_now_ns();
+        if (rh == NULL) {
+            current_stats = stats;
+            send_error_response("einval");
+        } else {
+            current_stats = &command_stats[rh - request_handlers];
+            plc_io_begin_ns = 0;
+            rh->handler(req, req_index);
+            record_phases(current_stats, start_ns, s7_stats_now_ns());
+        }
+
+        // handlers failing early leave their arguments undecoded
+        *req_index = next;
+        if (stop && batch_error)
+            break;
+    }
+
+    plc_io_begin_ns = begin_ns;
+    plc_io_end_ns = s7_stats_now_ns();
+    current_stats = stats;
+    batch_active = false;
+    job_active = job;
+    reply_timing = timing;
+
+    if (batch_overflow) {
+        send_error_response("too_large");
+        return;
+    }
+
+    static char resp[MAX_RESPONSE_SIZE];
+    int resp_index = sizeof(uint16_t); // Space for payload size
+    encode_response_header(resp, &resp_index);
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, "ok");
+    if (batch_count > 0) {
+        ei_encode_list_header(resp, &resp_index, batch_count);
+        memcpy(&resp[resp_index], batch_replies, batch_len);
+        resp_index += batch_len;
+    }
+    ei_encode_empty_list(resp, &resp_index);
+    send_response(resp, resp_index);
+}
+
+static uint64_t realtime_ms()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_REALTIME, &tp);
+    return ((uint64_t) tp.tv_sec) * 1000ULL + tp.tv_nsec / 1000000;
+}
+
+static void load_snap7_timeouts()
+{
+    if (snap7_timeouts_loaded)
+        return;
+
+    for (int i = 0; i < 3; i++)
+        Cli_GetParam(Client, p_i32_PingTimeout + i, &snap7_timeouts[i]);
+    snap7_timeouts_loaded = true;
+}
+
+/**
+ * @brief Caps the snap7 timeouts with the time left before the job deadline
+ * @return true when they were changed and must be restored
+ */
+static bool apply_deadline(uint64_t remaining_ms)
+{
+    bool changed = false;
+    load_snap7_timeouts();
+    for (int i = 0; i < 3; i++) {
+        if ((uint64_t) snap7_timeouts[i] > remaining_ms) {
+            int32_t timeout = (int32_t) remaining_ms;
+            Cli_SetParam(Client, p_i32_PingTimeout + i, &timeout);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void restore_snap7_timeouts()
+{
+    for (int i = 0; i < 3; i++)
+        Cli_SetParam(Client, p_i32_PingTimeout + i, &snap7_timeouts[i]);
+}
+
+/*
+ * Fixed-layout binary protocol of the hot read/write commands, told apart from ETF
+ * requests by their first byte. All fields are big-endian:
+ *   opcode:8 (RAW_READ/RAW_WRITE), id:32, deadline_ms:64, priority:8,
+ *   area:8, db_number:16, start:32, amount:32, word_len:8, data (writes only)
+ * They are accounted as read_area/write_area and answered with a raw reply (no data for
+ * writes), or the regular {:error, _} job reply.
+ */
+enum raw_opcode { RAW_READ = 1, RAW_WRITE = 2 };
+#define RAW_JOB_SIZE 14
+#define RAW_ARGS_SIZE 12
+#define RAW_REPLY_HEADER_SIZE 14
+
+static uint64_t decode_be(const char *buf, int size)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++)
+        value = (value << 8) | (uint8_t) buf[i];
+    return value;
+}
+
+static void handle_raw_request(const char *req, int *req_index)
+{
+    static char resp[MAX_RESPONSE_SIZE];
+    int header = sizeof(uint16_t) + RAW_REPLY_HEADER_SIZE;
+    int len = (((uint8_t) req[0]) << 8 | (uint8_t) req[1]) + sizeof(uint16_t);
+    char opcode = req[sizeof(uint16_t)];
+    if (*req_index + RAW_ARGS_SIZE > len) {
+        send_error_response("einval");
+        return;
+    }
+
+    const char *args = &req[*req_index];
+    int area = (uint8_t) args[0];
+    int db_number = (int) decode_be(&args[1], 2);
+    uint64_t start = decode_be(&args[3], 4);
+    uint64_t amount = decode_be(&args[7], 4);
+    int word_len = (uint8_t) args[11];
+    *req_index += RAW_ARGS_SIZE;
+
+    uint64_t size = amount * word_size(word_len);
+    if (size == 0 || size > MAX_RESPONSE_SIZE - header || start > INT32_MAX ||
+            (opcode == RAW_WRITE && (uint64_t) (len - *req_index) != size)) {
+        send_error_response("einval");
+        return;
+    }
+
+    int result;
+    if (opcode == RAW_READ) {
+        result = PLC_IO(Cli_ReadArea(Client, area, db_number, (int) start, (int) amount, word_len,
+                                     &resp[header]));
+    } else {
+        result = PLC_IO(Cli_WriteArea(Client, area, db_number, (int) start, (int) amount, word_len,
+                                      (void *) &req[*req_index]));
+        size = 0;
+    }
+    if (result != 0) {
+        send_snap7_errors(result);
+        return;
+    }
+
+    resp[sizeof(uint16_t)] = raw_response_id;
+    resp[header - 1] = opcode;
+    send_response(resp, header + (int) size);
+}
+
+/*
+ * Jobs wait in one FIFO per priority class, {{id, deadline_ms, priority}, cmd, args}
+ * with 0 realtime, 1 normal (the default) and 2 bulk, and the port loop runs the realtime
+ * ones first. Bulk area/DB transfers spanning several PDUs are split in PDU sized chunks,
+ * resumed once no realtime or normal job is waiting, so an alarm acknowledgement gets
+ * between two chunks instead of waiting for the whole transfer.
+ */
+enum job_priority { PRIORITY_REALTIME, PRIORITY_NORMAL, PRIORITY_BULK, N_PRIORITIES };
+
+#define BULK_MAX_SIZE MAX_DATA_SIZE
+// S7 headers of a read/write PDU, as accounted by snap7 to split Cli_ReadArea/Cli_WriteArea
+#define PDU_READ_OVERHEAD 18
+#define PDU_WRITE_OVERHEAD 35
+
+struct bulk_transfer
+{
+    bool active;
+    bool write;
+    int area;
+    int db_number;
+    int start;
+    int amount;
+    int done;
+    int chunk;
+    uint32_t id;
+    uint64_t deadline_ms;
+    uint64_t start_ns;
+    uint64_t plc_io_ns;
+    struct command_stats *stats;
+    unsigned char data[BULK_MAX_SIZE];
+};
+
+static struct bulk_transfer bulk;
+
+/**
+ * @brief Takes over a bulk read_area/write_area (of bytes) or db_read/db_write job when
+ *  it needs more than one PDU, it is then answered by run_bulk_chunk()
+ * @param req_index index of the arguments, left untouched for the regular handler
+ * @return false when the job must go through the regular handler
+ */
+static bool start_bulk_transfer(const char *cmd, const char *req, int req_index,
+                                unsigned long long deadline_ms)
+{
+    bool write = strcmp(cmd, "write_area") == 0 || strcmp(cmd, "db_write") == 0;
+    bool area = strcmp(cmd, "read_area") == 0 || strcmp(cmd, "write_area") == 0;
+    if (bulk.active || (!write && !area && strcmp(cmd, "db_read") != 0))
+        return false;
+
+    int term_size;
+    unsigned long args[5] = { S7AreaDB, 0, 0, 0, S7WLByte };
+    int first = area ? 0 : 1;
+    int count = area ? 5 : 4;
+    if (ei_decode_tuple_header(req, &req_index, &term_size) < 0 ||
+            term_size != count - first + (write ? 1 : 0))
+        return false;
+
+    for (int i = first; i < count; i++) {
+        if (ei_decode_ulong(req, &req_index, &args[i]) < 0)
+            return false;
+    }
+
+    int requested;
+    int negotiated;
+    if (args[4] != S7WLByte || args[3] > BULK_MAX_SIZE ||
+            Cli_GetPduLength(Client, &requested, &negotiated) != 0)
+        return false;
+
+    int chunk = negotiated - (write ? PDU_WRITE_OVERHEAD : PDU_READ_OVERHEAD);
+    if (chunk <= 0 || args[3] <= (unsigned long) chunk)
+        return false;
+
+    if (write) {
+        int type;
+        int size;
+        long bin_size;
+        if (ei_get_type(req, &req_index, &type, &size) < 0 ||
+                type != ERL_BINARY_EXT || (unsigned long) size != args[3] ||
+                ei_decode_binary(req, &req_index, bulk.data, &bin_size) < 0)
+            return false;
+    }
+
+    bulk.active = true;
+    bulk.write = write;
+    bulk.area = (int) args[0];
+    bulk.db_number = (int) args[1];
+    bulk.start = (int) args[2];
+    bulk.amount = (int) args[3];
+    bulk.done = 0;
+    bulk.chunk = chunk;
+    bulk.id = job_id;
+    bulk.deadline_ms = deadline_ms;
+    bulk.start_ns = request_start_ns;
+    bulk.plc_io_ns = 0;
+    bulk.stats = current_stats;
+    return true;
+}
+
 /**
  * @brief Decode and forward requests from Elixir to the appropriate handlers
  * @param req the undecoded request
@@ -2645,30 +3533,304 @@ static void handle_elixir_request(const char *req, void *cookie)
 {
     (void) cookie;
 
-    // Commands are of the form {Command, Arguments}:
-    // { atom(), term() }
+    uint64_t start_ns = s7_stats_now_ns();
+    request_start_ns = start_ns;
+    __atomic_fetch_add(&bytes_in, (((uint8_t) req[0]) << 8 | (uint8_t) req[1]) + sizeof(uint16_t),
+                       __ATOMIC_RELAXED);
+
+    unsigned long long deadline_ms = 0;
+    unsigned long priority = PRIORITY_NORMAL;
+    char cmd[MAXATOMLEN];
+    struct request_handler *rh;
+    void (*handler)(const char *req, int *req_index);
     int req_index = sizeof(uint16_t);
-    if (ei_decode_version(req, &req_index, NULL) < 0)
-        errx(EXIT_FAILURE, "Message version issue?");
+    job_active = false;
+
+    if ((uint8_t) req[req_index] != ERL_VERSION_MAGIC) {
+        // binary protocol, see handle_raw_request()
+        char opcode = req[req_index];
+        if (opcode != RAW_READ && opcode != RAW_WRITE)
+            errx(EXIT_FAILURE, "unknown binary opcode: %d", opcode);
+        if ((((uint8_t) req[0]) << 8 | (uint8_t) req[1]) < RAW_JOB_SIZE)
+            errx(EXIT_FAILURE, "binary request too short");
+
+        job_id = (uint32_t) decode_be(&req[req_index + 1], sizeof(uint32_t));
+        deadline_ms = decode_be(&req[req_index + 5], sizeof(uint64_t));
+        priority = (uint8_t) req[req_index + 13];
+        job_active = true;
+        req_index += RAW_JOB_SIZE;
+
+        strcpy(cmd, opcode == RAW_READ ? "read_area" : "write_area");
+        rh = find_request_handler(cmd);
+        handler = handle_raw_request;
+    } else {
+        // Commands are of the form {Command, Arguments} or {Job, Command, Arguments}:
+        // { atom(), term() } | { {integer(), integer()} | {integer(), integer(), integer()}, atom(), term() }
+        if (ei_decode_version(req, &req_index, NULL) < 0)
+            errx(EXIT_FAILURE, "Message version issue?");
+
+        int arity;
+        if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+                (arity != 2 && arity != 3))
+            errx(EXIT_FAILURE, "expecting {cmd, args} or {job, cmd, args} tuple");
+
+        if (arity == 3) {
+            int job_arity;
+            unsigned long id;
+            if (ei_decode_tuple_header(req, &req_index, &job_arity) < 0 ||
+                    (job_arity != 2 && job_arity != 3) ||
+                    ei_decode_ulong(req, &req_index, &id) < 0 ||
+                    ei_decode_ulonglong(req, &req_index, &deadline_ms) < 0 ||
+                    (job_arity == 3 && ei_decode_ulong(req, &req_index, &priority) < 0))
+                errx(EXIT_FAILURE, "expecting {id, deadline_ms} or {id, deadline_ms, priority} job");
+            job_id = (uint32_t) id;
+            job_active = true;
+        }
+
+        // no listed function, answered without dropping the PLC session
+        if (ei_decode_atom(req, &req_index, cmd) < 0 ||
+                (rh = find_request_handler(cmd)) == NULL) {
+            current_stats = NULL;
+            send_error_response("einval");
+            job_active = false;
+            return;
+        }
+        handler = rh->handler;
+    }
+
+    current_stats = &command_stats[rh - request_handlers];
+    reply_flags = priority == PRIORITY_REALTIME ? ERLCMD_FLUSH : 0;
+    plc_io_begin_ns = 0;
+
+    uint64_t now_ms = deadline_ms != 0 ? realtime_ms() : 0;
+    if (deadline_ms != 0 && now_ms >= deadline_ms) {
+        // overdue, most likely queued behind a slow job
+        send_error_response("timeout");
+    } else if (priority == PRIORITY_BULK && handler != handle_raw_request &&
+            start_bulk_transfer(cmd, req, req_index, deadline_ms)) {
+        // answered with its last chunk, see run_bulk_chunk()
+        s7_histogram_record(&current_stats->phases[PHASE_DECODE], s7_stats_now_ns() - start_ns);
+        current_stats = NULL;
+        job_active = false;
+        return;
+    } else {
+        bool restore = deadline_ms != 0 && apply_deadline(deadline_ms - now_ms);
+        handler(req, &req_index);
+        if (restore)
+            restore_snap7_timeouts();
+    }
+
+    record_phases(current_stats, start_ns, s7_stats_now_ns());
+    current_stats = NULL;
+    job_active = false;
+}
+
+// erlcmd_bench.c includes this file to drive the handlers without the port loop
+#ifndef S7_CLIENT_NO_MAIN
+struct queued_job
+{
+    struct queued_job *next;
+    char req[];
+};
 
+static struct queued_job *job_queue_head[N_PRIORITIES];
+static struct queued_job *job_queue_tail[N_PRIORITIES];
+// a request ran straight from the erlcmd buffer since the last poll
+static bool ran_in_place;
+
+/**
+ * @brief Peeks the priority of a request, plain {cmd, args} ones are normal
+ */
+static int request_priority(const char *req)
+{
+    int len = ((uint8_t) req[0]) << 8 | (uint8_t) req[1];
+    int req_index = sizeof(uint16_t);
     int arity;
-    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
-            arity != 2)
-        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+    int job_arity;
+    unsigned long id;
+    unsigned long long deadline_ms;
+    unsigned long priority;
+    if ((uint8_t) req[req_index] != ERL_VERSION_MAGIC) {
+        // too short, rejected by handle_elixir_request()
+        if (len < RAW_JOB_SIZE)
+            return PRIORITY_NORMAL;
+        priority = (uint8_t) req[req_index + RAW_JOB_SIZE - 1];
+    }
+    else if (ei_decode_version(req, &req_index, NULL) < 0 ||
+            ei_decode_tuple_header(req, &req_index, &arity) < 0 || arity != 3 ||
+            ei_decode_tuple_header(req, &req_index, &job_arity) < 0 || job_arity != 3 ||
+            ei_decode_ulong(req, &req_index, &id) < 0 ||
+            ei_decode_ulonglong(req, &req_index, &deadline_ms) < 0 ||
+            ei_decode_ulong(req, &req_index, &priority) < 0)
+        return PRIORITY_NORMAL;
+
+    return priority < N_PRIORITIES ? (int) priority : PRIORITY_BULK;
+}
 
-    char cmd[MAXATOMLEN];
-    if (ei_decode_atom(req, &req_index, cmd) < 0)
-        errx(EXIT_FAILURE, "expecting command atom");
-    
-    //execute all handler
-    for (struct request_handler *rh = request_handlers; rh->name != NULL; rh++) {
-        if (strcmp(cmd, rh->name) == 0) {
-            rh->handler(req, &req_index);
-            return;
+static bool jobs_queued()
+{
+    for (int priority = PRIORITY_REALTIME; priority < N_PRIORITIES; priority++) {
+        if (job_queue_head[priority] != NULL)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief erlcmd handler, runs the request in place when nothing is waiting (neither in
+ *  the queues nor behind it in the erlcmd ring), otherwise copies it out of the erlcmd
+ *  buffer to its priority queue
+ */
+static void queue_elixir_request(const char *req, void *cookie)
+{
+    struct erlcmd *handler = cookie;
+
+    if (!bulk.active && !jobs_queued() && erlcmd_last_message(handler)) {
+        handle_elixir_request(req, NULL);
+        ran_in_place = true;
+        return;
+    }
+
+    size_t len = (((uint8_t) req[0]) << 8 | (uint8_t) req[1]) + sizeof(uint16_t);
+    struct queued_job *job = malloc(sizeof(struct queued_job) + len);
+    if (job == NULL)
+        err(EXIT_FAILURE, "malloc");
+    memcpy(job->req, req, len);
+    job->next = NULL;
+
+    int priority = request_priority(req);
+    if (job_queue_tail[priority] != NULL)
+        job_queue_tail[priority]->next = job;
+    else
+        job_queue_head[priority] = job;
+    job_queue_tail[priority] = job;
+}
+
+static void finish_bulk_transfer()
+{
+    s7_histogram_record(&bulk.stats->phases[PHASE_PLC_IO], bulk.plc_io_ns);
+    bulk.active = false;
+}
+
+/**
+ * @brief Transfers the next chunk of the bulk transfer, replying after the last one
+ */
+static void run_bulk_chunk()
+{
+    request_start_ns = bulk.start_ns;
+    current_stats = bulk.stats;
+    reply_flags = 0;
+    job_id = bulk.id;
+    job_active = true;
+
+    uint64_t now_ms = bulk.deadline_ms != 0 ? realtime_ms() : 0;
+    if (bulk.deadline_ms != 0 && now_ms >= bulk.deadline_ms) {
+        send_error_response("timeout");
+        finish_bulk_transfer();
+    } else {
+        bool restore = bulk.deadline_ms != 0 && apply_deadline(bulk.deadline_ms - now_ms);
+        int size = bulk.amount - bulk.done < bulk.chunk ? bulk.amount - bulk.done : bulk.chunk;
+        int result;
+        if (bulk.write)
+            result = PLC_IO(Cli_WriteArea(Client, bulk.area, bulk.db_number, bulk.start + bulk.done,
+                                          size, S7WLByte, &bulk.data[bulk.done]));
+        else
+            result = PLC_IO(Cli_ReadArea(Client, bulk.area, bulk.db_number, bulk.start + bulk.done,
+                                         size, S7WLByte, &bulk.data[bulk.done]));
+        if (restore)
+            restore_snap7_timeouts();
+
+        bulk.plc_io_ns += plc_io_end_ns - plc_io_begin_ns;
+        bulk.done += size;
+        if (result != 0) {
+            send_snap7_errors(result);
+            finish_bulk_transfer();
+        } else if (bulk.done == bulk.amount) {
+            if (bulk.write)
+                send_ok_response();
+            else
+                send_data_response(bulk.data, 5, bulk.amount);
+            finish_bulk_transfer();
         }
     }
-    // no listed function
-    errx(EXIT_FAILURE, "unknown command: %s", cmd);
+
+    current_stats = NULL;
+    job_active = false;
+}
+
+/**
+ * @brief Runs the first queued realtime or normal job, otherwise goes on with bulk work
+ * @return false when there was nothing to run
+ */
+static bool run_next_job()
+{
+    for (int priority = PRIORITY_REALTIME; priority < N_PRIORITIES; priority++) {
+        if (priority == PRIORITY_BULK && bulk.active) {
+            run_bulk_chunk();
+            return true;
+        }
+
+        struct queued_job *job = job_queue_head[priority];
+        if (job != NULL) {
+            job_queue_head[priority] = job->next;
+            if (job->next == NULL)
+                job_queue_tail[priority] = NULL;
+            handle_elixir_request(job->req, NULL);
+            free(job);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Drops the connection to a dead PLC and tells Elixir right away
+ */
+static void peer_lost(const char *reason)
+{
+    plc_socket = -1;
+    Cli_Disconnect(Client);
+    send_notification("disconnected", reason);
+}
+
+/**
+ * @brief The PLC never talks first, so an idle socket turning readable is either
+ *  its FIN/RST or an error set by the keepalive/user timeout
+ * @return false when the socket can't tell (unexpected data), stop watching it
+ */
+static bool check_plc_socket(short revents)
+{
+    char byte;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(plc_socket, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error == 0 && (revents & POLLIN)) {
+        ssize_t n = recv(plc_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n > 0)
+            return false;
+        error = n == 0 ? 0 : errno;
+        if (error == EAGAIN || error == EWOULDBLOCK)
+            return true;
+    }
+
+    peer_lost(error == 0 ? "closed" : error == ETIMEDOUT ? "timeout" :
+              error == ECONNRESET ? "reset" : "error");
+    return true;
+}
+
+/**
+ * @brief Cheap round trip to an idle PLC, only a connection level failure (ISO or TCP
+ *  error) counts as a dead peer
+ */
+static void probe_plc()
+{
+    int status;
+    bool restore = health.probe_timeout_ms != 0 && apply_deadline(health.probe_timeout_ms);
+    int result = Cli_GetPlcStatus(Client, &status);
+    if (restore)
+        restore_snap7_timeouts();
+    if ((result & 0x000FFFFF) != 0)
+        peer_lost("probe");
 }
 
 int main()
@@ -2676,17 +3838,40 @@ int main()
     Client = Cli_Create();
 
     struct erlcmd *handler = malloc(sizeof(struct erlcmd));
-    erlcmd_init(handler, handle_elixir_request, NULL);
+    erlcmd_init(handler, queue_elixir_request, handler);
 
+    bool pending = false;
+    bool watch = true;
+    uint64_t last_io_ms = 0;
     for (;;) {
-        struct pollfd fdset;
-
-        fdset.fd = STDIN_FILENO;
-        fdset.events = POLLIN;
-        fdset.revents = 0;
+        struct pollfd fdset[2];
+        nfds_t nfds = 1;
+
+        fdset[0].fd = STDIN_FILENO;
+        fdset[0].events = POLLIN;
+        fdset[0].revents = 0;
+
+        // Wait forever unless there are jobs left, new requests are picked up between jobs
+        int timeout = pending ? 0 : -1;
+        bool probe = false;
+
+        // Idle, watch the PLC socket and probe it when due
+        if (!pending && plc_socket >= 0) {
+            if (watch) {
+                fdset[1].fd = plc_socket;
+                fdset[1].events = POLLIN;
+                fdset[1].revents = 0;
+                nfds = 2;
+            }
+            if (health.probe_interval_ms != 0) {
+                uint64_t now_ms = s7_stats_now_ns() / 1000000;
+                uint64_t due_ms = last_io_ms + health.probe_interval_ms;
+                timeout = due_ms > now_ms ? (int) (due_ms - now_ms) : 0;
+                probe = true;
+            }
+        }
 
-        int timeout = -1; // Wait forever unless told by otherwise
-        int rc = poll(&fdset, 1, timeout);
+        int rc = poll(fdset, nfds, timeout);
 
         if (rc < 0) {
             // Retry if EINTR
@@ -2696,11 +3881,28 @@ int main()
             err(EXIT_FAILURE, "poll");
         }
 
-        if (fdset.revents & (POLLIN | POLLHUP)) {
+        if (fdset[0].revents & (POLLIN | POLLHUP)) {
             if (erlcmd_process(handler))
                 break;
         }
+
+        if (nfds == 2 && fdset[1].revents != 0)
+            watch = check_plc_socket(fdset[1].revents);
+
+        pending = run_next_job();
+        if (pending || ran_in_place) {
+            ran_in_place = false;
+            watch = true;
+            last_io_ms = s7_stats_now_ns() / 1000000;
+        } else if (rc == 0 && probe && plc_socket >= 0) {
+            probe_plc();
+            last_io_ms = s7_stats_now_ns() / 1000000;
+        }
+        if (!pending)
+            erlcmd_flush();
     }
     // Kill client
-    Cli_Destroy(&Client);    
-}
\ No newline at end of file
+    Cli_Destroy(&Client);
+    s7_shm_destroy();    
+}
+#endif
@@ -0,0 +1,544 @@
+/*
+ *  In-VM snap7 client (Snapex7.Nif), used by Snapex7.Client with `backend: :nif`.
+ *
+ *  libsnap is linked into the VM and every request runs on a dirty I/O scheduler,
+ *  so a blocking Cli_* call never holds a normal scheduler. Requests keep the
+ *  {command, arguments} shape of the client port (see s7_client.c) and answer the
+ *  same terms, reads go straight from snap7 into the reply binary.
+ *
+ *  Only the administrative, data I/O, security and miscellaneous commands listed in
+ *  nif_commands are served, the rest answer {:error, :enotsup}.
+ */
+
+#include "erl_nif.h"
+#include "snap7.h"
+#include "s7_errors.h"
+
+#include <string.h>
+
+struct nif_client
+{
+    S7Object client;
+    ErlNifMutex *lock; // snap7 clients run one job at a time
+};
+
+struct nif_command;
+typedef ERL_NIF_TERM (*nif_handler)(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                    const struct nif_command *cmd);
+
+struct nif_command
+{
+    const char *name;
+    nif_handler handler;
+    int area;     // fixed area of the AB/EB/MB/TM/CT commands
+    int word_len; // and its word length
+};
+
+static ErlNifResourceType *nif_client_type;
+static ERL_NIF_TERM atom_ok;
+static ERL_NIF_TERM atom_error;
+static ERL_NIF_TERM atom_nil;
+
+static void nif_client_dtor(ErlNifEnv *env, void *obj)
+{
+    (void) env;
+    struct nif_client *c = (struct nif_client *) obj;
+    if (c->client != 0)
+        Cli_Destroy(&c->client);
+    if (c->lock != NULL)
+        enif_mutex_destroy(c->lock);
+}
+
+static int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+{
+    (void) priv_data;
+    (void) load_info;
+    nif_client_type = enif_open_resource_type(env, NULL, "s7_client", nif_client_dtor,
+                                              ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+    atom_ok = enif_make_atom(env, "ok");
+    atom_error = enif_make_atom(env, "error");
+    atom_nil = enif_make_atom(env, "nil");
+    return nif_client_type == NULL ? -1 : 0;
+}
+
+static ERL_NIF_TERM make_error(ErlNifEnv *env, const char *reason)
+{
+    return enif_make_tuple2(env, atom_error, enif_make_atom(env, reason));
+}
+
+static ERL_NIF_TERM make_ok(ErlNifEnv *env, ERL_NIF_TERM value)
+{
+    return enif_make_tuple2(env, atom_ok, value);
+}
+
+/**
+ * @brief %{es7: atom/nil, eiso: atom/nil, etcp: int/nil} of a snap7 error code,
+ *  as send_snap7_errors in the client port
+ */
+static ERL_NIF_TERM make_snap7_errors(ErlNifEnv *env, uint32_t code)
+{
+    int index_s7 = code / 0x100000;
+    int index_iso = (code & 0x000F0000) / 0x10000;
+    int index_tcp = (code & 0xFFFF);
+
+    ERL_NIF_TERM map = enif_make_new_map(env);
+    enif_make_map_put(env, map, enif_make_atom(env, "es7"),
+                      index_s7 != 0 && index_s7 <= 0x26 ? enif_make_atom(env, err_s7[index_s7 - 1]) : atom_nil, &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "eiso"),
+                      index_iso != 0 ? enif_make_atom(env, err_iso[index_iso - 1]) : atom_nil, &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "etcp"),
+                      index_tcp != 0 ? enif_make_int(env, index_tcp) : atom_nil, &map);
+    return map;
+}
+
+static ERL_NIF_TERM make_result(ErlNifEnv *env, int result)
+{
+    if (result != 0)
+        return enif_make_tuple2(env, atom_error, make_snap7_errors(env, result));
+    return atom_ok;
+}
+
+/**
+ * @brief Decodes the first n elements of a tuple of arity `arity` as unsigned
+ *  integers, the rest is left in *elements
+ */
+static int get_uint_tuple(ErlNifEnv *env, ERL_NIF_TERM term, int arity, int n,
+                          unsigned long *values, const ERL_NIF_TERM **elements)
+{
+    int term_arity;
+    if (!enif_get_tuple(env, term, &term_arity, elements) || term_arity != arity)
+        return 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!enif_get_ulong(env, (*elements)[i], &values[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static int get_string(ErlNifEnv *env, ERL_NIF_TERM term, char *buf, size_t buf_size)
+{
+    ErlNifBinary bin;
+    if (!enif_inspect_binary(env, term, &bin) || bin.size >= buf_size)
+        return 0;
+    memcpy(buf, bin.data, bin.size);
+    buf[bin.size] = '\0';
+    return 1;
+}
+
+static int word_size(unsigned long word_len)
+{
+    switch (word_len) {
+    case S7WLBit:
+    case S7WLByte:
+        return 1;
+    case S7WLWord:
+    case S7WLCounter:
+    case S7WLTimer:
+        return 2;
+    case S7WLDWord:
+    case S7WLReal:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Reads an area straight into a new binary, snap7 splits it by PDU size
+ */
+static ERL_NIF_TERM read_into_binary(ErlNifEnv *env, S7Object client, unsigned long area,
+                                     unsigned long db_number, unsigned long start,
+                                     unsigned long amount, unsigned long word_len)
+{
+    int size = word_size(word_len);
+    if (size == 0 || amount == 0 || amount > (unsigned long) (0x100000 / size))
+        return make_error(env, "einval");
+
+    ErlNifBinary data;
+    if (!enif_alloc_binary(amount * size, &data))
+        return make_error(env, "enomem");
+
+    int result = Cli_ReadArea(client, (int) area, (int) db_number, (int) start, (int) amount,
+                              (int) word_len, data.data);
+    if (result != 0) {
+        enif_release_binary(&data);
+        return make_result(env, result);
+    }
+    return make_ok(env, enif_make_binary(env, &data));
+}
+
+static ERL_NIF_TERM write_from_binary(ErlNifEnv *env, S7Object client, unsigned long area,
+                                      unsigned long db_number, unsigned long start,
+                                      unsigned long amount, unsigned long word_len,
+                                      ERL_NIF_TERM data_term)
+{
+    ErlNifBinary data;
+    int size = word_size(word_len);
+    if (size == 0 || !enif_inspect_binary(env, data_term, &data) ||
+            data.size != (size_t) amount * size)
+        return make_error(env, "einval");
+
+    return make_result(env, Cli_WriteArea(client, (int) area, (int) db_number, (int) start,
+                                          (int) amount, (int) word_len, data.data));
+}
+
+//    Administrative functions
+
+static ERL_NIF_TERM nif_set_connection_type(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                            const struct nif_command *cmd)
+{
+    (void) cmd;
+    unsigned int connection_type;
+    if (!enif_get_uint(env, args, &connection_type))
+        return make_error(env, "einval");
+    return make_result(env, Cli_SetConnectionType(client, (word) connection_type));
+}
+
+static ERL_NIF_TERM nif_connect_to(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                   const struct nif_command *cmd)
+{
+    (void) cmd;
+    int arity;
+    const ERL_NIF_TERM *elements;
+    char ip[20];
+    unsigned int rack, slot;
+    if (!enif_get_tuple(env, args, &arity, &elements) || arity != 3)
+        return make_error(env, "einval");
+    if (!get_string(env, elements[0], ip, sizeof(ip)))
+        return make_error(env, "enoent");
+    if (!enif_get_uint(env, elements[1], &rack) || !enif_get_uint(env, elements[2], &slot))
+        return make_error(env, "einval");
+    return make_result(env, Cli_ConnectTo(client, ip, (int) rack, (int) slot));
+}
+
+static ERL_NIF_TERM nif_set_connection_params(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                              const struct nif_command *cmd)
+{
+    (void) cmd;
+    int arity;
+    const ERL_NIF_TERM *elements;
+    char ip[20];
+    unsigned int local_tsap, remote_tsap;
+    if (!enif_get_tuple(env, args, &arity, &elements) || arity != 3)
+        return make_error(env, "einval");
+    if (!get_string(env, elements[0], ip, sizeof(ip)))
+        return make_error(env, "enoent");
+    if (!enif_get_uint(env, elements[1], &local_tsap) || !enif_get_uint(env, elements[2], &remote_tsap))
+        return make_error(env, "einval");
+    return make_result(env, Cli_SetConnectionParams(client, ip, (word) local_tsap, (word) remote_tsap));
+}
+
+static ERL_NIF_TERM nif_connect(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                const struct nif_command *cmd)
+{
+    (void) args;
+    (void) cmd;
+    return make_result(env, Cli_Connect(client));
+}
+
+static ERL_NIF_TERM nif_disconnect(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                   const struct nif_command *cmd)
+{
+    (void) args;
+    (void) cmd;
+    return make_result(env, Cli_Disconnect(client));
+}
+
+static ERL_NIF_TERM nif_get_params(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                   const struct nif_command *cmd)
+{
+    (void) cmd;
+    int param, result;
+    if (!enif_get_int(env, args, &param))
+        return make_error(env, "einval");
+
+    switch (param) {
+    case 2:
+    case 7:
+    case 8:
+    case 9: {
+        uint16_t value = 0;
+        result = Cli_GetParam(client, param, &value);
+        return result != 0 ? make_result(env, result) : make_ok(env, enif_make_uint(env, value));
+    }
+    case 3:
+    case 4:
+    case 5:
+    case 10: {
+        int32_t value = 0;
+        result = Cli_GetParam(client, param, &value);
+        return result != 0 ? make_result(env, result) : make_ok(env, enif_make_int(env, value));
+    }
+    default:
+        return make_error(env, "einval");
+    }
+}
+
+static ERL_NIF_TERM nif_set_params(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                   const struct nif_command *cmd)
+{
+    (void) cmd;
+    int arity, param;
+    const ERL_NIF_TERM *elements;
+    long value;
+    if (!enif_get_tuple(env, args, &arity, &elements) || arity != 2 ||
+            !enif_get_int(env, elements[0], &param) || !enif_get_long(env, elements[1], &value))
+        return make_error(env, "einval");
+
+    switch (param) {
+    case 2:
+    case 7:
+    case 8:
+    case 9: {
+        uint16_t u16 = (uint16_t) value;
+        return make_result(env, Cli_SetParam(client, param, &u16));
+    }
+    case 3:
+    case 4:
+    case 5:
+    case 10: {
+        int32_t i32 = (int32_t) value;
+        return make_result(env, Cli_SetParam(client, param, &i32));
+    }
+    default:
+        return make_error(env, "einval");
+    }
+}
+
+//    Data I/O functions
+
+static ERL_NIF_TERM nif_read_area(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                  const struct nif_command *cmd)
+{
+    (void) cmd;
+    unsigned long v[5]; // area, db_number, start, amount, word_len
+    const ERL_NIF_TERM *elements;
+    if (!get_uint_tuple(env, args, 5, 5, v, &elements))
+        return make_error(env, "einval");
+    return read_into_binary(env, client, v[0], v[1], v[2], v[3], v[4]);
+}
+
+static ERL_NIF_TERM nif_write_area(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                   const struct nif_command *cmd)
+{
+    (void) cmd;
+    unsigned long v[5]; // area, db_number, start, amount, word_len
+    const ERL_NIF_TERM *elements;
+    if (!get_uint_tuple(env, args, 6, 5, v, &elements))
+        return make_error(env, "einval");
+    return write_from_binary(env, client, v[0], v[1], v[2], v[3], v[4], elements[5]);
+}
+
+static ERL_NIF_TERM nif_db_read(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                const struct nif_command *cmd)
+{
+    (void) cmd;
+    unsigned long v[3]; // db_number, start, amount
+    const ERL_NIF_TERM *elements;
+    if (!get_uint_tuple(env, args, 3, 3, v, &elements))
+        return make_error(env, "einval");
+    return read_into_binary(env, client, S7AreaDB, v[0], v[1], v[2], S7WLByte);
+}
+
+static ERL_NIF_TERM nif_db_write(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                 const struct nif_command *cmd)
+{
+    (void) cmd;
+    unsigned long v[3]; // db_number, start, amount
+    const ERL_NIF_TERM *elements;
+    if (!get_uint_tuple(env, args, 4, 3, v, &elements))
+        return make_error(env, "einval");
+    return write_from_binary(env, client, S7AreaDB, v[0], v[1], v[2], S7WLByte, elements[3]);
+}
+
+// AB/EB/MB/TM/CT reads and writes, {start, amount} and {start, amount, data}
+static ERL_NIF_TERM nif_fixed_read(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                   const struct nif_command *cmd)
+{
+    unsigned long v[2];
+    const ERL_NIF_TERM *elements;
+    if (!get_uint_tuple(env, args, 2, 2, v, &elements))
+        return make_error(env, "einval");
+    return read_into_binary(env, client, cmd->area, 0, v[0], v[1], cmd->word_len);
+}
+
+static ERL_NIF_TERM nif_fixed_write(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                    const struct nif_command *cmd)
+{
+    unsigned long v[2];
+    const ERL_NIF_TERM *elements;
+    if (!get_uint_tuple(env, args, 3, 2, v, &elements))
+        return make_error(env, "einval");
+    return write_from_binary(env, client, cmd->area, 0, v[0], v[1], cmd->word_len, elements[2]);
+}
+
+//    Security functions
+
+static ERL_NIF_TERM nif_set_session_password(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                             const struct nif_command *cmd)
+{
+    (void) cmd;
+    char password[13];
+    if (!get_string(env, args, password, sizeof(password)))
+        return make_error(env, "enoent");
+    return make_result(env, Cli_SetSessionPassword(client, password));
+}
+
+static ERL_NIF_TERM nif_clear_session_password(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                               const struct nif_command *cmd)
+{
+    (void) args;
+    (void) cmd;
+    return make_result(env, Cli_ClearSessionPassword(client));
+}
+
+//    Miscellaneous functions
+
+static ERL_NIF_TERM nif_get_plc_status(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                       const struct nif_command *cmd)
+{
+    (void) args;
+    (void) cmd;
+    int status;
+    int result = Cli_GetPlcStatus(client, &status);
+    if (result != 0)
+        return make_result(env, result);
+
+    switch (status) {
+    case S7CpuStatusRun:
+        return make_ok(env, enif_make_atom(env, "S7CpuStatusRun"));
+    case S7CpuStatusStop:
+        return make_ok(env, enif_make_atom(env, "S7CpuStatusStop"));
+    default:
+        return make_ok(env, enif_make_atom(env, "S7CpuStatusUnknown"));
+    }
+}
+
+static ERL_NIF_TERM nif_get_exec_time(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                      const struct nif_command *cmd)
+{
+    (void) args;
+    (void) cmd;
+    int time;
+    int result = Cli_GetExecTime(client, &time);
+    return result != 0 ? make_result(env, result) : make_ok(env, enif_make_uint(env, time));
+}
+
+static ERL_NIF_TERM nif_get_last_error(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                       const struct nif_command *cmd)
+{
+    (void) args;
+    (void) cmd;
+    int error;
+    int result = Cli_GetLastError(client, &error);
+    return result != 0 ? make_result(env, result) : make_ok(env, make_snap7_errors(env, error));
+}
+
+static ERL_NIF_TERM nif_get_pdu_length(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                       const struct nif_command *cmd)
+{
+    (void) args;
+    (void) cmd;
+    int requested, negotiated;
+    int result = Cli_GetPduLength(client, &requested, &negotiated);
+    if (result != 0)
+        return make_result(env, result);
+
+    ERL_NIF_TERM pdu = enif_make_list2(env,
+        enif_make_tuple2(env, enif_make_atom(env, "Requested"), enif_make_int(env, requested)),
+        enif_make_tuple2(env, enif_make_atom(env, "Negotiated"), enif_make_int(env, negotiated)));
+    return make_ok(env, pdu);
+}
+
+static ERL_NIF_TERM nif_get_connected(ErlNifEnv *env, S7Object client, ERL_NIF_TERM args,
+                                      const struct nif_command *cmd)
+{
+    (void) args;
+    (void) cmd;
+    int status;
+    int result = Cli_GetConnected(client, &status);
+    if (result != 0)
+        return make_result(env, result);
+    return make_ok(env, enif_make_atom(env, status != 0 ? "true" : "false"));
+}
+
+static const struct nif_command nif_commands[] = {
+    {"set_connection_type", nif_set_connection_type, 0, 0},
+    {"connect_to", nif_connect_to, 0, 0},
+    {"set_connection_params", nif_set_connection_params, 0, 0},
+    {"connect", nif_connect, 0, 0},
+    {"disconnect", nif_disconnect, 0, 0},
+    {"get_params", nif_get_params, 0, 0},
+    {"set_params", nif_set_params, 0, 0},
+    {"read_area", nif_read_area, 0, 0},
+    {"write_area", nif_write_area, 0, 0},
+    {"db_read", nif_db_read, 0, 0},
+    {"db_write", nif_db_write, 0, 0},
+    {"ab_read", nif_fixed_read, S7AreaPA, S7WLByte},
+    {"ab_write", nif_fixed_write, S7AreaPA, S7WLByte},
+    {"eb_read", nif_fixed_read, S7AreaPE, S7WLByte},
+    {"eb_write", nif_fixed_write, S7AreaPE, S7WLByte},
+    {"mb_read", nif_fixed_read, S7AreaMK, S7WLByte},
+    {"mb_write", nif_fixed_write, S7AreaMK, S7WLByte},
+    {"tm_read", nif_fixed_read, S7AreaTM, S7WLTimer},
+    {"tm_write", nif_fixed_write, S7AreaTM, S7WLTimer},
+    {"ct_read", nif_fixed_read, S7AreaCT, S7WLCounter},
+    {"ct_write", nif_fixed_write, S7AreaCT, S7WLCounter},
+    {"set_session_password", nif_set_session_password, 0, 0},
+    {"clear_session_password", nif_clear_session_password, 0, 0},
+    {"get_plc_status", nif_get_plc_status, 0, 0},
+    {"get_exec_time", nif_get_exec_time, 0, 0},
+    {"get_last_error", nif_get_last_error, 0, 0},
+    {"get_pdu_length", nif_get_pdu_length, 0, 0},
+    {"get_connected", nif_get_connected, 0, 0},
+    {NULL, NULL, 0, 0}
+};
+
+/**
+ * @brief create(), a new (disconnected) snap7 client
+ */
+static ERL_NIF_TERM create_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    (void) argc;
+    (void) argv;
+    struct nif_client *c = enif_alloc_resource(nif_client_type, sizeof(struct nif_client));
+    c->client = Cli_Create();
+    c->lock = enif_mutex_create("s7_client");
+    ERL_NIF_TERM ref = enif_make_resource(env, c);
+    enif_release_resource(c);
+
+    if (c->client == 0 || c->lock == NULL)
+        return make_error(env, "enomem");
+    return make_ok(env, ref);
+}
+
+/**
+ * @brief command(client, command, arguments), runs on a dirty I/O scheduler
+ */
+static ERL_NIF_TERM command_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    (void) argc;
+    struct nif_client *c;
+    char cmd[32];
+    if (!enif_get_resource(env, argv[0], nif_client_type, (void **) &c) ||
+            !enif_get_atom(env, argv[1], cmd, sizeof(cmd), ERL_NIF_LATIN1))
+        return enif_make_badarg(env);
+
+    for (const struct nif_command *command = nif_commands; command->name != NULL; command++) {
+        if (strcmp(command->name, cmd) == 0) {
+            enif_mutex_lock(c->lock);
+            ERL_NIF_TERM response = command->handler(env, c->client, argv[2], command);
+            enif_mutex_unlock(c->lock);
+            return response;
+        }
+    }
+    return make_error(env, "enotsup");
+}
+
+static ErlNifFunc nif_funcs[] = {
+    {"create", 0, create_nif, 0},
+    {"command", 3, command_nif, ERL_NIF_DIRTY_JOB_IO_BOUND}
+};
+
+ERL_NIF_INIT(Elixir.Snapex7.Nif, nif_funcs, load, NULL, NULL, NULL)
@@ -0,0 +1,69 @@
+#ifndef S7_ERRORS_H
+#define S7_ERRORS_H
+
+/*
+ * Names of the snap7 error codes, shared by the ports and the client NIF.
+ * A snap7 code packs the S7 error in its upper 12 bits (index code / 0x100000),
+ * the ISO one in bits 16..19 and the TCP (errno) one in the lower 16 bits,
+ * index 0 means no error of that kind (check snap7-refman.pdf pg. 253).
+ */
+static const char err_s7[0x26][37] = {
+    "errNegotiatingPDU",
+    "errCliInvalidParams",
+    "errCliJobPending",
+    "errCliTooManyItems",
+    "errCliInvalidWordLen",
+    "errCliPartialDataWritten",
+    "errCliSizeOverPDU",
+    "errCliInvalidPlcAnswer",
+    "errCliAddressOutOfRange",
+    "errCliInvalidTransportSize",
+    "errCliWriteDataSizeMismatch",
+    "errCliItemNotAvailable",
+    "errCliInvalidValue",
+    "errCliCannotStartPLC",
+    "errCliAlreadyRun",
+    "errCliCannotStopPLC",
+    "errCliCannotCopyRamToRom",
+    "errCliCannotCompress",
+    "errCliAlreadyStop",
+    "errCliFunNotAvailable",
+    "errCliUploadSequenceFailed",
+    "errCliInvalidDataSizeRecvd",
+    "errCliInvalidBlockType",
+    "errCliInvalidBlockNumber",
+    "errCliInvalidBlockSize",
+    "errCliDownloadSequenceFailed",
+    "errCliInsertRefused",
+    "errCliDeleteRefused",
+    "errCliNeedPassword",
+    "errCliInvalidPassword",
+    "errCliNoPasswordToSetOrClear",
+    "errCliJobTimeout",
+    "errCliPartialDataRead",
+    "errCliBufferTooSmall",
+    "errCliFunctionRefused",
+    "errCliInvalidParamNumber",
+    "errCliDestroying",
+    "errCliCannotChangeParam"
+    };
+
+static const char err_iso[0x0F][37] = {
+    "errIsoConnect",
+    "errIsoDisconnect",
+    "errIsoInvalidPDU",
+    "errIsoInvalidDataSize",
+    "errIsoNullPointer",
+    "errIsoShortPacket",
+    "errIsoTooManyFragments",
+    "errIsoPduOverflow",
+    "errIsoSendPacket",
+    "errIsoRecvPacket",
+    "errIsoInvalidParams",
+    "errIsoResvd_1",
+    "errIsoResvd_2",
+    "errIsoResvd_3",
+    "errIsoResvd_4"
+};
+
+#endif
@@ -45,15 +45,17 @@ void print_arrays(byte *data,int size)
     printf("\n");
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    // PLC address, e.g. a loopback Snapex7.Server or a real CPU.
+    const char *plc_ip = argc > 1 ? argv[1] : "127.0.0.1";
     char *str;
     char *str1 = "tutorialspoint";
     char array[] = {'H','o','l','a'};
     struct erlcmd handler;
     Client = Cli_Create();
     uint32_t param;
-    int result = Cli_ConnectTo(Client,"192.168.0.1",0,1);
+    int result = Cli_ConnectTo(Client, plc_ip, 0, 1);
     printf("r = %d\n", result);
 
     // Read/Write Area test
@@ -1,30 +1,496 @@
 #include "snap7.h"
 #include "erlcmd.h"
+#include "s7_errors.h"
 #include <err.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <poll.h>
 #include <stdio.h>
-#define MAX_READ 1023
 
-int MyDB32[256]; // byte is a portable type of snap7.h
-ei_x_buff x;
+#define MAX_AREAS 64
 
-S7Object Client;
+S7Object Server;
+
+// Utilities for communication and error handling
+static const char response_id = 'r';
+
+const char err_srv[0x08][37] = {
+    "errSrvCannotStart",
+    "errSrvDBNullPointer",
+    "errSrvAreaAlreadyExists",
+    "errSrvUnknownArea",
+    "errSrvInvalidParams",
+    "errSrvTooManyDB",
+    "errSrvInvalidParamNumber",
+    "errSrvCannotChangeParam"
+};
+
+/*
+ * Memory registered into the server. Snap7 keeps a pointer to the user
+ * buffer, so it must live as long as the area stays registered.
+ */
+struct server_area
+{
+    int area_code;  // srvAreaPE, srvAreaPA, srvAreaMK, srvAreaCT, srvAreaTM or srvAreaDB
+    word index;     // DB number (only meaningful for srvAreaDB)
+    int size;
+    byte *data;
+};
+
+static struct server_area areas[MAX_AREAS];
+static int n_areas = 0;
+
+static struct server_area *find_area(int area_code, word index)
+{
+    for (int i = 0; i < n_areas; i++) {
+        if (areas[i].area_code == area_code && areas[i].index == index)
+            return &areas[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Send :ok back to Elixir
+ */
+static void send_ok_response()
+{
+    char resp[256];
+    int resp_index = sizeof(uint16_t); // Space for payload size
+    resp[resp_index++] = response_id;
+    ei_encode_version(resp, &resp_index);
+    ei_encode_atom(resp, &resp_index, "ok");
+    erlcmd_send(resp, resp_index);
+}
+
+/**
+ * @brief Send a binary back to Elixir in form of {:ok, data}
+ */
+static void send_binary_response(const byte *data, int data_len)
+{
+    char resp[ERLCMD_BUF_SIZE];
+    int resp_index = sizeof(uint16_t); // Space for payload size
+    resp[resp_index++] = response_id;
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, "ok");
+    ei_encode_binary(resp, &resp_index, data, data_len);
+    erlcmd_send(resp, resp_index);
+}
+
+/**
+ * @brief Send a response of the form {:error, reason}
+ *
+ * @param reason is an error reason (sended back as an atom)
+ */
+static void send_error_response(const char *reason)
+{
+    char resp[256];
+    int resp_index = sizeof(uint16_t); // Space for payload size
+    resp[resp_index++] = response_id;
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, "error");
+    ei_encode_atom(resp, &resp_index, reason);
+    erlcmd_send(resp, resp_index);
+}
+
+/**
+ * @brief Send a response of the form {:error, reasons}
+ *  where 'reasons' is a map (%{es7: atom/nil, eiso: atom/nil, etcp: int/nil}),
+ *  same as the client, but 'es7' holds the server error (errSrv*).
+ * @param code, is an error code from snap7 source code.
+ */
+static void send_snap7_errors(uint32_t code)
+{
+    char resp[256];
+    int index_srv = code / 0x100000;
+    int index_iso = (code & 0x000F0000)/ 0x10000;
+    int index_tcp = (code & 0xFFFF);
+    int resp_index = sizeof(uint16_t); // Space for payload size
+
+    resp[resp_index++] = response_id;
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, "error");
+    ei_encode_map_header(resp, &resp_index, 3);
+
+    ei_encode_atom(resp, &resp_index, "es7");
+    if(index_srv != 0 && index_srv <= 0x08)
+        ei_encode_atom(resp, &resp_index, err_srv[index_srv-1]);
+    else
+        ei_encode_atom(resp, &resp_index, "nil");
+
+    ei_encode_atom(resp, &resp_index, "eiso");
+    if(index_iso != 0)
+        ei_encode_atom(resp, &resp_index, err_iso[index_iso-1]);
+    else
+        ei_encode_atom(resp, &resp_index, "nil");
+
+    ei_encode_atom(resp, &resp_index, "etcp");
+    if(index_tcp != 0)
+        ei_encode_char(resp, &resp_index, index_tcp);
+    else
+        ei_encode_atom(resp, &resp_index, "nil");
+
+    erlcmd_send(resp, resp_index);
+}
+
+/*
+    Snap7 Server Handlers
+*/
+
+/**
+ *  Sets an internal Server object parameter (e.g. 1 = LocalPort).
+*/
+static void handle_set_params(const char *req, int *req_index)
+{
+    int term_size;
+    if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
+        term_size != 2)
+        errx(EXIT_FAILURE, ":set_params requires a 2-tuple, term_size = %d", term_size);
+
+    char ind_param;
+    if (ei_decode_char(req, req_index, &ind_param) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    long long data;
+    if (ei_decode_longlong(req, req_index, &data) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    int result = Srv_SetParam(Server, ind_param, &data);
+    if (result != 0){
+        send_snap7_errors(result);
+        return;
+    }
+
+    send_ok_response();
+}
+
+/**
+ *  Starts the server and binds it to the given IPV4 address.
+*/
+static void handle_start_to(const char *req, int *req_index)
+{
+    int term_type;
+    int term_size;
+    char ip[20];
+    long binary_len;
+    if (ei_get_type(req, req_index, &term_type, &term_size) < 0 ||
+            term_type != ERL_BINARY_EXT ||
+            term_size >= (int) sizeof(ip) ||
+            ei_decode_binary(req, req_index, ip, &binary_len) < 0) {
+        send_error_response("enoent");
+        return;
+    }
+    ip[term_size] = '\0';
+
+    int result = Srv_StartTo(Server, ip);
+    if (result != 0){
+        send_snap7_errors(result);
+        return;
+    }
+
+    send_ok_response();
+}
+
+/**
+ *  Stops the server, the registered areas are kept.
+*/
+static void handle_stop(const char *req, int *req_index)
+{
+    int result = Srv_Stop(Server);
+    if (result != 0){
+        send_snap7_errors(result);
+        return;
+    }
+
+    send_ok_response();
+}
+
+/**
+ *  Allocates a zero filled buffer and shares it with the server as
+ *  {area_code, index, size}.
+*/
+static void handle_register_area(const char *req, int *req_index)
+{
+    int term_size;
+    if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
+        term_size != 3)
+        errx(EXIT_FAILURE, ":register_area requires a 3-tuple, term_size = %d", term_size);
+
+    unsigned long area_code;
+    if (ei_decode_ulong(req, req_index, &area_code) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    unsigned long index;
+    if (ei_decode_ulong(req, req_index, &index) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    unsigned long size;
+    if (ei_decode_ulong(req, req_index, &size) < 0 || size == 0 || size > 0xFFFF) {
+        send_error_response("einval");
+        return;
+    }
+
+    if (n_areas >= MAX_AREAS) {
+        send_error_response("enomem");
+        return;
+    }
+
+    byte *data = calloc(size, 1);
+    if (data == NULL) {
+        send_error_response("enomem");
+        return;
+    }
+
+    int result = Srv_RegisterArea(Server, (int)area_code, (word)index, data, (int)size);
+    if (result != 0){
+        free(data);
+        send_snap7_errors(result);
+        return;
+    }
+
+    areas[n_areas].area_code = (int)area_code;
+    areas[n_areas].index = (word)index;
+    areas[n_areas].size = (int)size;
+    areas[n_areas].data = data;
+    n_areas++;
+
+    send_ok_response();
+}
+
+/**
+ *  Copies {area_code, index, start, data} into a registered area,
+ *  the area is locked while it is written.
+*/
+static void handle_write_area(const char *req, int *req_index)
+{
+    int term_type;
+    int term_size;
+    if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
+        term_size != 4)
+        errx(EXIT_FAILURE, ":write_area requires a 4-tuple, term_size = %d", term_size);
+
+    unsigned long area_code;
+    unsigned long index;
+    unsigned long start;
+    if (ei_decode_ulong(req, req_index, &area_code) < 0 ||
+        ei_decode_ulong(req, req_index, &index) < 0 ||
+        ei_decode_ulong(req, req_index, &start) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    struct server_area *area = find_area((int)area_code, (word)index);
+    if (area == NULL) {
+        send_error_response("enoent");
+        return;
+    }
+
+    if (ei_get_type(req, req_index, &term_type, &term_size) < 0 ||
+        term_type != ERL_BINARY_EXT ||
+        start + term_size > (unsigned long)area->size) {
+        send_error_response("einval");
+        return;
+    }
+
+    long bin_size;
+    Srv_LockArea(Server, area->area_code, area->index);
+    ei_decode_binary(req, req_index, area->data + start, &bin_size);
+    Srv_UnlockArea(Server, area->area_code, area->index);
+
+    send_ok_response();
+}
+
+/**
+ *  Returns {area_code, index, start, size} bytes of a registered area.
+*/
+static void handle_read_area(const char *req, int *req_index)
+{
+    int term_size;
+    if(ei_decode_tuple_header(req, req_index, &term_size) < 0 ||
+        term_size != 4)
+        errx(EXIT_FAILURE, ":read_area requires a 4-tuple, term_size = %d", term_size);
+
+    unsigned long area_code;
+    unsigned long index;
+    unsigned long start;
+    unsigned long size;
+    if (ei_decode_ulong(req, req_index, &area_code) < 0 ||
+        ei_decode_ulong(req, req_index, &index) < 0 ||
+        ei_decode_ulong(req, req_index, &start) < 0 ||
+        ei_decode_ulong(req, req_index, &size) < 0) {
+        send_error_response("einval");
+        return;
+    }
+
+    struct server_area *area = find_area((int)area_code, (word)index);
+    if (area == NULL) {
+        send_error_response("enoent");
+        return;
+    }
+
+    if (start + size > (unsigned long)area->size ||
+        size > ERLCMD_BUF_SIZE - 64) {
+        send_error_response("einval");
+        return;
+    }
+
+    byte data[size];
+    Srv_LockArea(Server, area->area_code, area->index);
+    memcpy(data, area->data + start, size);
+    Srv_UnlockArea(Server, area->area_code, area->index);
+
+    send_binary_response(data, (int)size);
+}
+
+/**
+ *  Returns the server status (stopped/running/error).
+*/
+static void handle_get_status(const char *req, int *req_index)
+{
+    int server_status;
+    int cpu_status;
+    int clients_count;
+    int result = Srv_GetStatus(Server, &server_status, &cpu_status, &clients_count);
+    if (result != 0){
+        send_snap7_errors(result);
+        return;
+    }
+
+    char resp[256];
+    int resp_index = sizeof(uint16_t); // Space for payload size
+    resp[resp_index++] = response_id;
+    ei_encode_version(resp, &resp_index);
+    ei_encode_tuple_header(resp, &resp_index, 2);
+    ei_encode_atom(resp, &resp_index, "ok");
+    ei_encode_map_header(resp, &resp_index, 3);
+
+    ei_encode_atom(resp, &resp_index, "server_status");
+    switch(server_status)
+    {
+        case 1:
+            ei_encode_atom(resp, &resp_index, "SrvRunning");
+        break;
+
+        case 2:
+            ei_encode_atom(resp, &resp_index, "SrvError");
+        break;
+
+        default:
+            ei_encode_atom(resp, &resp_index, "SrvStopped");
+        break;
+    }
+
+    ei_encode_atom(resp, &resp_index, "cpu_status");
+    ei_encode_long(resp, &resp_index, cpu_status);
+
+    ei_encode_atom(resp, &resp_index, "clients_count");
+    ei_encode_long(resp, &resp_index, clients_count);
+
+    erlcmd_send(resp, resp_index);
+}
+
+static void handle_test(const char *req, int *req_index)
+{
+    send_ok_response();
+}
+
+/* Elixir request handler table
+ */
+struct request_handler {
+    const char *name;
+    void (*handler)(const char *req, int *req_index);
+};
+
+static struct request_handler request_handlers[] = {
+    {"test", handle_test},
+    {"set_params", handle_set_params},
+    {"start_to", handle_start_to},
+    {"stop", handle_stop},
+    {"register_area", handle_register_area},
+    {"write_area", handle_write_area},
+    {"read_area", handle_read_area},
+    {"get_status", handle_get_status},
+    { NULL, NULL }
+};
+
+/**
+ * @brief Decode and forward requests from Elixir to the appropriate handlers
+ * @param req the undecoded request
+ * @param cookie
+ */
+static void handle_elixir_request(const char *req, void *cookie)
+{
+    (void) cookie;
+
+    // Commands are of the form {Command, Arguments}:
+    // { atom(), term() }
+    int req_index = sizeof(uint16_t);
+    if (ei_decode_version(req, &req_index, NULL) < 0)
+        errx(EXIT_FAILURE, "Message version issue?");
+
+    int arity;
+    if (ei_decode_tuple_header(req, &req_index, &arity) < 0 ||
+            arity != 2)
+        errx(EXIT_FAILURE, "expecting {cmd, args} tuple");
+
+    char cmd[MAXATOMLEN];
+    if (ei_decode_atom(req, &req_index, cmd) < 0)
+        errx(EXIT_FAILURE, "expecting command atom");
+
+    for (struct request_handler *rh = request_handlers; rh->name != NULL; rh++) {
+        if (strcmp(cmd, rh->name) == 0) {
+            rh->handler(req, &req_index);
+            return;
+        }
+    }
+    // no listed function
+    errx(EXIT_FAILURE, "unknown command: %s", cmd);
+}
 
 int main()
 {
-    struct erlcmd handler;
-    Client = Cli_Create();
+    Server = Srv_Create();
+
+    struct erlcmd *handler = malloc(sizeof(struct erlcmd));
+    erlcmd_init(handler, handle_elixir_request, NULL);
+
+    for (;;) {
+        struct pollfd fdset;
+
+        fdset.fd = STDIN_FILENO;
+        fdset.events = POLLIN;
+        fdset.revents = 0;
+
+        int rc = poll(&fdset, 1, -1);
+
+        if (rc < 0) {
+            // Retry if EINTR
+            if (errno == EINTR)
+                continue;
 
-    Cli_ConnectTo(Client,"192.168.0.1",0,1);
+            err(EXIT_FAILURE, "poll");
+        }
 
-    Cli_DBRead(Client, 1, 2, 4, MyDB32);
+        if (fdset.revents & (POLLIN | POLLHUP)) {
+            if (erlcmd_process(handler))
+                break;
+        }
+    }
 
-    printf("0x");
-    printf("%04x", MyDB32[0]);
-    printf("\n");
-    
-    Cli_Destroy(&Client);    
-}
\ No newline at end of file
+    // Stop and kill the server before releasing the areas it points to
+    Srv_Stop(Server);
+    Srv_Destroy(&Server);
+    for (int i = 0; i < n_areas; i++)
+        free(areas[i].data);
+}
@@ -0,0 +1,89 @@
+#include "s7_shm.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void *region = NULL;
+static size_t region_size;
+static uint32_t next_slot = 0;
+static char region_name[64];
+
+/**
+ * @brief Creates and maps the region, replacing the previous one
+ * @return 0, or -1 with errno set
+ */
+int s7_shm_create(const char *name, uint32_t slots, uint32_t slot_size)
+{
+    s7_shm_destroy();
+    if (strlen(name) >= sizeof(region_name))
+        return -1;
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return -1;
+
+    size_t size = s7_shm_size(slots, slot_size);
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, (off_t) size) == 0)
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name);
+        return -1;
+    }
+
+    // the pages come zeroed, all the slots are free
+    struct s7_shm_header *header = (struct s7_shm_header *) base;
+    header->slots = slots;
+    header->slot_size = slot_size;
+    __atomic_store_n(&header->magic, S7_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    region = base;
+    region_size = size;
+    next_slot = 0;
+    strcpy(region_name, name);
+    return 0;
+}
+
+/**
+ * @brief Copies data to the next free slot of the ring, slots are normally freed
+ *  in order but the BEAM may hold one for a while (e.g. a late reply)
+ * @return the slot, or -1 when the data must go through the pipe
+ */
+int s7_shm_put(const void *data, uint32_t len)
+{
+    if (region == NULL || len < S7_SHM_MIN_SIZE)
+        return -1;
+
+    const struct s7_shm_header *header = (const struct s7_shm_header *) region;
+    if (len > header->slot_size)
+        return -1;
+
+    uint32_t slot = next_slot;
+    struct s7_shm_slot *desc = s7_shm_slot(region, slot);
+    for (uint32_t i = 0; __atomic_load_n(&desc->state, __ATOMIC_ACQUIRE) != S7_SHM_FREE; i++) {
+        if (i == header->slots)
+            return -1;
+        slot = (slot + 1) % header->slots;
+        desc = s7_shm_slot(region, slot);
+    }
+
+    memcpy(s7_shm_slot_data(region, slot), data, len);
+    desc->len = len;
+    __atomic_store_n(&desc->state, S7_SHM_FULL, __ATOMIC_RELEASE);
+    next_slot = (slot + 1) % header->slots;
+    return (int) slot;
+}
+
+/**
+ * @brief Unmaps the region, its name is normally unlinked by the BEAM already
+ */
+void s7_shm_destroy()
+{
+    if (region != NULL) {
+        munmap(region, region_size);
+        shm_unlink(region_name);
+    }
+    region = NULL;
+}
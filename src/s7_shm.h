@@ -0,0 +1,68 @@
+#ifndef S7_SHM_H
+#define S7_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory data plane between the client port and the BEAM.
+ *
+ * The port creates a POSIX shm region holding a ring of fixed size slots and the
+ * BEAM maps it through the s7_shm_nif NIF (which unlinks its name right away).
+ * Big binaries of data replies are copied to the next free slot and the pipe only
+ * carries {:"$shm", slot, size}, the NIF copies the slot out and frees it.
+ *
+ * Layout: header, slot descriptors, slot data (every slot S7_SHM_ALIGN aligned).
+ * A slot is owned by the port while S7_SHM_FREE and by the BEAM while S7_SHM_FULL,
+ * its state is only changed with acquire/release atomics.
+ */
+#define S7_SHM_MAGIC 0x53374D31 // "S7M1"
+#define S7_SHM_ALIGN 64
+#define S7_SHM_FREE 0
+#define S7_SHM_FULL 1
+
+// Smaller binaries aren't worth a slot
+#define S7_SHM_MIN_SIZE 512
+
+struct s7_shm_header
+{
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t reserved;
+};
+
+struct s7_shm_slot
+{
+    uint32_t state;
+    uint32_t len;
+};
+
+static inline size_t s7_shm_data_offset(uint32_t slots)
+{
+    size_t offset = sizeof(struct s7_shm_header) + slots * sizeof(struct s7_shm_slot);
+    return (offset + S7_SHM_ALIGN - 1) & ~((size_t) S7_SHM_ALIGN - 1);
+}
+
+static inline size_t s7_shm_size(uint32_t slots, uint32_t slot_size)
+{
+    return s7_shm_data_offset(slots) + (size_t) slots * slot_size;
+}
+
+static inline struct s7_shm_slot *s7_shm_slot(void *base, uint32_t slot)
+{
+    return (struct s7_shm_slot *) ((char *) base + sizeof(struct s7_shm_header)) + slot;
+}
+
+static inline char *s7_shm_slot_data(void *base, uint32_t slot)
+{
+    const struct s7_shm_header *header = (const struct s7_shm_header *) base;
+    return (char *) base + s7_shm_data_offset(header->slots) + (size_t) slot * header->slot_size;
+}
+
+// Port side
+int s7_shm_create(const char *name, uint32_t slots, uint32_t slot_size);
+int s7_shm_put(const void *data, uint32_t len);
+void s7_shm_destroy();
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ *  BEAM side of the shared memory data plane (see s7_shm.h), the client port
+ *  creates the region and Snapex7.Shm maps it through this NIF.
+ */
+
+#include "erl_nif.h"
+#include "s7_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct shm_region
+{
+    void *base;
+    size_t size;
+};
+
+static ErlNifResourceType *shm_region_type;
+
+static void shm_region_dtor(ErlNifEnv *env, void *obj)
+{
+    (void) env;
+    struct shm_region *region = (struct shm_region *) obj;
+    if (region->base != NULL)
+        munmap(region->base, region->size);
+}
+
+static int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+{
+    (void) priv_data;
+    (void) load_info;
+    shm_region_type = enif_open_resource_type(env, NULL, "s7_shm_region", shm_region_dtor,
+                                              ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+    return shm_region_type == NULL ? -1 : 0;
+}
+
+static ERL_NIF_TERM make_error(ErlNifEnv *env, const char *reason)
+{
+    return enif_make_tuple2(env, enif_make_atom(env, "error"), enif_make_atom(env, reason));
+}
+
+/**
+ * @brief open(name), maps the region and unlinks its name
+ */
+static ERL_NIF_TERM shm_open_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    (void) argc;
+    ErlNifBinary name_bin;
+    char name[64];
+    if (!enif_inspect_binary(env, argv[0], &name_bin) || name_bin.size >= sizeof(name))
+        return enif_make_badarg(env);
+    memcpy(name, name_bin.data, name_bin.size);
+    name[name_bin.size] = '\0';
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return make_error(env, errno == ENOENT ? "enoent" : "eshm");
+    shm_unlink(name);
+
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct s7_shm_header))
+        base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return make_error(env, "eshm");
+
+    const struct s7_shm_header *header = (const struct s7_shm_header *) base;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != S7_SHM_MAGIC ||
+            s7_shm_size(header->slots, header->slot_size) > (size_t) st.st_size) {
+        munmap(base, st.st_size);
+        return make_error(env, "einval");
+    }
+
+    struct shm_region *region = enif_alloc_resource(shm_region_type, sizeof(struct shm_region));
+    region->base = base;
+    region->size = st.st_size;
+    ERL_NIF_TERM ref = enif_make_resource(env, region);
+    enif_release_resource(region);
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), ref);
+}
+
+/**
+ * @brief take(region, slot, size), copies the slot out and frees it
+ */
+static ERL_NIF_TERM shm_take_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    (void) argc;
+    struct shm_region *region;
+    unsigned int slot;
+    unsigned int size;
+    if (!enif_get_resource(env, argv[0], shm_region_type, (void **) &region) ||
+            !enif_get_uint(env, argv[1], &slot) ||
+            !enif_get_uint(env, argv[2], &size))
+        return enif_make_badarg(env);
+
+    const struct s7_shm_header *header = (const struct s7_shm_header *) region->base;
+    if (slot >= header->slots)
+        return enif_make_badarg(env);
+
+    struct s7_shm_slot *desc = s7_shm_slot(region->base, slot);
+    if (__atomic_load_n(&desc->state, __ATOMIC_ACQUIRE) != S7_SHM_FULL ||
+            desc->len != size || size > header->slot_size)
+        return make_error(env, "empty");
+
+    ERL_NIF_TERM data;
+    unsigned char *buf = enif_make_new_binary(env, size, &data);
+    memcpy(buf, s7_shm_slot_data(region->base, slot), size);
+    __atomic_store_n(&desc->state, S7_SHM_FREE, __ATOMIC_RELEASE);
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), data);
+}
+
+static ErlNifFunc nif_funcs[] = {
+    {"open", 1, shm_open_nif, 0},
+    {"take", 3, shm_take_nif, 0}
+};
+
+ERL_NIF_INIT(Elixir.Snapex7.Shm, nif_funcs, load, NULL, NULL, NULL)
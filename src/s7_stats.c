@@ -0,0 +1,115 @@
+#include "s7_stats.h"
+#include <string.h>
+#include <time.h>
+
+uint64_t s7_stats_now_ns()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ((uint64_t) tp.tv_sec) * 1000000000ULL + tp.tv_nsec;
+}
+
+static int bucket_index(uint64_t value)
+{
+    if (value < (1 << S7_HIST_SUB_BITS))
+        return (int) value;
+
+    if (value >> (S7_HIST_MAX_BITS + 1))
+        return S7_HIST_BUCKETS - 1;
+
+    // position of the most significant bit, then the next bits pick the sub-bucket
+    int msb = 63 - __builtin_clzll(value);
+    int sub = (int) (value >> (msb - S7_HIST_SUB_BITS + 1)) & (S7_HIST_SUB_COUNT - 1);
+    return (1 << S7_HIST_SUB_BITS) + (msb - S7_HIST_SUB_BITS) * S7_HIST_SUB_COUNT + sub;
+}
+
+// Highest value counted by a bucket
+static uint64_t bucket_upper_bound(int index)
+{
+    if (index < (1 << S7_HIST_SUB_BITS))
+        return (uint64_t) index;
+
+    int group = (index - (1 << S7_HIST_SUB_BITS)) / S7_HIST_SUB_COUNT;
+    int sub = (index - (1 << S7_HIST_SUB_BITS)) % S7_HIST_SUB_COUNT;
+    int msb = group + S7_HIST_SUB_BITS;
+    int shift = msb - S7_HIST_SUB_BITS + 1;
+    uint64_t lower = (1ULL << msb) | ((uint64_t) sub << shift);
+    return lower + (1ULL << shift) - 1;
+}
+
+void s7_histogram_record(struct s7_histogram *h, uint64_t value)
+{
+    __atomic_fetch_add(&h->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while ((min == 0 || value < min) &&
+           !__atomic_compare_exchange_n(&h->min, &min, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    // count goes last, readers use it to tell whether the histogram is empty
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Value under which `percentile` (0..100) of the samples are, it is the
+ *  upper bound of the matching bucket, never bigger than the max recorded value.
+ */
+uint64_t s7_histogram_percentile(const struct s7_histogram *h, double percentile)
+{
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    if (count == 0)
+        return 0;
+
+    uint64_t target = (uint64_t) (count * percentile / 100.0 + 0.5);
+    if (target == 0)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < S7_HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            uint64_t bound = bucket_upper_bound(i);
+            uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            return bound < max ? bound : max;
+        }
+    }
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+void s7_histogram_reset(struct s7_histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+/**
+ * @brief Encodes the histogram summary as
+ *  %{count, min, max, mean, p50, p90, p99, p999} (nanoseconds)
+ */
+void s7_histogram_encode(char *buf, int *index, const struct s7_histogram *h)
+{
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+
+    ei_encode_map_header(buf, index, 8);
+    ei_encode_atom(buf, index, "count");
+    ei_encode_ulonglong(buf, index, count);
+    ei_encode_atom(buf, index, "min");
+    ei_encode_ulonglong(buf, index, h->min);
+    ei_encode_atom(buf, index, "max");
+    ei_encode_ulonglong(buf, index, h->max);
+    ei_encode_atom(buf, index, "mean");
+    ei_encode_ulonglong(buf, index, count ? h->sum / count : 0);
+    ei_encode_atom(buf, index, "p50");
+    ei_encode_ulonglong(buf, index, s7_histogram_percentile(h, 50.0));
+    ei_encode_atom(buf, index, "p90");
+    ei_encode_ulonglong(buf, index, s7_histogram_percentile(h, 90.0));
+    ei_encode_atom(buf, index, "p99");
+    ei_encode_ulonglong(buf, index, s7_histogram_percentile(h, 99.0));
+    ei_encode_atom(buf, index, "p999");
+    ei_encode_ulonglong(buf, index, s7_histogram_percentile(h, 99.9));
+}
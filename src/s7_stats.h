@@ -0,0 +1,38 @@
+#ifndef S7_STATS_H
+#define S7_STATS_H
+
+#include <ei.h>
+#include <stdint.h>
+
+/*
+ * HDR-style log-linear latency histograms (in nanoseconds).
+ *
+ * Values under 2^S7_HIST_SUB_BITS are counted exactly, bigger values are
+ * grouped by power of two and every group is split in 2^(S7_HIST_SUB_BITS - 1)
+ * linear sub-buckets, so any recorded value is reported within 12.5%.
+ * Values over 2^(S7_HIST_MAX_BITS + 1) ns (~36 minutes) fall in the last bucket.
+ *
+ * Counters are only updated with relaxed atomics, recording never blocks
+ * nor allocates.
+ */
+#define S7_HIST_SUB_BITS 4
+#define S7_HIST_MAX_BITS 40
+#define S7_HIST_SUB_COUNT (1 << (S7_HIST_SUB_BITS - 1))
+#define S7_HIST_BUCKETS ((1 << S7_HIST_SUB_BITS) + (S7_HIST_MAX_BITS - S7_HIST_SUB_BITS + 1) * S7_HIST_SUB_COUNT)
+
+struct s7_histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[S7_HIST_BUCKETS];
+};
+
+uint64_t s7_stats_now_ns();
+void s7_histogram_record(struct s7_histogram *h, uint64_t value);
+uint64_t s7_histogram_percentile(const struct s7_histogram *h, double percentile);
+void s7_histogram_reset(struct s7_histogram *h);
+void s7_histogram_encode(char *buf, int *index, const struct s7_histogram *h);
+
+#endif
@@ -2,6 +2,8 @@ defmodule CliAdminFuncTest do
   use ExUnit.Case
   doctest Snapex7
 
+  @moduletag :plc
+
   setup do
     # checar como cambiar esto para que use :code.priv_dir
     snap7_dir = :code.priv_dir(:snapex7) |> List.to_string()
@@ -2,6 +2,8 @@ defmodule CliDataIoTest do
   use ExUnit.Case, async: false
   doctest Snapex7
 
+  @moduletag :plc
+
   # We need to implement S7 Server behavior in order to make a proper tests.
   # these tests are done connected to a real PLC
 
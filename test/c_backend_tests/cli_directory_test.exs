@@ -2,6 +2,8 @@ defmodule CliDirectoryTest do
   use ExUnit.Case
   doctest Snapex7
 
+  @moduletag :plc
+
   # We need to implement S7 Server behavior in order to make a proper tests.
   # we have a PLC that doesn't supports these functions (S7-1200).
 
@@ -2,6 +2,8 @@ defmodule CliMiscTest do
   use ExUnit.Case, async: false
   doctest Snapex7
 
+  @moduletag :plc
+
   setup do
     snap7_dir = :code.priv_dir(:snapex7) |> List.to_string()
     System.put_env("LD_LIBRARY_PATH", snap7_dir)
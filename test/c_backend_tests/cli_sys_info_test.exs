@@ -2,6 +2,8 @@ defmodule CliSysInfoTest do
   use ExUnit.Case, async: false
   doctest Snapex7
 
+  @moduletag :plc
+
   # We don't have the way to test this function
   # (we've a plc s7-1200 and snap7 server doesn't support these functions)
   # These tests only help us to track the input variables.
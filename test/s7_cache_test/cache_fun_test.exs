@@ -0,0 +1,85 @@
+defmodule CacheFunTest do
+  use ExUnit.Case, async: false
+  doctest Snapex7
+
+  @db_read {:db_read, [db_number: 2, start: 20, amount: 4]}
+
+  setup do
+    {:ok, client} = Snapex7.Client.start_link()
+    :ok = Snapex7.Client.connect_to(client, Snapex7.LoopbackPLC.connect_opts())
+    :ok = Snapex7.Server.write_area(Snapex7.LoopbackPLC, :DB, 2, 20, <<1, 2, 3, 4>>)
+
+    {:ok, cache} =
+      Snapex7.Cache.start_link(
+        name: :test_cache,
+        client: client,
+        polls: [
+          fast: [request: @db_read, interval: 20],
+          hot: [request: @db_read, interval: 20, store: :persistent_term]
+        ]
+      )
+
+    on_exit(fn -> if Process.alive?(cache), do: Snapex7.Cache.stop(cache) end)
+    %{client: client, cache: cache}
+  end
+
+  test "polled values are readable without the client" do
+    assert wait_for(:fast, <<1, 2, 3, 4>>) == {:ok, <<1, 2, 3, 4>>}
+    assert wait_for(:hot, <<1, 2, 3, 4>>) == {:ok, <<1, 2, 3, 4>>}
+
+    :ok = Snapex7.Server.write_area(Snapex7.LoopbackPLC, :DB, 2, 20, <<5, 6, 7, 8>>)
+    assert wait_for(:fast, <<5, 6, 7, 8>>) == {:ok, <<5, 6, 7, 8>>}
+    assert wait_for(:hot, <<5, 6, 7, 8>>) == {:ok, <<5, 6, 7, 8>>}
+  end
+
+  test "max_age, put and fetch" do
+    assert Snapex7.Cache.get(:test_cache, :unknown) == {:error, :not_found}
+
+    :ok = Snapex7.Cache.put(:test_cache, :manual, :value)
+    assert Snapex7.Cache.get(:test_cache, :manual, max_age: 1000) == {:ok, :value}
+    Process.sleep(5)
+    assert Snapex7.Cache.get(:test_cache, :manual, max_age: 1) == {:error, :stale}
+
+    assert Snapex7.Cache.fetch(:test_cache, :read_through, 1000, @db_read) == {:ok, <<1, 2, 3, 4>>}
+    assert Snapex7.Cache.get(:test_cache, :read_through) == {:ok, <<1, 2, 3, 4>>}
+  end
+
+  test "persistent_term values are deleted on stop", state do
+    assert wait_for(:hot, <<1, 2, 3, 4>>) == {:ok, <<1, 2, 3, 4>>}
+    :ok = Snapex7.Cache.stop(state.cache)
+    assert :persistent_term.get({Snapex7.Cache, :test_cache, :hot}, nil) == nil
+  end
+
+  test "adaptive polls slow down while the value doesn't change", state do
+    {:ok, cache} =
+      Snapex7.Cache.start_link(
+        name: :adaptive_cache,
+        client: state.client,
+        polls: [recipe: [request: @db_read, interval: 10, max_interval: 80]]
+      )
+
+    Process.sleep(400)
+    assert {80, <<1, 2, 3, 4>>} = :sys.get_state(cache).adaptive.recipe
+
+    :ok = Snapex7.Server.write_area(Snapex7.LoopbackPLC, :DB, 2, 20, <<9, 9, 9, 9>>)
+    Process.sleep(200)
+    assert Snapex7.Cache.get(:adaptive_cache, :recipe) == {:ok, <<9, 9, 9, 9>>}
+    {interval, <<9, 9, 9, 9>>} = :sys.get_state(cache).adaptive.recipe
+    assert interval < 80
+    Snapex7.Cache.stop(cache)
+  end
+
+  defp wait_for(key, expected, retries \\ 100) do
+    case Snapex7.Cache.get(:test_cache, key) do
+      {:ok, ^expected} = resp ->
+        resp
+
+      resp when retries == 0 ->
+        resp
+
+      _resp ->
+        Process.sleep(10)
+        wait_for(key, expected, retries - 1)
+    end
+  end
+end
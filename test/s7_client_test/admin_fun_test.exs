@@ -2,9 +2,9 @@ defmodule AdminFunTest do
   use ExUnit.Case
   doctest Snapex7
 
-  setup do
+  setup context do
     {:ok, pid} = Snapex7.Client.start_link()
-    Snapex7.Client.connect_to(pid, ip: "192.168.0.1", rack: 0, slot: 1)
+    Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts(context))
     {:ok, state} = :sys.get_state(pid) |> Map.fetch(:state)
     %{pid: pid, status: state}
   end
@@ -37,6 +37,7 @@ defmodule AdminFunTest do
     end
   end
 
+  @tag :plc
   test "connect_to function" do
     {:ok, pid} = Snapex7.Client.start_link()
     resp = Snapex7.Client.connect_to(pid, ip: "192.168.0.200", rack: 0, slot: 1)
@@ -71,4 +72,61 @@ defmodule AdminFunTest do
     resp = Snapex7.Client.get_params(pid, 2)
     assert resp == {:ok, 400}
   end
+
+  test "reconnect replays the session and holds requests" do
+    areas = [DB: [{1, 16}]]
+    {:ok, server} = Snapex7.Server.start_link(ip: "127.0.0.1", port: 10112, areas: areas)
+    {:ok, pid} = Snapex7.Client.start_link(reconnect: [backoff_min: 50, backoff_max: 200])
+    :ok = Snapex7.Client.set_params(pid, 5, 500)
+    :ok = Snapex7.Client.connect_to(pid, Snapex7.Server.connect_opts(server))
+    assert Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: 2) == {:ok, <<0, 0>>}
+
+    # the PLC blips, the request seeing it fails and the client starts reconnecting
+    :ok = Snapex7.Server.stop(server)
+    assert {:error, %{}} = Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: 2)
+    assert :sys.get_state(pid).state == :reconnecting
+
+    held = Task.async(fn -> Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: 2, timeout: 4000) end)
+    {:ok, server} = Snapex7.Server.start_link(ip: "127.0.0.1", port: 10112, areas: areas)
+    :ok = Snapex7.Server.write_area(server, :DB, 1, 0, <<1, 2>>)
+
+    assert Task.await(held, 5000) == {:ok, <<1, 2>>}
+    assert :sys.get_state(pid).state == :connected
+    assert Snapex7.Client.get_params(pid, 5) == {:ok, 500}
+
+    Snapex7.Client.stop(pid)
+    Snapex7.Server.stop(server)
+  end
+
+  test "reconnect fails fast by policy" do
+    {:ok, server} = Snapex7.Server.start_link(ip: "127.0.0.1", port: 10113, areas: [DB: [{1, 16}]])
+    {:ok, pid} = Snapex7.Client.start_link(reconnect: [on_disconnect: :fail_fast, backoff_min: 1000])
+    :ok = Snapex7.Client.connect_to(pid, Snapex7.Server.connect_opts(server))
+
+    :ok = Snapex7.Server.stop(server)
+    assert {:error, %{}} = Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: 2)
+    assert Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: 2) == {:error, :disconnected}
+
+    # disconnect/1 ends the reconnect loop
+    Snapex7.Client.disconnect(pid)
+    assert :sys.get_state(pid).state == :idle
+    Snapex7.Client.stop(pid)
+  end
+
+  test "dead peers are pushed by the port" do
+    {:ok, server} = Snapex7.Server.start_link(ip: "127.0.0.1", port: 10114, areas: [DB: [{1, 16}]])
+    health = [keepalive: {1000, 1000, 3}, user_timeout: 3000, probe_interval: 100, probe_timeout: 200]
+    {:ok, pid} = Snapex7.Client.start_link(health: health)
+    :ok = Snapex7.Client.connect_to(pid, Snapex7.Server.connect_opts(server))
+
+    # idle probes keep going on a healthy connection
+    Process.sleep(300)
+    assert Snapex7.Client.get_connected(pid) == {:ok, true}
+
+    :ok = Snapex7.Server.stop(server)
+    assert_receive {:snapex7, ^pid, {:disconnected, _reason}}, 1000
+    assert :sys.get_state(pid).state == :idle
+    assert Snapex7.Client.get_connected(pid) == {:ok, false}
+    Snapex7.Client.stop(pid)
+  end
 end
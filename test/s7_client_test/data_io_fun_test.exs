@@ -2,9 +2,9 @@ defmodule DataIoFunTest do
   use ExUnit.Case
   doctest Snapex7
 
-  setup do
+  setup context do
     {:ok, pid} = Snapex7.Client.start_link()
-    Snapex7.Client.connect_to(pid, ip: "192.168.0.1", rack: 0, slot: 1)
+    Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts(context))
     {:ok, state} = :sys.get_state(pid) |> Map.fetch(:state)
     %{pid: pid, status: state}
   end
@@ -356,4 +356,253 @@ defmodule DataIoFunTest do
         IO.puts("(#{__MODULE__}) Not connected")
     end
   end
+
+  test "identical concurrent reads share one port call", state do
+    case state.status do
+      :connected ->
+        {:ok, _stats} = Snapex7.Client.get_stats(state.pid, reset: true)
+
+        # queue the reads while the client is suspended, they are all waiting
+        # when the first one gets to the port
+        :ok = :sys.suspend(state.pid)
+
+        reads =
+          for _ <- 1..10 do
+            Task.async(fn -> Snapex7.Client.db_read(state.pid, db_number: 1, start: 0, amount: 4) end)
+          end
+
+        other = Task.async(fn -> Snapex7.Client.db_read(state.pid, db_number: 1, start: 4, amount: 4) end)
+        wait_for_queue(state.pid, 11)
+        :ok = :sys.resume(state.pid)
+
+        [first | _] = results = Enum.map(reads, &Task.await/1)
+        assert {:ok, <<_::binary-size(4)>>} = first
+        assert Enum.all?(results, &(&1 == first))
+        assert {:ok, <<_::binary-size(4)>>} = Task.await(other)
+
+        {:ok, stats} = Snapex7.Client.get_stats(state.pid)
+        assert stats.commands.db_read.calls == 2
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "priority classes", state do
+    case state.status do
+      :connected ->
+        data = <<1, 2, 3, 4, 0, 0, 0, 0, 0, 0>>
+        :ok = Snapex7.Client.db_write(state.pid, db_number: 2, start: 0, amount: 10, data: data)
+
+        # both requests reach the port while it is stopped, it reads them at once
+        port_os_pid = os_pid(:sys.get_state(state.pid).port)
+        kill("-STOP", port_os_pid)
+        :ok = :sys.suspend(state.pid)
+
+        bulk =
+          Task.async(fn ->
+            Snapex7.Client.db_read(state.pid, db_number: 2, start: 0, amount: 256, priority: :bulk)
+          end)
+
+        wait_for_queue(state.pid, 1)
+
+        realtime =
+          Task.async(fn ->
+            Snapex7.Client.db_write(state.pid,
+              db_number: 2,
+              start: 8,
+              amount: 2,
+              data: <<0xAB, 0xCD>>,
+              priority: :realtime
+            )
+          end)
+
+        wait_for_queue(state.pid, 2)
+        :ok = :sys.resume(state.pid)
+        # the realtime write is sent while the bulk read is in flight
+        wait_for_empty_queue(state.pid)
+        kill("-CONT", port_os_pid)
+
+        assert Task.await(realtime) == :ok
+        # the realtime write ran first, the bulk read sees it
+        assert {:ok, <<1, 2, 3, 4, 0, 0, 0, 0, 0xAB, 0xCD, _rest::binary-size(246)>>} = Task.await(bulk)
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "binary protocol", state do
+    case state.status do
+      :connected ->
+        {:ok, pid} = Snapex7.Client.start_link(binary_protocol: true)
+        :ok = Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts())
+
+        resp = Snapex7.Client.db_write(pid, db_number: 1, start: 16, amount: 4, data: <<1, 2, 3, 4>>)
+        assert resp == :ok
+        assert Snapex7.Client.db_read(pid, db_number: 1, start: 16, amount: 4) == {:ok, <<1, 2, 3, 4>>}
+
+        resp =
+          Snapex7.Client.read_area(pid, area: :DB, db_number: 1, word_len: :byte, start: 18, amount: 2)
+
+        assert resp == {:ok, <<3, 4>>}
+
+        assert Snapex7.Client.mb_write(pid, start: 8, amount: 2, data: <<0xBE, 0xEF>>) == :ok
+        assert Snapex7.Client.mb_read(pid, start: 8, amount: 2) == {:ok, <<0xBE, 0xEF>>}
+
+        # the ETF client sees the same data, errors come back as usual
+        assert Snapex7.Client.mb_read(state.pid, start: 8, amount: 2) == {:ok, <<0xBE, 0xEF>>}
+        assert {:error, %{}} = Snapex7.Client.db_read(pid, db_number: 99, start: 0, amount: 4)
+
+        {:ok, stats} = Snapex7.Client.get_stats(pid)
+        assert stats.commands.read_area.calls == 4
+        assert stats.commands.write_area.calls == 2
+
+        # late replies of timed out jobs are dropped
+        port = :sys.get_state(pid).port
+        send(pid, {port, {:data, <<?b, 1::32, 0::64, 1, 0xBE, 0xEF>>}})
+        send(pid, :unexpected)
+        assert Snapex7.Client.mb_read(pid, start: 8, amount: 2) == {:ok, <<0xBE, 0xEF>>}
+
+        Snapex7.Client.stop(pid)
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "shared memory data plane", state do
+    case state.status do
+      :connected ->
+        {:ok, server} = Snapex7.Server.start_link(ip: "127.0.0.1", port: 10117, areas: [DB: [{1, 1024}]])
+        {:ok, pid} = Snapex7.Client.start_link(shm: [slots: 2, slot_size: 1024])
+        :ok = Snapex7.Client.connect_to(pid, Snapex7.Server.connect_opts(server))
+        region = :sys.get_state(pid).shm
+        assert is_reference(region)
+
+        data = :binary.copy(<<0xA5>>, 1000)
+        assert Snapex7.Client.db_write(pid, db_number: 1, start: 0, amount: 1000, data: data) == :ok
+
+        # more replies through the slots than slots, each one is freed once taken
+        for _ <- 1..4 do
+          assert Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: 1000) == {:ok, data}
+        end
+
+        # the port is stuck past the deadline of a read waiting for the PLC
+        server_os_pid = os_pid(:sys.get_state(server).port)
+        port_os_pid = os_pid(:sys.get_state(pid).port)
+        kill("-STOP", server_os_pid)
+        late = Task.async(fn -> Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: 1000, timeout: 200) end)
+        Process.sleep(100)
+        kill("-STOP", port_os_pid)
+        kill("-CONT", server_os_pid)
+        assert Task.await(late) == {:error, :timeout}
+
+        # its late reply goes through a slot, the client frees it
+        kill("-CONT", port_os_pid)
+        assert Snapex7.Client.db_read(pid, db_number: 1, start: 0, amount: 1000) == {:ok, data}
+        _ = :sys.get_state(pid)
+        assert Snapex7.Shm.take(region, 0, 1) == {:error, :empty}
+        assert Snapex7.Shm.take(region, 1, 1) == {:error, :empty}
+
+        Snapex7.Client.stop(pid)
+        Snapex7.Server.stop(server)
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "nif backend", state do
+    case state.status do
+      :connected ->
+        {:ok, pid} = Snapex7.Client.start_link(backend: :nif)
+        :ok = Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts())
+        assert Snapex7.Client.get_connected(pid) == {:ok, true}
+
+        resp = Snapex7.Client.db_write(pid, db_number: 1, start: 24, amount: 4, data: <<5, 6, 7, 8>>)
+        assert resp == :ok
+        assert Snapex7.Client.db_read(pid, db_number: 1, start: 24, amount: 4) == {:ok, <<5, 6, 7, 8>>}
+        assert Snapex7.Client.db_read(state.pid, db_number: 1, start: 24, amount: 4) == {:ok, <<5, 6, 7, 8>>}
+
+        assert Snapex7.Client.mb_write(pid, start: 10, amount: 2, data: <<0xCA, 0xFE>>) == :ok
+        assert Snapex7.Client.mb_read(pid, start: 10, amount: 2) == {:ok, <<0xCA, 0xFE>>}
+        assert {:error, %{}} = Snapex7.Client.db_read(pid, db_number: 99, start: 0, amount: 4)
+
+        resp =
+          Snapex7.Client.batch(pid, [
+            {:db_read, [db_number: 1, start: 24, amount: 2]},
+            {:mb_read, [start: 10, amount: 2]}
+          ])
+
+        assert resp == {:ok, [{:ok, <<5, 6>>}, {:ok, <<0xCA, 0xFE>>}]}
+
+        # port only commands
+        assert Snapex7.Client.get_stats(pid) == {:error, :enotsup}
+
+        Snapex7.Client.stop(pid)
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "malformed requests are answered without restarting the port", state do
+    case state.status do
+      :connected ->
+        port = :sys.get_state(state.pid).port
+
+        resp = Snapex7.Client.db_write(state.pid, db_number: 1, start: 0, amount: 4, data: <<1, 2>>)
+        assert resp == {:error, :einval}
+
+        resp = Snapex7.Client.read_area(state.pid, area: :DB, word_len: :d_word, db_number: 1, start: 0, amount: 100_000)
+        assert resp == {:error, :einval}
+
+        var = %{area: :DB, word_len: :byte, db_number: 1, start: 0, amount: 1}
+        assert Snapex7.Client.read_multi_vars(state.pid, data: List.duplicate(var, 21)) == {:error, :einval}
+
+        resp = Snapex7.Client.write_multi_vars(state.pid, data: [Map.put(var, :data, <<1, 2, 3>>)])
+        assert resp == {:error, :einval}
+
+        assert Snapex7.Client.list_blocks_of_type(state.pid, :OB, 0) == {:error, :einval}
+        assert Snapex7.Client.list_blocks_of_type(state.pid, :OB, 0x8001) == {:error, :einval}
+
+        # same port and PLC session
+        assert :sys.get_state(state.pid).port == port
+        assert Snapex7.Client.db_write(state.pid, db_number: 1, start: 0, amount: 2, data: <<1, 2>>) == :ok
+        assert Snapex7.Client.db_read(state.pid, db_number: 1, start: 0, amount: 2) == {:ok, <<1, 2>>}
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  defp os_pid(port) do
+    {:os_pid, os_pid} = Port.info(port, :os_pid)
+    os_pid
+  end
+
+  # stops/resumes a C port
+  defp kill(signal, os_pid) do
+    {_, 0} = System.cmd("kill", [signal, to_string(os_pid)])
+    :ok
+  end
+
+  defp wait_for_empty_queue(pid) do
+    case Process.info(pid, :message_queue_len) do
+      {:message_queue_len, 0} -> :ok
+      _ ->
+        Process.sleep(1)
+        wait_for_empty_queue(pid)
+    end
+  end
+
+  defp wait_for_queue(pid, n) do
+    case Process.info(pid, :message_queue_len) do
+      {:message_queue_len, len} when len >= n -> :ok
+      _ ->
+        Process.sleep(1)
+        wait_for_queue(pid, n)
+    end
+  end
 end
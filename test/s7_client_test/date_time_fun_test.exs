@@ -2,9 +2,11 @@ defmodule DateTimeFunTest do
   use ExUnit.Case
   doctest Snapex7
 
-  setup do
+  @moduletag :plc
+
+  setup context do
     {:ok, pid} = Snapex7.Client.start_link()
-    Snapex7.Client.connect_to(pid, ip: "192.168.0.1", rack: 0, slot: 1)
+    Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts(context))
     {:ok, state} = :sys.get_state(pid) |> Map.fetch(:state)
     %{pid: pid, status: state}
   end
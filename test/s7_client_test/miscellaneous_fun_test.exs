@@ -2,9 +2,9 @@ defmodule MiscellaneousFunTest do
   use ExUnit.Case
   doctest Snapex7
 
-  setup do
+  setup context do
     {:ok, pid} = Snapex7.Client.start_link()
-    Snapex7.Client.connect_to(pid, ip: "192.168.0.1", rack: 0, slot: 1)
+    Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts(context))
     {:ok, state} = :sys.get_state(pid) |> Map.fetch(:state)
     %{pid: pid, status: state}
   end
@@ -20,6 +20,7 @@ defmodule MiscellaneousFunTest do
     end
   end
 
+  @tag :plc
   test "get_last_error function", state do
     case state.status do
       :connected ->
@@ -32,6 +33,7 @@ defmodule MiscellaneousFunTest do
     end
   end
 
+  @tag :plc
   test "get_pdu_length function", state do
     case state.status do
       :connected ->
@@ -53,4 +55,155 @@ defmodule MiscellaneousFunTest do
         IO.puts("(#{__MODULE__}) Not connected")
     end
   end
+
+  test "get_stats function", state do
+    case state.status do
+      :connected ->
+        {:ok, _data} = Snapex7.Client.db_read(state.pid, db_number: 1, start: 0, amount: 4)
+        {:error, _reason} = Snapex7.Client.db_read(state.pid, db_number: 99, start: 0, amount: 4)
+
+        {:ok, stats} = Snapex7.Client.get_stats(state.pid, reset: true)
+        assert %{calls: 2, errors: 1, plc_io: plc_io} = stats.commands.db_read
+        assert plc_io.count == 2
+        assert plc_io.min <= plc_io.p50 and plc_io.p50 <= plc_io.max
+        assert stats.bytes_in > 0 and stats.bytes_out > 0
+        assert stats.errors.es7 |> Map.values() |> Enum.sum() >= 1
+
+        {:ok, stats} = Snapex7.Client.get_stats(state.pid)
+        assert Map.keys(stats.commands) == [:get_stats]
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "telemetry events for port calls", state do
+    case state.status do
+      :connected ->
+        test_pid = self()
+        handler_id = "#{__MODULE__}-telemetry"
+
+        :telemetry.attach_many(
+          handler_id,
+          [[:snapex7, :client, :call, :start], [:snapex7, :client, :call, :stop]],
+          fn event, measurements, metadata, _config ->
+            send(test_pid, {:telemetry, event, measurements, metadata})
+          end,
+          nil
+        )
+
+        {:ok, _data} = Snapex7.Client.db_read(state.pid, db_number: 1, start: 0, amount: 4)
+        :telemetry.detach(handler_id)
+
+        assert_received {:telemetry, [:snapex7, :client, :call, :start], _, %{command: :db_read}}
+        assert_received {:telemetry, [:snapex7, :client, :call, :stop], measurements, metadata}
+        assert %{command: :db_read, result: :ok, payload_size: size} = metadata
+        assert metadata.ip == Snapex7.LoopbackPLC.connect_opts(state)[:ip]
+        assert size > 0
+        assert measurements.exec_time > 0
+        assert measurements.queue_wait >= 0
+        assert measurements.duration >= measurements.exec_time
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "overdue requests time out without desynchronizing the client", state do
+    case state.status do
+      :connected ->
+        request = {:db_read, [db_number: 1, start: 0, amount: 4]}
+        assert Snapex7.Client.command(state.pid, request, 0) == {:error, :timeout}
+        assert {:ok, <<_::binary-size(4)>>} = Snapex7.Client.command(state.pid, request, 1000)
+
+        assert {:ok, <<_::binary-size(4)>>} =
+                 Snapex7.Client.db_read(state.pid, db_number: 1, start: 0, amount: 4, timeout: 1000)
+
+        {:ok, stats} = Snapex7.Client.get_stats(state.pid)
+        assert stats.errors.other >= 1
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "batch function", state do
+    case state.status do
+      :connected ->
+        requests = [
+          :get_connected,
+          {:db_write, [db_number: 2, start: 40, amount: 2, data: <<0x12, 0x34>>]},
+          {:db_read, [db_number: 99, start: 0, amount: 2]},
+          {:db_read, [db_number: 2, start: 40, amount: 2]}
+        ]
+
+        assert {:ok, [{:ok, true}, :ok, {:error, _reason}, {:ok, <<0x12, 0x34>>}]} =
+                 Snapex7.Client.batch(state.pid, requests)
+
+        assert {:ok, [{:ok, true}, :ok, {:error, _reason}]} =
+                 Snapex7.Client.batch(state.pid, requests, stop_on_error: true)
+
+        assert Snapex7.Client.batch(state.pid, []) == {:ok, []}
+        assert Snapex7.Client.batch(state.pid, [:get_connected, :disconnect]) == {:error, :einval}
+
+        {:ok, stats} = Snapex7.Client.get_stats(state.pid)
+        assert stats.commands.batch.calls == 3
+        assert stats.commands.get_connected.calls >= 2
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "rate limited clients wait for the budget of the PLC", state do
+    case state.status do
+      :connected ->
+        {:ok, pid} = Snapex7.Client.start_link(rate_limit: [pdus: 20, burst: 0])
+        :ok = Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts(state))
+        opts = [db_number: 1, start: 0, amount: 4]
+
+        started_at = System.monotonic_time(:millisecond)
+        for _ <- 1..6, do: {:ok, _data} = Snapex7.Client.db_read(pid, opts)
+        # a PDU every 50 ms
+        assert System.monotonic_time(:millisecond) - started_at >= 250
+
+        # realtime requests are charged without waiting, the next ones can't make it in time
+        {:ok, _data} = Snapex7.Client.db_read(pid, [priority: :realtime] ++ opts)
+        for _ <- 1..4, do: {:ok, _data} = Snapex7.Client.db_read(pid, [priority: :realtime] ++ opts)
+        assert Snapex7.Client.db_read(pid, [timeout: 50] ++ opts) == {:error, :timeout}
+
+        {:ok, stats} = Snapex7.Client.get_stats(pid)
+        assert %{delayed: delayed, timeouts: 1, pdus: used, bytes: nil} = stats.rate_limit
+        assert delayed >= 5
+        assert used > 1.0
+        Snapex7.Client.stop(pid)
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
+
+  test "requests waiting for the budget don't hold up the client", state do
+    case state.status do
+      :connected ->
+        {:ok, pid} = Snapex7.Client.start_link(rate_limit: [pdus: 10, burst: 0, bulk_share: 0.1])
+        :ok = Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts(state))
+        opts = [db_number: 1, start: 0, amount: 4]
+
+        # a bulk PDU a second
+        {:ok, _data} = Snapex7.Client.db_read(pid, [priority: :bulk] ++ opts)
+        bulk = Task.async(fn -> Snapex7.Client.db_read(pid, [priority: :bulk] ++ opts) end)
+        Process.sleep(50)
+
+        {time, {:ok, _data}} = :timer.tc(fn -> Snapex7.Client.db_read(pid, [priority: :realtime] ++ opts) end)
+        assert time < 500_000
+        assert {:ok, _data} = Task.await(bulk)
+
+        assert_raise ArgumentError, fn -> Snapex7.RateLimit.new(bulk_share: 0) end
+        Snapex7.Client.stop(pid)
+
+      _ ->
+        IO.puts("(#{__MODULE__}) Not connected")
+    end
+  end
 end
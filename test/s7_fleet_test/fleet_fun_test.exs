@@ -0,0 +1,25 @@
+defmodule FleetFunTest do
+  use ExUnit.Case, async: false
+  doctest Snapex7
+
+  test "plcs connect in parallel with their latency" do
+    loopback = Snapex7.LoopbackPLC.connect_opts()
+    plcs = for n <- 1..6, do: {n, loopback}
+    # nothing listens there
+    plcs = plcs ++ [{:down, Keyword.put(loopback, :port, 1)}]
+
+    results = Snapex7.Fleet.connect(plcs, max_concurrency: 3, jitter: 20, timeout: 1000)
+    assert Enum.map(results, &elem(&1, 0)) == [1, 2, 3, 4, 5, 6, :down]
+
+    for {n, result, latency} <- results, n != :down do
+      assert {:ok, client} = result
+      assert is_integer(latency)
+      assert Snapex7.Client.get_connected(client) == {:ok, true}
+      # connected from a task, it notifies the caller
+      assert :sys.get_state(client).controlling_process == self()
+      Snapex7.Client.stop(client)
+    end
+
+    assert {:down, {:error, _reason}, _latency} = List.last(results)
+  end
+end
@@ -0,0 +1,63 @@
+defmodule PoolFunTest do
+  use ExUnit.Case, async: false
+  doctest Snapex7
+
+  setup do
+    {:ok, pool} = Snapex7.Pool.start_link(size: 3, connect: Snapex7.LoopbackPLC.connect_opts())
+    on_exit(fn -> if Process.alive?(pool), do: Snapex7.Pool.stop(pool) end)
+    %{pool: pool}
+  end
+
+  test "every session is connected", state do
+    sessions = Snapex7.Pool.sessions(state.pool)
+    assert length(sessions) == 3
+    assert Enum.uniq(sessions) == sessions
+
+    for session <- sessions do
+      assert Snapex7.Client.get_connected(session) == {:ok, true}
+    end
+  end
+
+  test "concurrent reads through the pool", state do
+    :ok = Snapex7.Server.write_area(Snapex7.LoopbackPLC, :DB, 1, 0, <<1, 2, 3, 4>>)
+
+    results =
+      1..30
+      |> Task.async_stream(fn _ ->
+        Snapex7.Pool.db_read(state.pool, db_number: 1, start: 0, amount: 4)
+      end)
+      |> Enum.map(fn {:ok, resp} -> resp end)
+
+    assert Enum.all?(results, &(&1 == {:ok, <<1, 2, 3, 4>>}))
+  end
+
+  test "busy sessions are skipped", state do
+    test_pid = self()
+
+    busy =
+      Task.async(fn ->
+        Snapex7.Pool.run(state.pool, fn session ->
+          send(test_pid, {:busy, session})
+
+          receive do
+            :release -> :ok
+          end
+        end)
+      end)
+
+    assert_receive {:busy, busy_session}
+    free_session = Snapex7.Pool.run(state.pool, & &1)
+    assert free_session != busy_session
+
+    send(busy.pid, :release)
+    assert Task.await(busy) == :ok
+  end
+
+  test "writes and command requests", state do
+    resp = Snapex7.Pool.db_write(state.pool, db_number: 2, start: 0, amount: 2, data: <<0xCA, 0xFE>>)
+    assert resp == :ok
+
+    resp = Snapex7.Pool.command(state.pool, {:db_read, [db_number: 2, start: 0, amount: 2]})
+    assert resp == {:ok, <<0xCA, 0xFE>>}
+  end
+end
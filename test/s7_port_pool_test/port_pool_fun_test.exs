@@ -0,0 +1,34 @@
+defmodule PortPoolFunTest do
+  use ExUnit.Case, async: false
+  doctest Snapex7
+
+  setup do
+    {:ok, pool} = Snapex7.PortPool.start_link(size: 2, name: :test_port_pool)
+    on_exit(fn -> if Process.alive?(pool), do: Snapex7.PortPool.stop(pool) end)
+    %{pool: pool}
+  end
+
+  test "clients check out warm ports", state do
+    assert Snapex7.PortPool.available(state.pool) == 2
+    {:ok, pid} = Snapex7.Client.start_link(port_pool: :test_port_pool)
+    :ok = Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts())
+
+    :ok = Snapex7.Server.write_area(Snapex7.LoopbackPLC, :DB, 1, 40, <<9, 8>>)
+    assert Snapex7.Client.db_read(pid, db_number: 1, start: 40, amount: 2) == {:ok, <<9, 8>>}
+
+    # the port moved to the client and the pool spawned another one
+    port = :sys.get_state(pid).port
+    assert Port.info(port, :connected) == {:connected, pid}
+    assert Snapex7.PortPool.available(state.pool) == 2
+
+    Snapex7.Client.stop(pid)
+  end
+
+  test "clients spawn their own port without warm ones", state do
+    :ok = Snapex7.PortPool.stop(state.pool)
+    {:ok, pid} = Snapex7.Client.start_link(port_pool: :test_port_pool)
+    :ok = Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts())
+    assert Snapex7.Client.get_connected(pid) == {:ok, true}
+    Snapex7.Client.stop(pid)
+  end
+end
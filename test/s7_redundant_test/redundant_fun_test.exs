@@ -0,0 +1,113 @@
+defmodule RedundantFunTest do
+  use ExUnit.Case, async: false
+  doctest Snapex7
+
+  setup do
+    {:ok, cpu_0} = Snapex7.Server.start_link(ip: "127.0.0.1", port: 10115, areas: [DB: [{1, 16}]])
+    {:ok, cpu_1} = Snapex7.Server.start_link(ip: "127.0.0.1", port: 10116, areas: [DB: [{1, 16}]])
+    :ok = Snapex7.Server.write_area(cpu_0, :DB, 1, 0, <<0, 0>>)
+    :ok = Snapex7.Server.write_area(cpu_1, :DB, 1, 0, <<1, 1>>)
+
+    on_exit(fn ->
+      for server <- [cpu_0, cpu_1], Process.alive?(server), do: Snapex7.Server.stop(server)
+    end)
+
+    %{cpus: [Snapex7.Server.connect_opts(cpu_0), Snapex7.Server.connect_opts(cpu_1)], servers: {cpu_0, cpu_1}}
+  end
+
+  test "reads go to the master and fail over to the standby", state do
+    {:ok, h} = Snapex7.Redundant.start_link(cpus: state.cpus, check_interval: 100)
+    [session_0, session_1] = Snapex7.Redundant.sessions(h)
+    assert Snapex7.Redundant.master(h) == session_0
+    assert Snapex7.Client.get_connected(session_1) == {:ok, true}
+    assert Snapex7.Redundant.db_read(h, db_number: 1, start: 0, amount: 2) == {:ok, <<0, 0>>}
+
+    :ok = Snapex7.Server.stop(elem(state.servers, 0))
+    # the request failing on the master is sent again to the standby
+    assert Snapex7.Redundant.db_read(h, db_number: 1, start: 0, amount: 2) == {:ok, <<1, 1>>}
+    assert Snapex7.Redundant.master(h) == session_1
+    Snapex7.Redundant.stop(h)
+  end
+
+  test "writes are mirrored by policy", state do
+    {:ok, h} = Snapex7.Redundant.start_link(cpus: state.cpus, writes: :mirror)
+    assert Snapex7.Redundant.db_write(h, db_number: 1, start: 0, amount: 2, data: <<7, 7>>) == :ok
+
+    for server <- Tuple.to_list(state.servers) do
+      assert Snapex7.Server.read_area(server, :DB, 1, 0, 2) == {:ok, <<7, 7>>}
+    end
+
+    Snapex7.Redundant.stop(h)
+  end
+
+  test "a mirrored write isn't sent twice when the master fails", state do
+    {:ok, h} = Snapex7.Redundant.start_link(cpus: state.cpus, writes: :mirror)
+    [_session_0, session_1] = Snapex7.Redundant.sessions(h)
+
+    :ok = Snapex7.Server.stop(elem(state.servers, 0))
+    assert Snapex7.Redundant.db_write(h, db_number: 1, start: 0, amount: 2, data: <<8, 8>>) == :ok
+    assert Snapex7.Server.read_area(elem(state.servers, 1), :DB, 1, 0, 2) == {:ok, <<8, 8>>}
+    assert Snapex7.Redundant.master(h) == session_1
+    Snapex7.Redundant.stop(h)
+  end
+
+  test "reconnected sessions still tell a dead master", state do
+    health = [keepalive: {1000, 1000, 3}, probe_interval: 100, probe_timeout: 200]
+    # only the dead peer notifications switch over
+    opts = [cpus: state.cpus, check_interval: 100, master?: fn _session -> true end, client_opts: [health: health]]
+    {:ok, h} = Snapex7.Redundant.start_link(opts)
+    [session_0, session_1] = Snapex7.Redundant.sessions(h)
+    {cpu_0, cpu_1} = state.servers
+
+    :ok = Snapex7.Server.stop(cpu_0)
+    assert wait_for_master(h, session_1) == session_1
+
+    # a check reconnects CPU 0, which is master again once CPU 1 dies
+    cpu_0 = start_cpu(10115)
+    assert wait_for_connected(h, {true, true}) == {true, true}
+    :ok = Snapex7.Server.stop(cpu_1)
+    assert wait_for_master(h, session_0) == session_0
+
+    # the session reconnected by the check tells the switchover
+    cpu_1 = start_cpu(10116)
+    assert wait_for_connected(h, {true, true}) == {true, true}
+    :ok = Snapex7.Server.stop(cpu_0)
+    assert wait_for_master(h, session_1) == session_1
+
+    Snapex7.Redundant.stop(h)
+    Snapex7.Server.stop(cpu_1)
+  end
+
+  test "no cpu connects" do
+    Process.flag(:trap_exit, true)
+    down = [ip: "127.0.0.1", port: 1]
+    assert Snapex7.Redundant.start_link(cpus: [down, down]) == {:error, :no_cpu}
+  end
+
+  defp start_cpu(port) do
+    {:ok, server} = Snapex7.Server.start_link(ip: "127.0.0.1", port: port, areas: [DB: [{1, 16}]])
+    server
+  end
+
+  defp wait_for_master(h, session, retries \\ 100) do
+    case Snapex7.Redundant.master(h) do
+      master when master == session or retries == 0 ->
+        master
+
+      _master ->
+        Process.sleep(20)
+        wait_for_master(h, session, retries - 1)
+    end
+  end
+
+  defp wait_for_connected(h, connected, retries \\ 100) do
+    case :sys.get_state(h).connected do
+      current when current == connected or retries == 0 ->
+        current
+
+      _current ->
+        Process.sleep(20)
+        wait_for_connected(h, connected, retries - 1)
+    end
+  end
+end
@@ -0,0 +1,101 @@
+defmodule SchedulerFunTest do
+  use ExUnit.Case, async: false
+  doctest Snapex7
+
+  @db_read {:db_read, [db_number: 2, start: 40, amount: 4]}
+
+  setup do
+    clients =
+      for _ <- 1..2 do
+        {:ok, client} = Snapex7.Client.start_link()
+        :ok = Snapex7.Client.connect_to(client, Snapex7.LoopbackPLC.connect_opts())
+        client
+      end
+
+    :ok = Snapex7.Server.write_area(Snapex7.LoopbackPLC, :DB, 2, 40, <<1, 2, 3, 4>>)
+    on_exit(fn -> for client <- clients, Process.alive?(client), do: Snapex7.Client.stop(client) end)
+    %{clients: clients}
+  end
+
+  test "groups are polled at their cycle with stats", %{clients: [client_1, client_2]} do
+    test_pid = self()
+    {:ok, _cache} = Snapex7.Cache.start_link(name: :scheduler_cache, client: client_1)
+
+    {:ok, scheduler} =
+      Snapex7.Scheduler.start_link(
+        cache: :scheduler_cache,
+        on_result: fn group, result -> send(test_pid, {group, result}) end,
+        groups: [
+          fast: [client: client_1, request: @db_read, cycle: 20],
+          slow: [client: client_2, request: @db_read, cycle: 100, deadline: 50],
+          shared: [client: client_1, request: {:mb_read, [start: 0, amount: 2]}, cycle: 20]
+        ]
+      )
+
+    assert_receive {:fast, {:ok, <<1, 2, 3, 4>>}}, 500
+    assert_receive {:slow, {:ok, <<1, 2, 3, 4>>}}, 500
+    assert_receive {:shared, {:ok, <<_::16>>}}, 500
+    assert Snapex7.Cache.get(:scheduler_cache, :fast) == {:ok, <<1, 2, 3, 4>>}
+
+    Process.sleep(300)
+    stats = Snapex7.Scheduler.stats(scheduler, reset: true)
+    assert stats.fast.runs > stats.slow.runs
+    assert stats.slow.runs >= 2
+    assert %{min: _, max: _, mean: _} = stats.fast.jitter
+    assert stats.fast.duration.max >= stats.fast.duration.min
+
+    assert Snapex7.Scheduler.stats(scheduler).slow.runs <= 1
+    Snapex7.Scheduler.stop(scheduler)
+    Snapex7.Cache.stop(:scheduler_cache)
+  end
+
+  test "overruns skip releases", %{clients: [client, _client]} do
+    # a slow consumer keeps the scheduler busy for several cycles
+    {:ok, scheduler} =
+      Snapex7.Scheduler.start_link(
+        on_result: fn _group, _result -> Process.sleep(50) end,
+        groups: [busy: [client: client, request: @db_read, cycle: 10]]
+      )
+
+    Process.sleep(300)
+    stats = Snapex7.Scheduler.stats(scheduler)
+    assert stats.busy.runs > 0
+    assert stats.busy.skipped > 0
+    Snapex7.Scheduler.stop(scheduler)
+  end
+
+  @tag capture_log: true
+  test "a crashing poll doesn't stop the scheduler", %{clients: [client, _client]} do
+    {:ok, scheduler} =
+      Snapex7.Scheduler.start_link(
+        groups: [
+          broken: [client: client, request: {:db_read, [timeout: :bad]}, cycle: 20],
+          fine: [client: client, request: @db_read, cycle: 20]
+        ]
+      )
+
+    Process.sleep(200)
+    assert Process.alive?(scheduler)
+    assert Snapex7.Scheduler.stats(scheduler).fine.runs > 2
+    Snapex7.Scheduler.stop(scheduler)
+  end
+
+  test "unchanged values lengthen the cycle up to max_cycle", %{clients: [client, _client]} do
+    test_pid = self()
+
+    {:ok, scheduler} =
+      Snapex7.Scheduler.start_link(
+        on_result: fn group, result -> send(test_pid, {group, result}) end,
+        groups: [recipe: [client: client, request: @db_read, cycle: 10, max_cycle: 80]]
+      )
+
+    Process.sleep(400)
+    assert Snapex7.Scheduler.stats(scheduler).recipe.cycle == 80
+
+    :ok = Snapex7.Server.write_area(Snapex7.LoopbackPLC, :DB, 2, 40, <<5, 6, 7, 8>>)
+    assert_receive {:recipe, {:ok, <<5, 6, 7, 8>>}}, 500
+    # back to the fast rate
+    assert Snapex7.Scheduler.stats(scheduler).recipe.cycle <= 20
+    Snapex7.Scheduler.stop(scheduler)
+  end
+end
@@ -0,0 +1,37 @@
+defmodule ServerFunTest do
+  use ExUnit.Case, async: false
+  doctest Snapex7
+
+  setup do
+    {:ok, pid} = Snapex7.Client.start_link()
+    :ok = Snapex7.Client.connect_to(pid, Snapex7.LoopbackPLC.connect_opts())
+    %{pid: pid, server: Snapex7.LoopbackPLC}
+  end
+
+  test "server data is visible to the client", state do
+    resp = Snapex7.Server.write_area(state.server, :DB, 2, 10, <<0xDE, 0xAD, 0xBE, 0xEF>>)
+    assert resp == :ok
+
+    {:ok, resp_bin} = Snapex7.Client.db_read(state.pid, db_number: 2, start: 10, amount: 4)
+    assert resp_bin == <<0xDE, 0xAD, 0xBE, 0xEF>>
+  end
+
+  test "client writes are visible to the server", state do
+    resp = Snapex7.Client.mb_write(state.pid, start: 4, amount: 2, data: <<0x12, 0x34>>)
+    assert resp == :ok
+
+    {:ok, resp_bin} = Snapex7.Server.read_area(state.server, :MK, 4, 2)
+    assert resp_bin == <<0x12, 0x34>>
+  end
+
+  test "unknown areas are rejected", state do
+    resp = Snapex7.Server.read_area(state.server, :DB, 99, 0, 4)
+    assert resp == {:error, :enoent}
+  end
+
+  test "get_status function", state do
+    {:ok, status} = Snapex7.Server.get_status(state.server)
+    assert status.server_status == :SrvRunning
+    assert status.clients_count >= 1
+  end
+end
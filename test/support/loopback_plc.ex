@@ -0,0 +1,33 @@
+defmodule Snapex7.LoopbackPLC do
+  @moduledoc false
+
+  # Loopback S7 server shared by the whole test suite, so the client tests
+  # don't need a real PLC. Tests tagged with `:plc` still talk to the
+  # hardware at @plc_ip (run them with `mix test --include plc`).
+
+  @plc_ip "192.168.0.1"
+
+  @areas [
+    DB: [{1, 256}, {2, 256}],
+    MK: 256,
+    PE: 256,
+    PA: 256,
+    TM: 256,
+    CT: 256
+  ]
+
+  def start do
+    port = System.get_env("SNAPEX7_LOOPBACK_PORT", "10102") |> String.to_integer()
+
+    {:ok, _pid} =
+      Snapex7.Server.start_link([ip: "127.0.0.1", port: port, areas: @areas], name: __MODULE__)
+
+    :ok
+  end
+
+  def connect_opts(context \\ %{})
+
+  def connect_opts(%{plc: true}), do: [ip: @plc_ip, rack: 0, slot: 1]
+
+  def connect_opts(_context), do: Snapex7.Server.connect_opts(__MODULE__)
+end
@@ -1 +1,2 @@
-ExUnit.start()
+:ok = Snapex7.LoopbackPLC.start()
+ExUnit.start(exclude: [:plc])